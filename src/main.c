@@ -3,15 +3,55 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <strings.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <errno.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#if defined(__APPLE__)
+#include <sys/time.h>
+#include <sys/sysctl.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_F16C_DISPATCH 1
+#endif
 
 #define TRUE 1
 #define FALSE 0
 #define IMAGE_READ_BUFFER_SIZE 1024
+#define P6_BAND_BYTES (8 * 1024 * 1024)
 
 #define ERR_INVALID_FILE "Error: The source file is not a valid PPM3 or PPM6 file\n"
 #define ERR_UNEXPECTED_EOF "Error: Unexpected EOF\n"
 #define ERR_OPEN_FILE_READING "Error: Could not open source file for reading '%s'\n"
 
+#ifndef GL_SRGB8
+#define GL_SRGB8 0x8C41
+#endif
+#ifndef GL_RGB16
+#define GL_RGB16 0x8054
+#endif
+#ifndef GL_RGB16F_ARB
+#define GL_RGB16F_ARB 0x881B
+#endif
+#ifndef GL_HALF_FLOAT_ARB
+#define GL_HALF_FLOAT_ARB 0x140B
+#endif
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
 /**
  * RGB Pixel
  */
@@ -20,21 +60,82 @@ typedef struct RGBpixel {
 } RGBpixel;
 
 /**
- * Image
+ * Pixel storage formats
+ */
+typedef enum PixelFormat {
+    PIXEL_FORMAT_FLOAT,
+    PIXEL_FORMAT_U16,
+    PIXEL_FORMAT_HALF
+} PixelFormat;
+
+/**
+ * Pixel layouts. Interleaved pixels keep the three samples of a pixel side
+ * by side, planar images keep every red sample, then every green sample,
+ * then every blue sample, so per channel loops run over contiguous floats
+ * without shuffles. Only PIXEL_FORMAT_FLOAT images can be planar.
+ */
+typedef enum PixelLayout {
+    LAYOUT_INTERLEAVED,
+    LAYOUT_PLANAR
+} PixelLayout;
+
+/**
+ * Image, PIXEL_FORMAT_FLOAT images keep their pixels in pixmap while
+ * PIXEL_FORMAT_U16 and PIXEL_FORMAT_HALF images keep three samples per pixel
+ * in pixmap16. Raw samples may still be in the big endian byte order of the
+ * file, half floats are always in host order. capacity is the size of the
+ * pixel buffer when it came from image_allocate and 0 otherwise, alignment
+ * is the guaranteed alignment of the start of the buffer in bytes and 0 when
+ * only malloc's alignment is guaranteed.
  */
 typedef struct Image {
     uint32_t width, height;
+    PixelFormat format;
+    PixelLayout layout;
+    int color_max;
+    int big_endian_samples;
     RGBpixel* pixmap;
+    uint16_t* pixmap16;
+    size_t capacity;
+    size_t alignment;
 } Image;
 
 /**
  * Show a simple help message about the usage of this program
  */
 void show_help() {
-    printf("Usage: ezview <input.ppm>\n");
+    printf("Usage: ezview [options] <input.ppm>\n");
+    printf("       ezview [options] <directory | input.ppm ...>\n");
+    printf("       ezview --convert [options] -o <directory> <directory | input.ppm ...>\n");
+    printf("       ezview --generate [options] <output.ppm | ->\n");
+    printf("       ezview --benchmark [options] [input.ppm ...]\n");
     printf("\t input.ppm: The input image PPM file\n");
+    printf("\t directory: A directory of PPM files to show as a contact sheet\n");
+    printf("\n");
+    printf("\t Options:\n");
+    printf("\t\t     --easing <curve> - Transform easing: linear, quad, cubic (default), smooth, expo\n");
+    printf("\t\t --duration <seconds> - Transform animation length (default 0.25)\n");
+    printf("\t\t   --histogram <bins> - Print image statistics with a 256 or 4096 bin histogram\n");
+    printf("\t\t              --stats - Print memory use on exit\n");
+    printf("\t\t   --trace <out.json> - Record load, upload and frame times in Chrome trace format\n");
+    printf("\t\t        --first-frame - Load, show one frame and exit, printing how long each step took\n");
+    printf("\t\t            --verbose - Print the shader sources and where the shader program came from\n");
+    printf("\t\t   --residency <mode> - Host copy after upload: keep (default), drop, or spill\n");
+    printf("\t\t           --compress - Upload 8 bit images as BC1 compressed textures\n");
+    printf("\t\t        --srgb <mode> - Filter in linear light: texture (GL_SRGB8) or decode (lookup table)\n");
+    printf("\t\t      --format <type> - Pixel storage: native (default, raw 16 bit samples), half, or float\n");
+    printf("\t\t      --filter <spec> - Filter before display: gaussian:<sigma>, box:<radius>, unsharp:<sigma>:<amount>\n");
+    printf("\t\t                --roi - Only decode the parts of a P6 file that are on screen\n");
+    printf("\t\t         --tiles <MB> - Keep a P6 file on disk and cache at most MB of decoded tiles\n");
+    printf("\t\t        --scale <x,y> - Initial scale\n");
+    printf("\t\t        --shear <x,y> - Initial shear\n");
+    printf("\t\t    --translate <x,y> - Initial translation\n");
+    printf("\t\t   --rotate <radians> - Initial rotation\n");
+    printf("\t\t   --export <out.ppm> - Write the transformed image at full resolution and exit\n");
     printf("\n");
     printf("\t Example: ezview test.ppm\n");
+    printf("\t Example: ezview renders/\n");
+    printf("\t Example: ezview --rotate 0.5 --export rotated.ppm test.ppm\n");
     printf("\n");
     printf("\t Controls:\n");
     printf("\t\t                WASD - Translation\n");
@@ -43,690 +144,7213 @@ void show_help() {
     printf("\t\t                  QE - Rotation\n");
     printf("\t\t Arrow Up/Arrow Down - Scale uniform\n");
     printf("\t\t      Mouse Scroll Y - Scale uniform by scroll amount\n");
+    printf("\t\t          Mouse Move - Show the pixel under the cursor in the title\n");
+    printf("\t\t                   R - Reset transform\n");
+    printf("\t\t                 1/2 - Brightness down/up\n");
+    printf("\t\t                 3/4 - Contrast down/up\n");
+    printf("\t\t                 5/6 - Gamma down/up\n");
+    printf("\t\t                 7/8 - Exposure down/up\n");
+    printf("\t\t               Z/X/C - Red/Green/Blue gain up, with Shift down\n");
+    printf("\t\t                   V - Toggle auto levels\n");
+    printf("\t\t           Backspace - Reset adjustments\n");
+    printf("\t\t                   O - Export the current view at full resolution\n");
+    printf("\t\t                   M - Print memory use\n");
 }
 
 /**
- * Increments the pointer past past comments in a PPM file
- * @param fp
+ * Check the byte order of this machine
+ * @return TRUE on little endian machines
+ */
+int host_is_little_endian() {
+    uint16_t one = 1;
+    return *(unsigned char*) &one == 1;
+}
+
+/**
+ * Convert a float to an IEEE binary16 half float, rounding to nearest even
+ * @param value
  * @return
  */
-int skip_comments(FILE* fp) {
-    int c;
-    char in_comment = FALSE;
-    while (TRUE) {
-        c = getc(fp);
-        if (c == EOF) {
-            fprintf(stderr, ERR_INVALID_FILE);
-            return 1;
-        }
-        if (in_comment) {
-            if (c == '\n' || c == '\r')
-                in_comment = FALSE;
-        }
-        else if (c == '#')
-            in_comment = TRUE;
-        else {
-            // We read one to far, move back one
-            fseek(fp, -1, SEEK_CUR);
-            return 0;
-        }
+uint16_t float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t mantissa = bits & 0x7FFFFF;
+    int exponent = (int) ((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t half;
+    uint32_t remainder;
+    uint32_t halfway;
+
+    // Infinity and NaN
+    if (exponent == 0xFF - 127 + 15)
+        return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+    // Too large, round to infinity
+    if (exponent >= 0x1F)
+        return sign | 0x7C00;
+    // Too small even for a denormal
+    if (exponent < -10)
+        return sign;
+    if (exponent <= 0) {
+        // Denormal, shift the implicit leading one into the mantissa
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        half = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
     }
-};
+    else {
+        half = ((uint32_t) exponent << 10) | (mantissa >> 13);
+        remainder = mantissa & 0x1FFF;
+        halfway = 0x1000;
+    }
+    // A carry out of the mantissa correctly bumps the exponent
+    if (remainder > halfway || (remainder == halfway && (half & 1)))
+        half++;
+    return (uint16_t) (sign | half);
+}
 
 /**
- * Increments the pointer past whitespace AND comments in a PPM file
- * @param fp
+ * Convert an IEEE binary16 half float to a float
+ * @param half
  * @return
  */
-int skip_whitespace(FILE* fp) {
-    int c;
-    do {
-        c = getc(fp);
-        // make sure we didn't read to the EOF
-        if (c == EOF) {
-            fprintf(stderr, ERR_UNEXPECTED_EOF);
-            return 1;
-        }
-        if (c == '\n' || c == '\r') {
-            // read past any comments
-            if (skip_comments(fp) != 0)
-                return 1;
+float half_to_float(uint16_t half) {
+    uint32_t sign = (uint32_t) (half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t bits;
+    float value;
+
+    if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else if (exponent == 0 && mantissa == 0) {
+        bits = sign;
+    }
+    else if (exponent == 0) {
+        // Denormal, renormalize for the wider exponent
+        exponent = 113;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            exponent--;
         }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
     }
-    while(c == '\r' || // carriage return
-          c == '\n' || // newline
-          c == ' '  || // space
-          c == '\t'); // tab
-    // We read one to far, move back one
-    fseek(fp, -1, SEEK_CUR);
-    return 0;
+    else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    memcpy(&value, &bits, sizeof(value));
+    return value;
 }
 
+#ifdef HAVE_F16C_DISPATCH
 /**
- * Reads the contents of the current position in the file to the next whitespace character into the specified buffer
- * This function null terminates the buffer at the end of the read string
- * @param fp
- * @param buffer
- * @param buffer_size
- * @return
+ * F16C version of floats_to_halves converting 8 values per instruction
+ * @param src
+ * @param dst
+ * @param count
  */
-int read_to_whitespace(FILE* fp, char buffer[], int buffer_size) {
-    int c;
-    int pos = 0;
-    while (TRUE) {
-        if (pos > buffer_size - 1) {
-            fprintf(stderr, "Error: Buffer not large enough to finish reading to whitespace\n");
-            return -1;
-        }
-        c = getc(fp);
-        // make sure we didn't read to the EOF
-        if (c == EOF) {
-            fprintf(stderr, ERR_UNEXPECTED_EOF);
-            return -1;
-        }
-        if (c == '\r' || // carriage return
-            c == '\n' || // newline
-            c == ' '  || // space
-            c == '\t') { // tab
-            fseek(fp, -1, SEEK_CUR);
-            // add ASCIIZ, null terminate the string
-            buffer[pos] = '\0';
-            return pos;
-        }
-        buffer[pos++] = (char)c;
+__attribute__((target("avx,f16c")))
+static void floats_to_halves_f16c(const float* src, uint16_t* dst, size_t count) {
+    size_t i;
+    for (i=0; i + 8 <= count; i+=8)
+        _mm_storeu_si128((__m128i*) &dst[i], _mm256_cvtps_ph(_mm256_loadu_ps(&src[i]), _MM_FROUND_TO_NEAREST_INT));
+    for (; i<count; i++)
+        dst[i] = float_to_half(src[i]);
+}
+#endif
+
+/**
+ * Convert a run of floats to half floats, using F16C when the processor has it
+ * @param src
+ * @param dst
+ * @param count
+ */
+void floats_to_halves(const float* src, uint16_t* dst, size_t count) {
+    size_t i;
+#ifdef HAVE_F16C_DISPATCH
+    if (__builtin_cpu_supports("f16c")) {
+        floats_to_halves_f16c(src, dst, count);
+        return;
     }
-};
+#endif
+    for (i=0; i<count; i++)
+        dst[i] = float_to_half(src[i]);
+}
 
 /**
- * Load a PPM P3 file into an image
- * @param fp
- * @param image_ptr
- * @param color_max
- * @param buffer
- * @return
+ * Thread Pool Task
  */
-int image_load_p3(FILE* fp, Image* image_ptr, int color_max, char buffer[]) {
-    int height = image_ptr->height;
-    int width = image_ptr->width;
-    // Allocate space for the image in memory
-    image_ptr->pixmap = malloc(sizeof(RGBpixel) * width * height);
+typedef struct PoolTask {
+    void (*fn)(void* arg);
+    void* arg;
+} PoolTask;
 
-    // Read the actual image in
-    int i;
-    int j;
-    int k;
-    float value;
-    int bytes_read;
-    for (i=0; i<height; i++) {
-        for (j=0; j<width; j++) {
-            for (k=0; k<3; k++) {
-                // Read past the comments and whitespace
-                if (skip_whitespace(fp) != 0) {
-                    fprintf(stderr, "Error: An error occurred skipping file whitespace\n");
-                    return 1;
-                }
+/**
+ * Thread Pool, a fixed set of worker threads pulling tasks off a bounded
+ * queue. Submitting to a full queue blocks the caller until a worker frees
+ * a slot, this keeps producers from running arbitrarily far ahead.
+ */
+typedef struct ThreadPool {
+    pthread_t* threads;
+    int thread_count;
+    PoolTask* queue;
+    int queue_capacity;
+    int queue_head;
+    int queue_count;
+    int active;
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    pthread_cond_t has_space;
+    pthread_cond_t idle;
+} ThreadPool;
 
-                bytes_read = read_to_whitespace(fp, buffer, IMAGE_READ_BUFFER_SIZE);
-                if (bytes_read <= 0) {
-                    fprintf(stderr, "Error: Expected a color value but read nothing\n");
-                    return 1;
-                }
-                else if (atoi(buffer) > color_max) {
-                    fprintf(stderr, "Error: A color sample is greater than the maximum color (%i) value \n", color_max);
-                    return 1;
-                }
-                else if (atoi(buffer) < 0) {
-                    fprintf(stderr, "Error: A negative color sample is not a valid value \n");
-                    return 1;
-                }
-                value = (atoi(buffer)/(float)color_max);
+/**
+ * Get the number of online processors, always at least 1
+ * @return
+ */
+int cpu_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count < 1 ? 1 : (int) count;
+}
 
-                if (k == 0)
-                    image_ptr->pixmap[i*width + j].r = value;
-                if (k == 1)
-                    image_ptr->pixmap[i*width + j].g = value;
-                if (k == 2)
-                    image_ptr->pixmap[i*width + j].b = value;
-            }
+/**
+ * Get a monotonic time in seconds, for measuring work done outside GLFW
+ * @return
+ */
+double monotonic_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/**
+ * The body of every worker thread in a pool
+ * @param pool_ptr
+ * @return
+ */
+static void* thread_pool_worker(void* pool_ptr) {
+    ThreadPool* pool = pool_ptr;
+    PoolTask task;
+    while (TRUE) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queue_count == 0 && !pool->shutdown)
+            pthread_cond_wait(&pool->has_work, &pool->lock);
+        if (pool->queue_count == 0 && pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
         }
-    }
+        task = pool->queue[pool->queue_head];
+        pool->queue_head = (pool->queue_head + 1) % pool->queue_capacity;
+        pool->queue_count--;
+        pool->active++;
+        pthread_cond_signal(&pool->has_space);
+        pthread_mutex_unlock(&pool->lock);
 
-    return 0;
+        task.fn(task.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active--;
+        if (pool->active == 0 && pool->queue_count == 0)
+            pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
+    }
 }
 
 /**
- * Load a PPM P6 file into image_ptr
- * @param fp
- * @param image_ptr
- * @param color_max
- * @param buffer
+ * Start a thread pool
+ * @param pool
+ * @param thread_count - The number of workers, 0 for one per processor
+ * @param queue_capacity - The maximum number of queued tasks before submitting blocks
  * @return
  */
-int image_load_p6(FILE* fp, Image* image_ptr, int color_max, char buffer[]) {
-    int height = image_ptr->height;
-    int width = image_ptr->width;
-    image_ptr->pixmap = malloc(sizeof(RGBpixel) * width * height);
+int thread_pool_create(ThreadPool* pool, int thread_count, int queue_capacity) {
+    if (thread_count <= 0)
+        thread_count = cpu_count();
+    if (queue_capacity <= 0)
+        queue_capacity = 1;
 
-    // Read past the comments and whitespace
-    if (skip_whitespace(fp) != 0) {
-        fprintf(stderr, "Error: An error occurred skipping file whitespace\n");
+    memset(pool, 0, sizeof(ThreadPool));
+    pool->threads = malloc(sizeof(pthread_t) * thread_count);
+    pool->queue = malloc(sizeof(PoolTask) * queue_capacity);
+    if (pool->threads == NULL || pool->queue == NULL) {
+        fprintf(stderr, "Error: Could not allocate the thread pool\n");
+        free(pool->threads);
+        free(pool->queue);
         return 1;
     }
+    pool->queue_capacity = queue_capacity;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    pthread_cond_init(&pool->has_space, NULL);
+    pthread_cond_init(&pool->idle, NULL);
 
-    // Read the actual image in
-    int i;
-    int j;
-    int k;
-    size_t bytes_read;
-    float value;
-    for (i=0; i<height; i++) {
-        for (j=0; j<width; j++) {
-            for (k=0; k<3; k++) {
-                // If color_max is < 256 the values are 8 bit, otherwise they're 16 bit!
-                if (color_max < 256) {
-                    bytes_read = fread(buffer, sizeof(char), 1, fp);
-                    if (bytes_read < 1) {
-                        fprintf(stderr, "Error: Expected a color value but read nothing\n");
-                        return 1;
-                    }
-                    value = buffer[0] & 0xFF;
-                }
-                else {
-                    bytes_read = fread(buffer, sizeof(char), 2, fp);
-                    if (bytes_read < 2) {
-                        fprintf(stderr, "Error: Expected a color value but read nothing\n");
-                        return 1;
-                    }
-                    value = ((buffer[0] << 8) & 0xFF00) | (buffer[1] & 0xFF);
-                }
-
-                value = (value/(float)color_max);
-
-                if (k == 0)
-                    image_ptr->pixmap[i*width + j].r = value;
-                if (k == 1)
-                    image_ptr->pixmap[i*width + j].g = value;
-                if (k == 2)
-                    image_ptr->pixmap[i*width + j].b = value;
-            }
+    for (pool->thread_count = 0; pool->thread_count < thread_count; pool->thread_count++) {
+        if (pthread_create(&pool->threads[pool->thread_count], NULL, thread_pool_worker, pool) != 0) {
+            fprintf(stderr, "Error: Could not start a worker thread\n");
+            break;
         }
     }
+    return pool->thread_count > 0 ? 0 : 1;
+}
 
-    return 0;
+/**
+ * Queue a task on the pool, blocks while the queue is full
+ * @param pool
+ * @param fn
+ * @param arg
+ */
+void thread_pool_submit(ThreadPool* pool, void (*fn)(void* arg), void* arg) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queue_count == pool->queue_capacity)
+        pthread_cond_wait(&pool->has_space, &pool->lock);
+    PoolTask* task = &pool->queue[(pool->queue_head + pool->queue_count) % pool->queue_capacity];
+    task->fn = fn;
+    task->arg = arg;
+    pool->queue_count++;
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
 }
 
 /**
- * Loads an PPM image in P3 or P6 formats into the specified image_ptr
- * @param image_ptr
- * @param fname
- * @return
+ * Block until every submitted task has finished
+ * @param pool
  */
-int load_image(Image* image_ptr, char* fname) {
-    FILE* fp = fopen(fname, "r");
-    if (fp) {
-        int ppm_version = 0;
-        char buffer[IMAGE_READ_BUFFER_SIZE];
-        int bytes_read;
-        int width;
-        int height;
-        int color_max;
+void thread_pool_wait(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0 || pool->queue_count > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
 
-        bytes_read = read_to_whitespace(fp, buffer, IMAGE_READ_BUFFER_SIZE);
+/**
+ * Finish all queued work, stop the workers, and release the pool
+ * @param pool
+ */
+void thread_pool_destroy(ThreadPool* pool) {
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = TRUE;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i=0; i<pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->has_work);
+    pthread_cond_destroy(&pool->has_space);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->threads);
+    free(pool->queue);
+}
 
-        // Check for the magic number
-        if (bytes_read != 2) {
-            fprintf(stderr, ERR_INVALID_FILE);
-            fclose(fp);
-            return 1;
-        }
-        if (strncmp("P3", buffer, 2) == 0) {
-            ppm_version = 3;
-        }
-        else if (strncmp("P6", buffer, 2) == 0) {
-            ppm_version = 6;
-        }
-        else {
-            fprintf(stderr, ERR_INVALID_FILE);
-            fclose(fp);
-            return 1;
-        }
+/**
+ * Parallel For, splits a range into chunks that are claimed by the calling
+ * thread and by helper tasks on the worker pool. The caller only waits for
+ * chunks that were actually started so it never deadlocks behind a busy
+ * pool, and the job is freed by whoever releases it last.
+ */
+typedef struct ParallelFor {
+    void (*fn)(void* ctx, int task, size_t begin, size_t end);
+    void* ctx;
+    size_t count;
+    int tasks;
+    int next_task;
+    int finished;
+    int references;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} ParallelFor;
 
-        // Read past the comments and whitespace
-        if (skip_whitespace(fp) != 0) {
-            fprintf(stderr, "Error: An error occurred skipping file whitespace\n");
-            fclose(fp);
-            return 1;
-        }
+/**
+ * The shared worker pool used for data parallel work
+ */
+ThreadPool WorkerPool;
+pthread_once_t WorkerPoolOnce = PTHREAD_ONCE_INIT;
 
-        // We are at the first line of image header information
-        // Read in the dimensions of the image
+static void worker_pool_init() {
+    if (thread_pool_create(&WorkerPool, 0, 1024) != 0)
+        exit(1);
+}
 
-        // Read the width of the image
-        bytes_read = read_to_whitespace(fp, buffer, IMAGE_READ_BUFFER_SIZE);
+/**
+ * Get the shared worker pool, starting it on first use
+ * @return
+ */
+ThreadPool* worker_pool() {
+    pthread_once(&WorkerPoolOnce, worker_pool_init);
+    return &WorkerPool;
+}
 
-        if (bytes_read <= 0) {
-            fprintf(stderr, "Error: Expected a width value but read nothing\n");
-            return 1;
-        }
+/**
+ * Claim and run chunks of a parallel for until none are left
+ * @param job
+ */
+static void parallel_for_run(ParallelFor* job) {
+    while (TRUE) {
+        pthread_mutex_lock(&job->lock);
+        int task = job->next_task < job->tasks ? job->next_task++ : -1;
+        pthread_mutex_unlock(&job->lock);
+        if (task < 0)
+            return;
 
-        width = atoi(buffer);
+        job->fn(job->ctx, task, job->count * task / job->tasks, job->count * (task + 1) / job->tasks);
 
-        if (width < 0)
-        {
-            fprintf(stderr, ERR_INVALID_FILE);
-            fclose(fp);
-            return 1;
-        }
+        pthread_mutex_lock(&job->lock);
+        if (++job->finished == job->tasks)
+            pthread_cond_broadcast(&job->done);
+        pthread_mutex_unlock(&job->lock);
+    }
+}
 
-        // Read past the comments and whitespace
-        if (skip_whitespace(fp) != 0) {
-            fprintf(stderr, "Error: An error occurred skipping file whitespace\n");
-            fclose(fp);
-            return 1;
-        }
-
-        // Read the height of the image
-        bytes_read = read_to_whitespace(fp, buffer, IMAGE_READ_BUFFER_SIZE);
+/**
+ * Drop a reference to a parallel for, freeing it with the last one
+ * @param job
+ */
+static void parallel_for_release(ParallelFor* job) {
+    pthread_mutex_lock(&job->lock);
+    int last = --job->references == 0;
+    pthread_mutex_unlock(&job->lock);
+    if (last) {
+        pthread_mutex_destroy(&job->lock);
+        pthread_cond_destroy(&job->done);
+        free(job);
+    }
+}
 
-        if (bytes_read <= 0) {
-            fprintf(stderr, "Error: Expected a width value but read nothing\n");
-            return 1;
-        }
+/**
+ * Thread pool task helping with a parallel for
+ * @param job_ptr
+ */
+static void parallel_for_helper(void* job_ptr) {
+    parallel_for_run(job_ptr);
+    parallel_for_release(job_ptr);
+}
 
-        height = atoi(buffer);
+/**
+ * Run fn over [0, count) split into tasks contiguous chunks on the worker
+ * pool, returning once every chunk has finished. Each chunk gets its task
+ * index so callers can keep per task state such as partial histograms.
+ * @param count
+ * @param tasks
+ * @param fn
+ * @param ctx
+ */
+void parallel_for(size_t count, int tasks, void (*fn)(void* ctx, int task, size_t begin, size_t end), void* ctx) {
+    if ((size_t) tasks > count)
+        tasks = (int) count;
+    if (tasks <= 1) {
+        fn(ctx, 0, 0, count);
+        return;
+    }
 
-        if (height < 0)
-        {
-            fprintf(stderr, ERR_INVALID_FILE);
-            fclose(fp);
-            return 1;
-        }
+    ParallelFor* job = calloc(1, sizeof(ParallelFor));
+    if (job == NULL) {
+        fn(ctx, 0, 0, count);
+        return;
+    }
+    job->fn = fn;
+    job->ctx = ctx;
+    job->count = count;
+    job->tasks = tasks;
+    job->references = tasks;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done, NULL);
 
-        // Read past the comments and whitespace
-        if (skip_whitespace(fp) != 0) {
-            fprintf(stderr, "Error: An error occurred skipping file whitespace\n");
-            fclose(fp);
-            return 1;
-        }
+    int i;
+    ThreadPool* pool = worker_pool();
+    for (i=1; i<tasks; i++)
+        thread_pool_submit(pool, parallel_for_helper, job);
 
-        // Read in the max color value
-        bytes_read = read_to_whitespace(fp, buffer, IMAGE_READ_BUFFER_SIZE);
+    parallel_for_run(job);
 
-        if (bytes_read <= 0) {
-            fprintf(stderr, "Error: Expected a maximum color value but read nothing\n");
-            return 1;
-        }
+    pthread_mutex_lock(&job->lock);
+    while (job->finished < job->tasks)
+        pthread_cond_wait(&job->done, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+    parallel_for_release(job);
+}
 
-        color_max = atoi(buffer);
+/**
+ * Number of spans each thread keeps for --trace, older spans are overwritten
+ */
+#define TRACE_RING_EVENTS 65536
 
-        if (color_max < 0 || color_max > 65535)
-        {
-            fprintf(stderr, "Error: Expected maximum color value between 0 and 65536");
-            fclose(fp);
-            return 1;
-        }
+/**
+ * One finished span, name must be a string literal so only the pointer is kept
+ */
+typedef struct TraceEvent {
+    const char* name;
+    int64_t arg;
+    double begin;
+    double end;
+} TraceEvent;
 
-        image_ptr->width = (uint32_t) width;
-        image_ptr->height = (uint32_t) height;
+/**
+ * A thread's spans, only ever written by the thread that owns it
+ */
+typedef struct TraceRing {
+    TraceEvent* events;
+    uint64_t written;
+    int thread_id;
+    int main_thread;
+    struct TraceRing* next;
+} TraceRing;
 
-        int result;
-        if (ppm_version == 6)
-            result = image_load_p6(fp, image_ptr, color_max, buffer);
+int TraceEnabled = FALSE;
+char* TraceFilename = NULL;
+double TraceOrigin = 0;
+pthread_t TraceMainThread;
+TraceRing* TraceRings = NULL;
+int TraceRingCount = 0;
+pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceRing* TraceThreadRing = NULL;
 
-        if (ppm_version == 3)
-            result = image_load_p3(fp, image_ptr, color_max, buffer);
+/**
+ * Get the calling thread's ring, creating and registering it on first use
+ * @return NULL if it could not be allocated
+ */
+static TraceRing* trace_ring() {
+    if (TraceThreadRing != NULL)
+        return TraceThreadRing;
 
-        fclose(fp);
-        return result;
-    }
-    else {
-        fprintf(stderr, ERR_OPEN_FILE_READING, fname);
-        return 1;
+    TraceRing* ring = calloc(1, sizeof(TraceRing));
+    if (ring == NULL)
+        return NULL;
+    ring->events = malloc(sizeof(TraceEvent) * TRACE_RING_EVENTS);
+    if (ring->events == NULL) {
+        free(ring);
+        return NULL;
     }
+    ring->main_thread = pthread_equal(pthread_self(), TraceMainThread);
+
+    pthread_mutex_lock(&TraceLock);
+    ring->thread_id = ++TraceRingCount;
+    ring->next = TraceRings;
+    TraceRings = ring;
+    pthread_mutex_unlock(&TraceLock);
+
+    TraceThreadRing = ring;
+    return ring;
 }
 
 /**
- * GLFW Window
+ * Start a span
+ * @return the start time to hand to trace_end, 0 when not tracing
  */
-GLFWwindow* window;
+double trace_begin() {
+    return TraceEnabled ? monotonic_seconds() : 0;
+}
 
 /**
- * Vertex Struct
+ * Finish a span with an argument shown in the trace viewer, such as a row
+ * @param name string literal naming the span
+ * @param begin the value trace_begin returned
+ * @param arg negative for none
  */
-typedef struct {
-    float position[3];
-    float color[4];
-    float texcords[2];
-} Vertex;
+void trace_end_arg(const char* name, double begin, int64_t arg) {
+    if (!TraceEnabled)
+        return;
+    double end = monotonic_seconds();
+    TraceRing* ring = trace_ring();
+    if (ring == NULL)
+        return;
+    TraceEvent* event = &ring->events[ring->written % TRACE_RING_EVENTS];
+    event->name = name;
+    event->arg = arg;
+    event->begin = begin;
+    event->end = end;
+    ring->written++;
+}
 
 /**
- * A simple set of vertieces that define a square with correctly mapped texture cords
+ * Finish a span
+ * @param name string literal naming the span
+ * @param begin the value trace_begin returned
  */
-const Vertex Vertices[] = {
-        {{1, -1, 0}, {1, 1, 1, 1}, {1, 1}},
-        {{1, 1, 0}, {1, 1, 1, 1}, {1, 0}},
-        {{-1, 1, 0}, {1, 1, 1, 1}, {0, 0}},
-        {{-1, -1, 0}, {1, 1, 1, 1}, {0, 1}}
-};
+void trace_end(const char* name, double begin) {
+    trace_end_arg(name, begin, -1);
+}
 
 /**
- * Specifies the connections between vertices
+ * Write every recorded span as Chrome trace format JSON, run at exit
  */
-const GLubyte Indices[] = {
-        0, 1, 2,
-        2, 3, 0
-};
+static void trace_write() {
+    if (!TraceEnabled)
+        return;
+    TraceEnabled = FALSE;
+
+    FILE* fp = fopen(TraceFilename, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Could not open %s to write the trace\n", TraceFilename);
+        return;
+    }
+
+    int first = TRUE;
+    uint64_t dropped = 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    pthread_mutex_lock(&TraceLock);
+    TraceRing* ring;
+    for (ring = TraceRings; ring != NULL; ring = ring->next) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                first ? "" : ",\n", ring->thread_id, ring->main_thread ? "main" : "worker", ring->thread_id);
+        first = FALSE;
+
+        uint64_t written = ring->written;
+        uint64_t i = written > TRACE_RING_EVENTS ? written - TRACE_RING_EVENTS : 0;
+        dropped += i;
+        for (; i<written; i++) {
+            TraceEvent* event = &ring->events[i % TRACE_RING_EVENTS];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    event->name, ring->thread_id, (event->begin - TraceOrigin) * 1e6, (event->end - event->begin) * 1e6);
+            if (event->arg >= 0)
+                fprintf(fp, ",\"args\":{\"value\":%lld}", (long long) event->arg);
+            fprintf(fp, "}");
+        }
+    }
+    pthread_mutex_unlock(&TraceLock);
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    if (dropped > 0)
+        fprintf(stderr, "The trace rings overflowed, the oldest %llu spans were dropped\n", (unsigned long long) dropped);
+    printf("Wrote %s\n", TraceFilename);
+}
 
 /**
- * The vertex shader for the applciation, this is where almost all the
- * action happens in reguards to transformations of the image. We simply
- * pass values for Scale, Translation, Shear, and Rotation into here and
- * the shader performs the appropriate matrix operations to transform the
- * displayed underlying geometry.
+ * Start recording spans, they're written to fname when the program exits
+ * @param fname
  */
-char* vertex_shader_src =
-        "attribute vec4 Position;\n"
-        "attribute vec4 SourceColor;\n"
-        "attribute vec2 SourceTexcoord;\n"
-        "uniform vec2 Scale;\n"
-        "uniform vec2 Translation;"
-        "uniform vec2 Shear;\n"
-        "uniform float Rotation;\n"
-        "varying vec4 DestinationColor;\n"
-        "varying vec2 DestinationTexcoord;\n"
-        "mat4 RotationMatrix = mat4( cos(Rotation), -sin(Rotation), 0.0, 0.0,\n"
-        "                            sin(Rotation),  cos(Rotation), 0.0, 0.0,\n"
-        "                            0.0,            0.0,           1.0, 0.0,\n"
-        "                            0.0,            0.0,           0.0, 1.0 );\n"
-        "\n"
-        "mat4 TranslationMatrix = mat4(1.0, 0.0, 0.0, Translation.x,\n"
-        "                              0.0, 1.0, 0.0, Translation.y,\n"
-        "                              0.0, 0.0, 1.0, 0.0,\n"
-        "                              0.0, 0.0, 0.0, 1.0 );\n"
-        "\n"
-        "mat4 ScaleMatrix = mat4(Scale.x, 0.0,     0.0, 0.0,\n"
-        "                        0.0,     Scale.y, 0.0, 0.0,\n"
-        "                        0.0,     0.0,     1.0, 0.0,\n"
-        "                        0.0,     0.0,     0.0, 1.0 );\n"
-        "\n"
-        "mat4 ShearMatrix = mat4(1.0,     Shear.x, 0.0, 0.0,\n"
-        "                        Shear.y, 1.0,     0.0, 0.0,\n"
-        "                        0.0,     0.0,     1.0, 0.0,\n"
-        "                        0.0,     0.0,     0.0, 1.0 );\n"
-        "\n"
-        "void main(void) {\n"
-        "    DestinationColor = SourceColor;\n"
-        "    DestinationTexcoord = SourceTexcoord;\n"
-        "    gl_Position = Position*ScaleMatrix*ShearMatrix*RotationMatrix*TranslationMatrix;\n"
-        "}";
+void trace_start(char* fname) {
+    TraceFilename = fname;
+    TraceMainThread = pthread_self();
+    TraceOrigin = monotonic_seconds();
+    TraceEnabled = TRUE;
+    atexit(trace_write);
+}
 
+/**
+ * Hardware events counted around decoding and uploads in benchmark mode
+ */
+typedef enum PerfCounterKind {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTER_KINDS
+} PerfCounterKind;
 
 /**
- * The fragment shader for the application. Handles actually mapping the
- * input image onto the geometry.
+ * Time and hardware counts summed over every run of one stage. Counters that
+ * could not be opened have a negative fd and only the time is kept. When the
+ * PMU has fewer counters than events the kernel multiplexes them, so every
+ * count is scaled by how long its event was enabled over how long it ran.
  */
-char* fragment_shader_src =
-        "varying vec4 DestinationColor;\n"
-        "varying vec2 DestinationTexcoord;\n"
-        "uniform sampler2D Texture;\n"
-        "\n"
-        "void main(void) {\n"
-        "    gl_FragColor = texture2D(Texture, DestinationTexcoord) * DestinationColor;\n"
-        "}";
+typedef struct PerfCounters {
+    int fds[PERF_COUNTER_KINDS];
+    uint64_t values[PERF_COUNTER_KINDS];
+    uint64_t enabled[PERF_COUNTER_KINDS];
+    uint64_t running[PERF_COUNTER_KINDS];
+    double seconds;
+    double started;
+    int runs;
+} PerfCounters;
 
 /**
- * Compile the specified shader, provides output and checks for errors
- * along the way.
- * @param shader_type - The OpenGL Shader Type
- * @param shader_src - The shader in string form
- * @return The compiled shader id
+ * Set up counters for the calling thread and every thread it creates after
+ * this, so worker pool threads must not exist yet to be counted
+ * @param counters
+ * @param hardware - FALSE to only measure time
+ * @return 0 if at least one hardware counter is available, or none was asked for
  */
-GLint simple_shader(GLint shader_type, char* shader_src) {
-    GLint compile_success = 0;
+int perf_counters_open(PerfCounters* counters, int hardware) {
+    int i;
+    memset(counters, 0, sizeof(PerfCounters));
+    for (i=0; i<PERF_COUNTER_KINDS; i++)
+        counters->fds[i] = -1;
+    if (!hardware)
+        return 0;
+#if defined(__linux__)
+    static const uint64_t configs[PERF_COUNTER_KINDS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int opened = 0;
+    for (i=0; i<PERF_COUNTER_KINDS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fds[i] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[i] >= 0)
+            opened++;
+    }
+    if (opened == 0) {
+        fprintf(stderr, "Hardware counters are not available: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+#else
+    fprintf(stderr, "Hardware counters are only available on Linux\n");
+    return 1;
+#endif
+}
 
-    // Generate a new shader to work with
-    GLuint shader_id = glCreateShader(shader_type);
+/**
+ * Start a run of the measured stage
+ * @param counters - NULL to do nothing
+ */
+void perf_counters_start(PerfCounters* counters) {
+    if (counters == NULL)
+        return;
+#if defined(__linux__)
+    int i;
+    for (i=0; i<PERF_COUNTER_KINDS; i++) {
+        // Resetting clears the count but not the times, so they are taken as a baseline
+        uint64_t read_values[3];
+        if (counters->fds[i] < 0)
+            continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        if (read(counters->fds[i], read_values, sizeof(read_values)) == sizeof(read_values)) {
+            counters->enabled[i] = read_values[1];
+            counters->running[i] = read_values[2];
+        }
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    counters->started = monotonic_seconds();
+}
 
-    // Tell the shader where the source is
-    glShaderSource(shader_id, 1, &shader_src, 0);
+/**
+ * Finish a run of the measured stage, adding it to the totals
+ * @param counters - NULL to do nothing
+ */
+void perf_counters_stop(PerfCounters* counters) {
+    if (counters == NULL)
+        return;
+    counters->seconds += monotonic_seconds() - counters->started;
+    counters->runs++;
+#if defined(__linux__)
+    int i;
+    for (i=0; i<PERF_COUNTER_KINDS; i++) {
+        uint64_t read_values[3];
+        if (counters->fds[i] < 0)
+            continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counters->fds[i], read_values, sizeof(read_values)) != sizeof(read_values))
+            continue;
+        uint64_t enabled = read_values[1] - counters->enabled[i];
+        uint64_t running = read_values[2] - counters->running[i];
+        if (running > 0 && running < enabled)
+            counters->values[i] += (uint64_t) ((double) read_values[0] * enabled / running);
+        else
+            counters->values[i] += read_values[0];
+    }
+#endif
+}
 
-    // Print the shader before we compile it
-    printf("===Compiling Shader===\n");
-    printf("%s\n", shader_src);
-    printf("======================\n");
+/**
+ * Close the counters
+ * @param counters
+ */
+void perf_counters_close(PerfCounters* counters) {
+    int i;
+    for (i=0; i<PERF_COUNTER_KINDS; i++) {
+        if (counters->fds[i] >= 0)
+            close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
 
-    // Actually compile the shader
-    glCompileShader(shader_id);
+/**
+ * Running totals of the memory allocated for images and their decoding,
+ * sampled before and after a load to see what it allocated
+ */
+typedef struct AllocationStats {
+    uint64_t count;
+    uint64_t bytes;
+} AllocationStats;
 
-    // Check the status of the compile
-    glGetShaderiv(shader_id, GL_COMPILE_STATUS, &compile_success);
+AllocationStats Allocations = { 0, 0 };
 
-    // If it failed print an error
-    if (compile_success == GL_FALSE) {
-        GLchar message[256];
-        glGetShaderInfoLog(shader_id, sizeof(message), 0, &message[0]);
-        printf("glCompileShader Error: %s\n", message);
-        exit(1);
-    }
+/**
+ * Add an allocation to the running totals, safe to call from any thread
+ * @param bytes
+ */
+void allocation_count(size_t bytes) {
+    __sync_fetch_and_add(&Allocations.count, 1);
+    __sync_fetch_and_add(&Allocations.bytes, bytes);
+}
 
-    return shader_id;
+/**
+ * malloc that is counted in Allocations
+ * @param bytes
+ * @return
+ */
+void* counted_malloc(size_t bytes) {
+    void* buffer = malloc(bytes);
+    if (buffer != NULL)
+        allocation_count(bytes);
+    return buffer;
 }
 
 /**
- * Start the OpenGL program, compile the shaders, and link the program
+ * calloc that is counted in Allocations
+ * @param count
+ * @param size
  * @return
  */
-int simple_program() {
+void* counted_calloc(size_t count, size_t size) {
+    void* buffer = calloc(count, size);
+    if (buffer != NULL)
+        allocation_count(count * size);
+    return buffer;
+}
 
-    GLint link_success = 0;
+/**
+ * Image Statistics, raw sample extremes, sums, and a histogram per channel.
+ * Sample values are kept in file units, divide by color_max to normalize.
+ */
+typedef struct ImageStats {
+    int bins;
+    int color_max;
+    uint64_t count;
+    uint32_t min[3];
+    uint32_t max[3];
+    uint64_t sum[3];
+    uint64_t* histogram;
+} ImageStats;
 
-    // Generate a new program to work with
-    GLint program_id = glCreateProgram();
-    // Compile the shaders
-    GLint vertex_shader = simple_shader(GL_VERTEX_SHADER, vertex_shader_src);
-    GLint fragment_shader = simple_shader(GL_FRAGMENT_SHADER, fragment_shader_src);
+/**
+ * Prepare empty statistics
+ * @param stats
+ * @param bins - The number of histogram bins per channel
+ * @param color_max
+ * @return
+ */
+int image_stats_init(ImageStats* stats, int bins, int color_max) {
+    int c;
+    memset(stats, 0, sizeof(ImageStats));
+    stats->bins = bins;
+    stats->color_max = color_max;
+    for (c=0; c<3; c++)
+        stats->min[c] = UINT32_MAX;
+    stats->histogram = counted_calloc((size_t) bins * 3, sizeof(uint64_t));
+    if (stats->histogram == NULL) {
+        fprintf(stderr, "Error: Could not allocate the image histogram\n");
+        return 1;
+    }
+    return 0;
+}
 
-    // Attach the shaders to the program
-    glAttachShader(program_id, vertex_shader);
-    glAttachShader(program_id, fragment_shader);
+/**
+ * Release the histogram of some statistics
+ * @param stats
+ */
+void image_stats_free(ImageStats* stats) {
+    free(stats->histogram);
+    stats->histogram = NULL;
+    stats->bins = 0;
+}
 
-    // Link the program
-    glLinkProgram(program_id);
+/**
+ * Accumulate a run of raw interleaved RGB samples as they appear in a P6 file
+ * @param stats
+ * @param bytes
+ * @param pixels
+ * @param bytes_per_sample - 1 for 8 bit samples, 2 for big endian 16 bit samples
+ */
+void image_stats_add_samples(ImageStats* stats, const unsigned char* bytes, size_t pixels, int bytes_per_sample) {
+    // Fixed point reciprocal mapping a sample onto its bin without dividing
+    uint64_t bin_scale = ((uint64_t) stats->bins << 32) / ((uint64_t) stats->color_max + 1);
+    uint64_t* histogram = stats->histogram;
+    uint64_t last_bin = (uint64_t) stats->bins - 1;
+    size_t i;
+    int c;
+    for (i=0; i<pixels; i++) {
+        for (c=0; c<3; c++) {
+            uint32_t value = bytes_per_sample == 1 ? bytes[i * 3 + c]
+                                                  : (uint32_t) bytes[(i * 3 + c) * 2] << 8 | bytes[(i * 3 + c) * 2 + 1];
+            if (value < stats->min[c])
+                stats->min[c] = value;
+            if (value > stats->max[c])
+                stats->max[c] = value;
+            stats->sum[c] += value;
+            // Files may hold samples above color_max, they count in the top bin
+            uint64_t bin = (value * bin_scale) >> 32;
+            histogram[c * stats->bins + (bin < last_bin ? bin : last_bin)]++;
+        }
+    }
+    stats->count += pixels;
+}
 
-    // Check the link status
-    glGetProgramiv(program_id, GL_LINK_STATUS, &link_success);
+/**
+ * Accumulate a single sample
+ * @param stats
+ * @param channel
+ * @param value
+ */
+void image_stats_add(ImageStats* stats, int channel, uint32_t value) {
+    if (value < stats->min[channel])
+        stats->min[channel] = value;
+    if (value > stats->max[channel])
+        stats->max[channel] = value;
+    stats->sum[channel] += value;
+    uint64_t bin = (uint64_t) value * stats->bins / ((uint64_t) stats->color_max + 1);
+    stats->histogram[channel * stats->bins + (bin < (uint64_t) stats->bins ? bin : (uint64_t) stats->bins - 1)]++;
+    if (channel == 2)
+        stats->count++;
+}
 
-    // If it failed print an error
-    if (link_success == GL_FALSE) {
-        GLchar message[256];
-        glGetProgramInfoLog(program_id, sizeof(message), 0, &message[0]);
-        printf("glLinkProgram Error: %s\n", message);
-        exit(1);
+/**
+ * Merge partial statistics into dst
+ * @param dst
+ * @param src
+ */
+void image_stats_merge(ImageStats* dst, const ImageStats* src) {
+    int c;
+    int i;
+    for (c=0; c<3; c++) {
+        if (src->min[c] < dst->min[c])
+            dst->min[c] = src->min[c];
+        if (src->max[c] > dst->max[c])
+            dst->max[c] = src->max[c];
+        dst->sum[c] += src->sum[c];
+    }
+    for (i=0; i<dst->bins * 3; i++)
+        dst->histogram[i] += src->histogram[i];
+    dst->count += src->count;
+}
+
+/**
+ * Find the normalized value below which the specified fraction of a channel's
+ * samples fall, resolved to the histogram bin
+ * @param stats
+ * @param channel
+ * @param fraction
+ * @return
+ */
+float image_stats_percentile(const ImageStats* stats, int channel, double fraction) {
+    uint64_t target = (uint64_t) (stats->count * fraction);
+    uint64_t seen = 0;
+    int i;
+    for (i=0; i<stats->bins; i++) {
+        seen += stats->histogram[channel * stats->bins + i];
+        if (seen > target)
+            break;
+    }
+    // Bins span color_max + 1 sample values, map the bin's middle back to a sample
+    double color_max = stats->color_max > 0 ? stats->color_max : 1;
+    double value = (i + 0.5) / stats->bins * (color_max + 1) / color_max;
+    return value < 1.0 ? (float) value : 1.0f;
+}
+
+/**
+ * Print a per channel summary of some statistics
+ * @param stats
+ * @param fp
+ */
+void image_stats_print(const ImageStats* stats, FILE* fp) {
+    const char* names[] = { "red", "green", "blue" };
+    int c;
+    float color_max = stats->color_max > 0 ? (float) stats->color_max : 1;
+    for (c=0; c<3; c++) {
+        fprintf(fp, "%-5s min %.4f max %.4f mean %.4f p0.1 %.4f p99.9 %.4f\n",
+                names[c],
+                stats->min[c] / color_max,
+                stats->max[c] / color_max,
+                stats->count ? stats->sum[c] / (double) stats->count / color_max : 0,
+                image_stats_percentile(stats, c, 0.001),
+                image_stats_percentile(stats, c, 0.999));
+    }
+}
+
+#define PIXEL_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HUGE_PAGE_THRESHOLD (4 * HUGE_PAGE_SIZE)
+
+/**
+ * Get the alignment pixels_alloc uses for a buffer of some size
+ * @param bytes
+ * @return
+ */
+size_t pixels_alignment(size_t bytes) {
+    return bytes >= HUGE_PAGE_THRESHOLD ? HUGE_PAGE_SIZE : PIXEL_ALIGNMENT;
+}
+
+/**
+ * Allocate a pixel buffer aligned to a cache line, so vectorized kernels can
+ * use aligned loads from its start. Large buffers are aligned to a huge page
+ * and on Linux are marked for transparent huge pages, so walking a multi GB
+ * image takes a fraction of the TLB misses. The buffer is freed with free.
+ * @param bytes
+ * @param alignment - Receives the alignment of the buffer
+ * @return The buffer or NULL if it could not be allocated
+ */
+void* pixels_alloc(size_t bytes, size_t* alignment) {
+    void* buffer = NULL;
+    size_t align = pixels_alignment(bytes);
+    if (posix_memalign(&buffer, align, bytes > 0 ? bytes : 1) != 0)
+        return NULL;
+    allocation_count(bytes);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (align == HUGE_PAGE_SIZE)
+        madvise(buffer, bytes / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+#endif
+    if (alignment != NULL)
+        *alignment = align;
+    return buffer;
+}
+
+#define IMAGE_BUFFERS_MAX 8
+
+/**
+ * A pool of pixel buffers owned by the caller and recycled across loads.
+ * A buffer is handed out again for any image that needs at least half of
+ * its capacity, so a session cycling through images of similar size stops
+ * allocating once the pool is warm. The pool is locked so loads on several
+ * threads can share it.
+ */
+typedef struct ImageBuffers {
+    pthread_mutex_t lock;
+    void* buffers[IMAGE_BUFFERS_MAX];
+    size_t capacities[IMAGE_BUFFERS_MAX];
+    int count;
+} ImageBuffers;
+
+/**
+ * Start an empty buffer pool
+ * @param buffers
+ */
+void image_buffers_init(ImageBuffers* buffers) {
+    memset(buffers, 0, sizeof(ImageBuffers));
+    pthread_mutex_init(&buffers->lock, NULL);
+}
+
+/**
+ * Take a buffer of at least bytes from the pool, allocating one if no
+ * pooled buffer fits
+ * @param buffers - May be NULL to always allocate
+ * @param bytes
+ * @param capacity - Receives the size of the buffer
+ * @return The buffer or NULL if it could not be allocated
+ */
+void* image_buffers_acquire(ImageBuffers* buffers, size_t bytes, size_t* capacity) {
+    int best = -1;
+    int i;
+    if (buffers != NULL) {
+        pthread_mutex_lock(&buffers->lock);
+        for (i=0; i<buffers->count; i++) {
+            if (buffers->capacities[i] >= bytes && buffers->capacities[i] / 2 <= bytes &&
+                (best < 0 || buffers->capacities[i] < buffers->capacities[best]))
+                best = i;
+        }
+        if (best >= 0) {
+            void* buffer = buffers->buffers[best];
+            *capacity = buffers->capacities[best];
+            buffers->count--;
+            buffers->buffers[best] = buffers->buffers[buffers->count];
+            buffers->capacities[best] = buffers->capacities[buffers->count];
+            pthread_mutex_unlock(&buffers->lock);
+            return buffer;
+        }
+        pthread_mutex_unlock(&buffers->lock);
+    }
+    *capacity = bytes;
+    return pixels_alloc(bytes, NULL);
+}
+
+/**
+ * Give a buffer back to the pool, it is freed when the pool is full
+ * @param buffers - May be NULL to always free
+ * @param buffer
+ * @param capacity - Size of the buffer, 0 if unknown
+ */
+void image_buffers_release(ImageBuffers* buffers, void* buffer, size_t capacity) {
+    if (buffer == NULL)
+        return;
+    if (buffers != NULL && capacity > 0) {
+        pthread_mutex_lock(&buffers->lock);
+        if (buffers->count < IMAGE_BUFFERS_MAX) {
+            buffers->buffers[buffers->count] = buffer;
+            buffers->capacities[buffers->count++] = capacity;
+            buffer = NULL;
+        }
+        pthread_mutex_unlock(&buffers->lock);
+    }
+    free(buffer);
+}
+
+/**
+ * Free every pooled buffer
+ * @param buffers
+ */
+void image_buffers_destroy(ImageBuffers* buffers) {
+    int i;
+    for (i=0; i<buffers->count; i++)
+        free(buffers->buffers[i]);
+    buffers->count = 0;
+    pthread_mutex_destroy(&buffers->lock);
+}
+
+/**
+ * Allocate the pixels of an image for its format and size
+ * @param image
+ * @param buffers - Pool to take the buffer from, may be NULL
+ * @return
+ */
+int image_allocate(Image* image, ImageBuffers* buffers) {
+    size_t pixels = (size_t) image->width * image->height;
+    size_t bytes = image->format == PIXEL_FORMAT_FLOAT ? sizeof(RGBpixel) * pixels : sizeof(uint16_t) * 3 * pixels;
+    void* buffer = image_buffers_acquire(buffers, bytes, &image->capacity);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for the image\n");
+        image->capacity = 0;
+        image->alignment = 0;
+        return 1;
+    }
+    image->alignment = pixels_alignment(image->capacity);
+    if (image->format == PIXEL_FORMAT_FLOAT)
+        image->pixmap = buffer;
+    else
+        image->pixmap16 = buffer;
+    return 0;
+}
+
+/**
+ * Give the pixels of an image back to a pool, or free them
+ * @param image
+ * @param buffers - May be NULL to free
+ */
+void image_recycle(Image* image, ImageBuffers* buffers) {
+    image_buffers_release(buffers, image->pixmap != NULL ? (void*) image->pixmap : (void*) image->pixmap16, image->capacity);
+    if (image->pixmap != NULL && image->pixmap16 != NULL)
+        free(image->pixmap16);
+    image->pixmap = NULL;
+    image->pixmap16 = NULL;
+    image->capacity = 0;
+    image->alignment = 0;
+}
+
+/**
+ * Decodes a P6 file a region at a time. Rows of a P6 file sit at fixed
+ * offsets, so any block of the image can be read with pread without
+ * touching the rest. The image is divided into blocks of ROI_BLOCK_SIZE
+ * pixels and each block is decoded at most once.
+ */
+typedef struct RoiDecoder {
+    int fd;
+    off_t data_offset;
+    Image* image;
+    int color_max;
+    int bytes_per_sample;
+    float* table;
+    int tasks;
+    unsigned char* bytes;
+    float* scratch;
+    uint32_t blocks_x;
+    uint32_t blocks_y;
+    unsigned char* decoded;
+    size_t remaining;
+} RoiDecoder;
+
+#define TILE_SIZE 256
+
+/**
+ * One slot of the tile cache. A slot holds a TILE_SIZE square of RGB floats
+ * once it has been decoded, edge tiles leave the rest of the square unused.
+ */
+typedef struct Tile {
+    float* pixels;
+    uint64_t index;
+    uint64_t last_used;
+    int pins;
+    int ready;
+    int32_t next;
+} Tile;
+
+/**
+ * Out of core storage for P6 images too large to hold in memory. The image
+ * is never decoded as a whole, TILE_SIZE square tiles are read from the file
+ * with pread as they are asked for and kept in a cache bounded to a fixed
+ * number of tiles, the least recently used unpinned tile is replaced first.
+ * Tiles are found through a chained hash of their index, so the cache cost
+ * does not grow with the size of the image.
+ */
+typedef struct TileStore {
+    int fd;
+    off_t data_offset;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    int color_max;
+    int bytes_per_sample;
+    float* table;
+    Tile* slots;
+    size_t capacity;
+    int32_t* buckets;
+    size_t bucket_mask;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+} TileStore;
+
+/**
+ * Image Load Options
+ */
+typedef struct LoadOptions {
+    int histogram_bins;
+    ImageStats* stats;
+    int linearize;
+    PixelFormat format;
+    RoiDecoder* roi;
+    ImageBuffers* buffers;
+    TileStore* tiles;
+    size_t tile_cache_bytes;
+    PerfCounters* counters;
+    uint32_t thumbnail_size;
+} LoadOptions;
+
+/**
+ * Convert an sRGB encoded value to linear light
+ * @param value
+ * @return
+ */
+float srgb_to_linear(float value) {
+    if (value <= 0.04045f)
+        return value / 12.92f;
+    return powf((value + 0.055f) / 1.055f, 2.4f);
+}
+
+/**
+ * Convert a linear light value to sRGB encoding
+ * @param value
+ * @return
+ */
+float linear_to_srgb(float value) {
+    if (value <= 0.0031308f)
+        return value * 12.92f;
+    return 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+}
+
+/**
+ * Build a table mapping every possible sample value to its float value,
+ * optionally converted from sRGB to linear light, so decoding never has to
+ * divide or call pow per sample
+ * @param color_max
+ * @param linearize
+ * @return The table of 256 entries for 8 bit samples and 65536 otherwise, or NULL if it could not be allocated
+ */
+float* sample_table(int color_max, int linearize) {
+    int entries = color_max < 256 ? 256 : 65536;
+    float* table = counted_malloc(sizeof(float) * entries);
+    int i;
+    if (table == NULL)
+        return NULL;
+    for (i=0; i<entries; i++) {
+        table[i] = i / (float) color_max;
+        if (linearize)
+            table[i] = srgb_to_linear(table[i]);
+    }
+    return table;
+}
+
+/**
+ * Increments the pointer past past comments in a PPM file
+ * @param fp
+ * @return
+ */
+int skip_comments(FILE* fp) {
+    int c;
+    char in_comment = FALSE;
+    while (TRUE) {
+        c = getc(fp);
+        if (c == EOF) {
+            fprintf(stderr, ERR_INVALID_FILE);
+            return 1;
+        }
+        if (in_comment) {
+            if (c == '\n' || c == '\r')
+                in_comment = FALSE;
+        }
+        else if (c == '#')
+            in_comment = TRUE;
+        else {
+            // We read one to far, move back one
+            fseek(fp, -1, SEEK_CUR);
+            return 0;
+        }
+    }
+};
+
+/**
+ * Increments the pointer past whitespace AND comments in a PPM file
+ * @param fp
+ * @return
+ */
+int skip_whitespace(FILE* fp) {
+    int c;
+    do {
+        c = getc(fp);
+        // make sure we didn't read to the EOF
+        if (c == EOF) {
+            fprintf(stderr, ERR_UNEXPECTED_EOF);
+            return 1;
+        }
+        if (c == '\n' || c == '\r') {
+            // read past any comments
+            if (skip_comments(fp) != 0)
+                return 1;
+        }
+    }
+    while(c == '\r' || // carriage return
+          c == '\n' || // newline
+          c == ' '  || // space
+          c == '\t'); // tab
+    // We read one to far, move back one
+    fseek(fp, -1, SEEK_CUR);
+    return 0;
+}
+
+/**
+ * Reads the contents of the current position in the file to the next whitespace character into the specified buffer
+ * This function null terminates the buffer at the end of the read string
+ * @param fp
+ * @param buffer
+ * @param buffer_size
+ * @return
+ */
+int read_to_whitespace(FILE* fp, char buffer[], int buffer_size) {
+    int c;
+    int pos = 0;
+    while (TRUE) {
+        if (pos > buffer_size - 1) {
+            fprintf(stderr, "Error: Buffer not large enough to finish reading to whitespace\n");
+            return -1;
+        }
+        c = getc(fp);
+        // make sure we didn't read to the EOF
+        if (c == EOF) {
+            fprintf(stderr, ERR_UNEXPECTED_EOF);
+            return -1;
+        }
+        if (c == '\r' || // carriage return
+            c == '\n' || // newline
+            c == ' '  || // space
+            c == '\t') { // tab
+            fseek(fp, -1, SEEK_CUR);
+            // add ASCIIZ, null terminate the string
+            buffer[pos] = '\0';
+            return pos;
+        }
+        buffer[pos++] = (char)c;
+    }
+};
+
+/**
+ * Load a PPM P3 file into an image
+ * @param fp
+ * @param image_ptr
+ * @param color_max
+ * @param buffer
+ * @param stats - Accumulates statistics for every sample when not NULL
+ * @param table - Maps samples to values when not NULL, see sample_table
+ * @return
+ */
+int image_load_p3(FILE* fp, Image* image_ptr, int color_max, char buffer[], ImageStats* stats, const float* table) {
+    size_t height = image_ptr->height;
+    size_t width = image_ptr->width;
+
+    // Read the actual image in, indices are 64 bit so gigapixel images do not overflow
+    size_t i;
+    size_t j;
+    int k;
+    float value;
+    int bytes_read;
+    for (i=0; i<height; i++) {
+        for (j=0; j<width; j++) {
+            for (k=0; k<3; k++) {
+                // Read past the comments and whitespace
+                if (skip_whitespace(fp) != 0) {
+                    fprintf(stderr, "Error: An error occurred skipping file whitespace\n");
+                    return 1;
+                }
+
+                bytes_read = read_to_whitespace(fp, buffer, IMAGE_READ_BUFFER_SIZE);
+                if (bytes_read <= 0) {
+                    fprintf(stderr, "Error: Expected a color value but read nothing\n");
+                    return 1;
+                }
+                else if (atoi(buffer) > color_max) {
+                    fprintf(stderr, "Error: A color sample is greater than the maximum color (%i) value \n", color_max);
+                    return 1;
+                }
+                else if (atoi(buffer) < 0) {
+                    fprintf(stderr, "Error: A negative color sample is not a valid value \n");
+                    return 1;
+                }
+                value = table != NULL ? table[atoi(buffer)] : (atoi(buffer)/(float)color_max);
+                if (stats != NULL)
+                    image_stats_add(stats, k, (uint32_t) atoi(buffer));
+
+                if (image_ptr->format == PIXEL_FORMAT_U16) {
+                    image_ptr->pixmap16[(i*width + j)*3 + k] = (uint16_t) atoi(buffer);
+                    continue;
+                }
+                if (image_ptr->format == PIXEL_FORMAT_HALF) {
+                    image_ptr->pixmap16[(i*width + j)*3 + k] = float_to_half(value);
+                    continue;
+                }
+
+                if (k == 0)
+                    image_ptr->pixmap[i*width + j].r = value;
+                if (k == 1)
+                    image_ptr->pixmap[i*width + j].g = value;
+                if (k == 2)
+                    image_ptr->pixmap[i*width + j].b = value;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * A band of P6 rows read into memory and waiting to be converted
+ */
+typedef struct P6Band {
+    Image* image;
+    const unsigned char* bytes;
+    uint32_t first_row;
+    uint32_t first_column;
+    uint32_t columns;
+    int color_max;
+    int bytes_per_sample;
+    const float* table;
+    ImageStats* partials;
+    float* scratch;
+} P6Band;
+
+/**
+ * Convert the columns of one row of a P6 band to floats and gather
+ * statistics for them while they are still in cache. Rows of a
+ * PIXEL_FORMAT_U16 image are already in place and only need statistics.
+ * @param band
+ * @param task
+ * @param src - The samples of the row as they are in the file
+ * @param row - Row within the band
+ */
+static void image_decode_p6_span(const P6Band* band, int task, const unsigned char* src, size_t row) {
+    size_t first = (band->first_row + row) * band->image->width + band->first_column;
+    size_t count = (size_t) band->columns * 3;
+    float color_max = (float) band->color_max;
+    float* dst = NULL;
+    size_t k;
+    if (band->image->format == PIXEL_FORMAT_FLOAT)
+        dst = (float*) &band->image->pixmap[first];
+    else if (band->image->format == PIXEL_FORMAT_HALF)
+        dst = band->scratch + (size_t) task * band->image->width * 3;
+
+    if (dst == NULL) {
+        // Raw 16 bit samples were read straight into place, only the statistics are left
+    }
+    else if (band->bytes_per_sample == 1) {
+        for (k=0; k<count; k++)
+            dst[k] = band->table[src[k]];
+    }
+    else if (band->table != NULL) {
+        for (k=0; k<count; k++)
+            dst[k] = band->table[(src[k * 2] << 8) | src[k * 2 + 1]];
+    }
+    else {
+        for (k=0; k<count; k++)
+            dst[k] = (float) ((src[k * 2] << 8) | src[k * 2 + 1]) / color_max;
+    }
+    if (band->image->format == PIXEL_FORMAT_HALF)
+        floats_to_halves(dst, &band->image->pixmap16[first * 3], count);
+    if (band->partials != NULL)
+        image_stats_add_samples(&band->partials[task], src, band->columns, band->bytes_per_sample);
+}
+
+/**
+ * parallel_for body converting whole rows of a P6 band
+ * @param band_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void image_decode_p6_rows(void* band_ptr, int task, size_t begin, size_t end) {
+    P6Band* band = band_ptr;
+    size_t row_bytes = (size_t) band->columns * 3 * band->bytes_per_sample;
+    size_t row;
+    double span = trace_begin();
+    for (row=begin; row<end; row++)
+        image_decode_p6_span(band, task, band->bytes + row * row_bytes, row);
+    trace_end_arg("decode rows", span, (int64_t) (band->first_row + begin));
+}
+
+/**
+ * Load a PPM P6 file into image_ptr. Rows are read in bands of about
+ * P6_BAND_BYTES and each band is converted in parallel, with statistics
+ * gathered into per task partials that are merged at the end. PIXEL_FORMAT_U16
+ * images are read straight into pixmap16 in file byte order and are swapped
+ * by the GPU during upload. PIXEL_FORMAT_HALF rows are decoded to floats in a
+ * per task scratch row and then narrowed into pixmap16.
+ * @param fp
+ * @param image_ptr - Pixels already allocated with image_allocate
+ * @param color_max
+ * @param stats - Accumulates statistics for every sample when not NULL
+ * @param table - Maps samples to values, required for 8 bit samples, see sample_table
+ * @return
+ */
+int image_load_p6(FILE* fp, Image* image_ptr, int color_max, ImageStats* stats, const float* table) {
+    size_t height = image_ptr->height;
+    size_t width = image_ptr->width;
+    int raw = image_ptr->format == PIXEL_FORMAT_U16;
+    image_ptr->big_endian_samples = raw;
+
+    // Exactly one whitespace character separates the header from the samples
+    int c = getc(fp);
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+        fprintf(stderr, ERR_INVALID_FILE);
+        return 1;
+    }
+
+    // If color_max is < 256 the values are 8 bit, otherwise they're 16 bit!
+    int bytes_per_sample = color_max < 256 ? 1 : 2;
+    size_t row_bytes = width * 3 * bytes_per_sample;
+    size_t band_rows = row_bytes > 0 && row_bytes < P6_BAND_BYTES ? P6_BAND_BYTES / row_bytes : 1;
+    if (band_rows > height)
+        band_rows = height;
+    unsigned char* bytes = raw ? NULL : counted_malloc(row_bytes * band_rows);
+    int tasks = cpu_count();
+    float* scratch = image_ptr->format == PIXEL_FORMAT_HALF ? counted_malloc(sizeof(float) * 3 * width * tasks) : NULL;
+    if ((!raw && bytes == NULL) || (image_ptr->format == PIXEL_FORMAT_HALF && scratch == NULL)) {
+        fprintf(stderr, "Error: Could not allocate memory for the image\n");
+        free(bytes);
+        free(scratch);
+        return 1;
+    }
+
+    int i;
+    ImageStats* partials = NULL;
+    if (stats != NULL) {
+        partials = counted_calloc(tasks, sizeof(ImageStats));
+        for (i=0; partials != NULL && i<tasks; i++) {
+            if (image_stats_init(&partials[i], stats->bins, color_max) != 0) {
+                while (i-- > 0)
+                    image_stats_free(&partials[i]);
+                free(partials);
+                partials = NULL;
+            }
+        }
+        if (partials == NULL) {
+            fprintf(stderr, "Error: Could not allocate memory for the image statistics\n");
+            free(bytes);
+            free(scratch);
+            return 1;
+        }
+    }
+
+    P6Band band = { image_ptr, bytes, 0, 0, (uint32_t) width, color_max, bytes_per_sample, table, partials, scratch };
+    int result = 0;
+    size_t row;
+    for (row=0; row<height; row+=band_rows) {
+        size_t rows = height - row < band_rows ? height - row : band_rows;
+        if (raw)
+            band.bytes = (unsigned char*) image_ptr->pixmap16 + row * row_bytes;
+        double span = trace_begin();
+        if (fread((void*) band.bytes, 1, row_bytes * rows, fp) < row_bytes * rows) {
+            fprintf(stderr, "Error: Expected a color value but read nothing\n");
+            result = 1;
+            break;
+        }
+        trace_end_arg("read band", span, (int64_t) row);
+        band.first_row = (uint32_t) row;
+        if (!raw || partials != NULL) {
+            span = trace_begin();
+            parallel_for(rows, tasks, image_decode_p6_rows, &band);
+            trace_end_arg("decode band", span, (int64_t) row);
+        }
+    }
+
+    if (partials != NULL) {
+        for (i=0; i<tasks; i++) {
+            image_stats_merge(stats, &partials[i]);
+            image_stats_free(&partials[i]);
+        }
+        free(partials);
+    }
+    free(bytes);
+    free(scratch);
+    return result;
+}
+
+#define ROI_BLOCK_SIZE 256
+#define ROI_MARGIN 256
+
+/**
+ * A run of blocks in one block row being decoded
+ */
+typedef struct RoiSpan {
+    RoiDecoder* roi;
+    P6Band band;
+    int failed;
+} RoiSpan;
+
+/**
+ * Prepare a region of interest decoder for a P6 file whose header has been
+ * read. Pixmap memory is zero filled and left to the operating system to
+ * commit, so only the regions actually decoded take up memory.
+ * @param roi
+ * @param fp - Positioned just past the maximum color value, stays owned by the caller
+ * @param image_ptr
+ * @param color_max
+ * @param table - Sample table, owned by the decoder from now on
+ * @return
+ */
+int roi_open(RoiDecoder* roi, FILE* fp, Image* image_ptr, int color_max, float* table) {
+    size_t width = image_ptr->width;
+    size_t height = image_ptr->height;
+    struct stat file_stat;
+    memset(roi, 0, sizeof(RoiDecoder));
+    roi->fd = -1;
+    roi->image = image_ptr;
+    roi->color_max = color_max;
+    roi->bytes_per_sample = color_max < 256 ? 1 : 2;
+    roi->table = table;
+    roi->tasks = cpu_count();
+
+    // Exactly one whitespace character separates the header from the samples
+    int c = getc(fp);
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+        fprintf(stderr, ERR_INVALID_FILE);
+        return 1;
+    }
+    roi->data_offset = ftello(fp);
+    if (fstat(fileno(fp), &file_stat) != 0 ||
+        file_stat.st_size < roi->data_offset + (off_t) (width * height * 3 * roi->bytes_per_sample)) {
+        fprintf(stderr, ERR_UNEXPECTED_EOF);
+        return 1;
+    }
+    roi->fd = dup(fileno(fp));
+
+    int raw = image_ptr->format == PIXEL_FORMAT_U16;
+    if (image_ptr->format == PIXEL_FORMAT_FLOAT)
+        image_ptr->pixmap = counted_calloc(width * height, sizeof(RGBpixel));
+    else
+        image_ptr->pixmap16 = counted_calloc(width * height * 3, sizeof(uint16_t));
+    image_ptr->big_endian_samples = raw;
+    roi->blocks_x = (image_ptr->width + ROI_BLOCK_SIZE - 1) / ROI_BLOCK_SIZE;
+    roi->blocks_y = (image_ptr->height + ROI_BLOCK_SIZE - 1) / ROI_BLOCK_SIZE;
+    roi->remaining = (size_t) roi->blocks_x * roi->blocks_y;
+    roi->decoded = counted_calloc(roi->remaining + 1, 1);
+    roi->bytes = raw ? NULL : counted_malloc(width * 3 * roi->bytes_per_sample * roi->tasks);
+    if (image_ptr->format == PIXEL_FORMAT_HALF)
+        roi->scratch = counted_malloc(sizeof(float) * width * 3 * roi->tasks);
+    int allocated = image_ptr->format == PIXEL_FORMAT_FLOAT ? image_ptr->pixmap != NULL : image_ptr->pixmap16 != NULL;
+    if (roi->fd < 0 || !allocated || roi->decoded == NULL || (!raw && roi->bytes == NULL) ||
+        (image_ptr->format == PIXEL_FORMAT_HALF && roi->scratch == NULL)) {
+        fprintf(stderr, "Error: Could not prepare the region of interest decoder\n");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Release everything held by a region of interest decoder, the image keeps its pixmap
+ * @param roi
+ */
+void roi_close(RoiDecoder* roi) {
+    if (roi->fd >= 0)
+        close(roi->fd);
+    roi->fd = -1;
+    free(roi->table);
+    free(roi->bytes);
+    free(roi->scratch);
+    free(roi->decoded);
+    roi->table = NULL;
+    roi->bytes = NULL;
+    roi->scratch = NULL;
+    roi->decoded = NULL;
+}
+
+#define THUMBNAIL_ROWS_PER_PIXEL 4
+
+/**
+ * Decode a P6 file straight to a thumbnail no larger than size on either
+ * side, keeping the aspect ratio. Every thumbnail pixel averages a box of the
+ * image, but only up to THUMBNAIL_ROWS_PER_PIXEL rows spread through the box
+ * are read, each with one pread at its offset in the file, so a large image
+ * costs a small part of its file and one row of memory.
+ * @param fp - Positioned just after the maximum color value
+ * @param image_ptr - Receives the thumbnail as PIXEL_FORMAT_FLOAT
+ * @param color_max
+ * @param table - Maps samples to values, required for 8 bit samples, see sample_table
+ * @param size
+ * @param buffers - Pool to take the pixels from, may be NULL
+ * @return
+ */
+int image_load_p6_thumbnail(FILE* fp, Image* image_ptr, int color_max, const float* table, uint32_t size,
+                            ImageBuffers* buffers) {
+    size_t width = image_ptr->width;
+    size_t height = image_ptr->height;
+    int bytes_per_sample = color_max < 256 ? 1 : 2;
+    size_t row_bytes = width * 3 * bytes_per_sample;
+    struct stat file_stat;
+
+    // Exactly one whitespace character separates the header from the samples
+    int c = getc(fp);
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+        fprintf(stderr, ERR_INVALID_FILE);
+        return 1;
+    }
+    off_t data_offset = ftello(fp);
+    if (fstat(fileno(fp), &file_stat) != 0 || file_stat.st_size < data_offset + (off_t) (row_bytes * height)) {
+        fprintf(stderr, ERR_UNEXPECTED_EOF);
+        return 1;
+    }
+
+    // Same fit as the contact sheet cells
+    float fit = size / (float) (width > height ? width : height);
+    uint32_t thumb_width = (uint32_t) (width * fit);
+    uint32_t thumb_height = (uint32_t) (height * fit);
+    image_ptr->width = thumb_width ? thumb_width : 1;
+    image_ptr->height = thumb_height ? thumb_height : 1;
+    image_ptr->format = PIXEL_FORMAT_FLOAT;
+    image_ptr->big_endian_samples = FALSE;
+    if (image_allocate(image_ptr, buffers) != 0)
+        return 1;
+
+    unsigned char* bytes = malloc(row_bytes);
+    float* sums = malloc(sizeof(float) * 3 * image_ptr->width);
+    if (bytes == NULL || sums == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for the image\n");
+        free(bytes);
+        free(sums);
+        return 1;
+    }
+
+    int fd = fileno(fp);
+    int result = 0;
+    uint32_t tx, ty;
+    for (ty=0; ty<image_ptr->height && result == 0; ty++) {
+        size_t y0 = ty * height / image_ptr->height;
+        size_t y1 = (ty + 1) * height / image_ptr->height;
+        size_t rows = y1 - y0 < THUMBNAIL_ROWS_PER_PIXEL ? y1 - y0 : THUMBNAIL_ROWS_PER_PIXEL;
+        size_t k;
+        memset(sums, 0, sizeof(float) * 3 * image_ptr->width);
+        for (k=0; k<rows; k++) {
+            // Rows are taken from the middle of equal parts of the box
+            size_t y = y0 + (2 * k + 1) * (y1 - y0) / (2 * rows);
+            if (pread(fd, bytes, row_bytes, data_offset + (off_t) (y * row_bytes)) != (ssize_t) row_bytes) {
+                fprintf(stderr, ERR_UNEXPECTED_EOF);
+                result = 1;
+                break;
+            }
+            for (tx=0; tx<image_ptr->width; tx++) {
+                size_t x0 = tx * width / image_ptr->width;
+                size_t x1 = (tx + 1) * width / image_ptr->width;
+                size_t x;
+                for (x=x0; x<x1; x++) {
+                    for (c=0; c<3; c++) {
+                        uint32_t value = bytes_per_sample == 1 ? bytes[x * 3 + c]
+                                                              : (uint32_t) bytes[(x * 3 + c) * 2] << 8 | bytes[(x * 3 + c) * 2 + 1];
+                        sums[tx * 3 + c] += table != NULL ? table[value] : (float) value / color_max;
+                    }
+                }
+            }
+        }
+        for (tx=0; tx<image_ptr->width; tx++) {
+            size_t columns = (tx + 1) * width / image_ptr->width - tx * width / image_ptr->width;
+            float scale = 1.0f / (columns * rows);
+            image_ptr->pixmap[(size_t) ty * image_ptr->width + tx].r = sums[tx * 3] * scale;
+            image_ptr->pixmap[(size_t) ty * image_ptr->width + tx].g = sums[tx * 3 + 1] * scale;
+            image_ptr->pixmap[(size_t) ty * image_ptr->width + tx].b = sums[tx * 3 + 2] * scale;
+        }
+    }
+    free(bytes);
+    free(sums);
+    return result;
+}
+
+/**
+ * parallel_for body reading the rows of a span at their offsets in the file
+ * and converting them in place
+ * @param span_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void roi_decode_rows(void* span_ptr, int task, size_t begin, size_t end) {
+    RoiSpan* span = span_ptr;
+    RoiDecoder* roi = span->roi;
+    size_t width = roi->image->width;
+    size_t span_bytes = (size_t) span->band.columns * 3 * roi->bytes_per_sample;
+    size_t row;
+    for (row=begin; row<end; row++) {
+        size_t first = (span->band.first_row + row) * width + span->band.first_column;
+        off_t offset = roi->data_offset + (off_t) (first * 3 * roi->bytes_per_sample);
+        unsigned char* bytes;
+        if (roi->image->format == PIXEL_FORMAT_U16)
+            bytes = (unsigned char*) &roi->image->pixmap16[first * 3];
+        else
+            bytes = roi->bytes + (size_t) task * width * 3 * roi->bytes_per_sample;
+        if (pread(roi->fd, bytes, span_bytes, offset) != (ssize_t) span_bytes) {
+            span->failed = TRUE;
+            continue;
+        }
+        image_decode_p6_span(&span->band, task, bytes, row);
+    }
+}
+
+/**
+ * Decode every block intersecting a region that has not been decoded yet,
+ * runs of neighbouring blocks in a block row are read together
+ * @param roi
+ * @param rect - Region as x0, y0, x1, y1 in pixels, exclusive at the end
+ * @param dirty - Receives the region that changed, in the same form
+ * @return The number of blocks decoded, or -1 on a read error
+ */
+int roi_decode(RoiDecoder* roi, const uint32_t rect[4], uint32_t dirty[4]) {
+    uint32_t bx0 = rect[0] / ROI_BLOCK_SIZE;
+    uint32_t by0 = rect[1] / ROI_BLOCK_SIZE;
+    uint32_t bx1 = (rect[2] + ROI_BLOCK_SIZE - 1) / ROI_BLOCK_SIZE;
+    uint32_t by1 = (rect[3] + ROI_BLOCK_SIZE - 1) / ROI_BLOCK_SIZE;
+    uint32_t bx, by, run;
+    int blocks = 0;
+    if (roi->remaining == 0)
+        return 0;
+    if (bx1 > roi->blocks_x)
+        bx1 = roi->blocks_x;
+    if (by1 > roi->blocks_y)
+        by1 = roi->blocks_y;
+
+    for (by=by0; by<by1; by++) {
+        for (bx=bx0; bx<bx1; bx=run) {
+            unsigned char* decoded = roi->decoded + (size_t) by * roi->blocks_x;
+            if (decoded[bx]) {
+                run = bx + 1;
+                continue;
+            }
+            for (run=bx; run<bx1 && !decoded[run]; run++);
+
+            uint32_t x0 = bx * ROI_BLOCK_SIZE;
+            uint32_t y0 = by * ROI_BLOCK_SIZE;
+            uint32_t x1 = run * ROI_BLOCK_SIZE < roi->image->width ? run * ROI_BLOCK_SIZE : roi->image->width;
+            uint32_t y1 = y0 + ROI_BLOCK_SIZE < roi->image->height ? y0 + ROI_BLOCK_SIZE : roi->image->height;
+            RoiSpan span = { roi, { roi->image, NULL, y0, x0, x1 - x0, roi->color_max, roi->bytes_per_sample,
+                                    roi->table, NULL, roi->scratch }, FALSE };
+            parallel_for(y1 - y0, roi->tasks, roi_decode_rows, &span);
+            if (span.failed) {
+                fprintf(stderr, "Error: Could not read a region of the image\n");
+                return -1;
+            }
+            // Blocks only count as decoded once all of their rows were read
+            memset(decoded + bx, TRUE, run - bx);
+
+            if (blocks == 0) {
+                dirty[0] = x0;
+                dirty[1] = y0;
+                dirty[2] = x1;
+                dirty[3] = y1;
+            }
+            dirty[0] = x0 < dirty[0] ? x0 : dirty[0];
+            dirty[1] = y0 < dirty[1] ? y0 : dirty[1];
+            dirty[2] = x1 > dirty[2] ? x1 : dirty[2];
+            dirty[3] = y1 > dirty[3] ? y1 : dirty[3];
+            blocks += run - bx;
+            roi->remaining -= run - bx;
+        }
+    }
+
+    // Everything is in memory, the file is no longer needed
+    if (roi->remaining == 0)
+        roi_close(roi);
+    return blocks;
+}
+
+/**
+ * Prepare tiled storage for a P6 file whose header has been read. Only the
+ * cache bookkeeping is allocated here, tile pixels are allocated as slots
+ * are first used.
+ * @param store
+ * @param fp - Positioned just past the maximum color value, stays owned by the caller
+ * @param image_ptr - Receives the dimensions, no pixels are allocated
+ * @param color_max
+ * @param table - Sample table, owned by the store from now on
+ * @param cache_bytes - Memory the decoded tiles may take up
+ * @return
+ */
+int tile_store_open(TileStore* store, FILE* fp, Image* image_ptr, int color_max, float* table, size_t cache_bytes) {
+    struct stat file_stat;
+    size_t buckets = 1;
+    size_t i;
+    memset(store, 0, sizeof(TileStore));
+    store->fd = -1;
+    store->width = image_ptr->width;
+    store->height = image_ptr->height;
+    store->tiles_x = (image_ptr->width + TILE_SIZE - 1) / TILE_SIZE;
+    store->tiles_y = (image_ptr->height + TILE_SIZE - 1) / TILE_SIZE;
+    store->color_max = color_max;
+    store->bytes_per_sample = color_max < 256 ? 1 : 2;
+    store->table = table;
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->loaded, NULL);
+
+    // Exactly one whitespace character separates the header from the samples
+    int c = getc(fp);
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+        fprintf(stderr, ERR_INVALID_FILE);
+        return 1;
+    }
+    store->data_offset = ftello(fp);
+    uint64_t data_bytes = (uint64_t) image_ptr->width * image_ptr->height * 3 * store->bytes_per_sample;
+    if (fstat(fileno(fp), &file_stat) != 0 || (uint64_t) file_stat.st_size < store->data_offset + data_bytes) {
+        fprintf(stderr, ERR_UNEXPECTED_EOF);
+        return 1;
+    }
+    store->fd = dup(fileno(fp));
+
+    // Every task rendering a view pins a tile, so there are always a few more slots than tasks
+    store->capacity = cache_bytes / (sizeof(float) * 3 * TILE_SIZE * TILE_SIZE);
+    if (store->capacity < (size_t) cpu_count() * 4 + 4)
+        store->capacity = (size_t) cpu_count() * 4 + 4;
+    while (buckets < store->capacity)
+        buckets <<= 1;
+    store->bucket_mask = buckets - 1;
+    store->slots = counted_calloc(store->capacity, sizeof(Tile));
+    store->buckets = counted_malloc(sizeof(int32_t) * buckets);
+    if (store->fd < 0 || store->slots == NULL || store->buckets == NULL) {
+        fprintf(stderr, "Error: Could not prepare the tile cache\n");
+        return 1;
+    }
+    for (i=0; i<buckets; i++)
+        store->buckets[i] = -1;
+    for (i=0; i<store->capacity; i++)
+        store->slots[i].index = UINT64_MAX;
+    image_ptr->format = PIXEL_FORMAT_FLOAT;
+    return 0;
+}
+
+/**
+ * Close the file and free every cached tile
+ * @param store
+ */
+void tile_store_close(TileStore* store) {
+    size_t i;
+    if (store->fd >= 0)
+        close(store->fd);
+    store->fd = -1;
+    for (i=0; store->slots != NULL && i<store->capacity; i++)
+        free(store->slots[i].pixels);
+    free(store->slots);
+    free(store->buckets);
+    free(store->table);
+    store->slots = NULL;
+    store->buckets = NULL;
+    store->table = NULL;
+    pthread_mutex_destroy(&store->lock);
+    pthread_cond_destroy(&store->loaded);
+}
+
+/**
+ * Find the slot caching a tile, the store lock must be held
+ * @param store
+ * @param index
+ * @return The slot or -1
+ */
+static int32_t tile_store_find(const TileStore* store, uint64_t index) {
+    int32_t slot = store->buckets[index & store->bucket_mask];
+    while (slot >= 0 && store->slots[slot].index != index)
+        slot = store->slots[slot].next;
+    return slot;
+}
+
+/**
+ * Take a slot out of its hash chain, the store lock must be held
+ * @param store
+ * @param slot
+ */
+static void tile_store_unlink(TileStore* store, int32_t slot) {
+    int32_t* link = &store->buckets[store->slots[slot].index & store->bucket_mask];
+    while (*link != slot)
+        link = &store->slots[*link].next;
+    *link = store->slots[slot].next;
+    store->slots[slot].index = UINT64_MAX;
+}
+
+/**
+ * Read the rows of a tile from the file and convert them to floats
+ * @param store
+ * @param tile
+ * @param tile_x
+ * @param tile_y
+ * @return
+ */
+static int tile_store_decode(TileStore* store, Tile* tile, uint32_t tile_x, uint32_t tile_y) {
+    uint32_t x0 = tile_x * TILE_SIZE;
+    uint32_t y0 = tile_y * TILE_SIZE;
+    uint32_t columns = store->width - x0 < TILE_SIZE ? store->width - x0 : TILE_SIZE;
+    uint32_t rows = store->height - y0 < TILE_SIZE ? store->height - y0 : TILE_SIZE;
+    size_t span_bytes = (size_t) columns * 3 * store->bytes_per_sample;
+    unsigned char bytes[TILE_SIZE * 3 * 2];
+    uint32_t row;
+
+    // The tile is decoded as a TILE_SIZE wide image with P6 band conversion
+    Image pixels;
+    memset(&pixels, 0, sizeof(Image));
+    pixels.width = TILE_SIZE;
+    pixels.height = TILE_SIZE;
+    pixels.format = PIXEL_FORMAT_FLOAT;
+    pixels.pixmap = (RGBpixel*) tile->pixels;
+    P6Band band = { &pixels, NULL, 0, 0, columns, store->color_max, store->bytes_per_sample, store->table, NULL, NULL };
+    for (row=0; row<rows; row++) {
+        uint64_t first = (uint64_t) (y0 + row) * store->width + x0;
+        off_t offset = store->data_offset + (off_t) (first * 3 * store->bytes_per_sample);
+        if (pread(store->fd, bytes, span_bytes, offset) != (ssize_t) span_bytes)
+            return 1;
+        image_decode_p6_span(&band, 0, bytes, row);
+    }
+    return 0;
+}
+
+/**
+ * Pin a tile in the cache, decoding it first if it is not there. Tiles
+ * being decoded by another thread are waited for rather than read twice.
+ * @param store
+ * @param tile_x
+ * @param tile_y
+ * @return The pinned tile, release it with tile_store_release, or NULL on a read error
+ */
+Tile* tile_store_acquire(TileStore* store, uint32_t tile_x, uint32_t tile_y) {
+    uint64_t index = (uint64_t) tile_y * store->tiles_x + tile_x;
+    int32_t slot;
+    pthread_mutex_lock(&store->lock);
+    while ((slot = tile_store_find(store, index)) >= 0 && !store->slots[slot].ready)
+        pthread_cond_wait(&store->loaded, &store->lock);
+    if (slot >= 0) {
+        Tile* tile = &store->slots[slot];
+        tile->pins++;
+        tile->last_used = ++store->clock;
+        store->hits++;
+        pthread_mutex_unlock(&store->lock);
+        return tile;
+    }
+
+    // Replace an empty slot or else the least recently used one nobody has pinned
+    size_t i;
+    slot = -1;
+    for (i=0; i<store->capacity; i++) {
+        Tile* candidate = &store->slots[i];
+        if (candidate->pins > 0)
+            continue;
+        if (candidate->index == UINT64_MAX) {
+            slot = (int32_t) i;
+            break;
+        }
+        if (slot < 0 || candidate->last_used < store->slots[slot].last_used)
+            slot = (int32_t) i;
+    }
+    if (slot < 0) {
+        pthread_mutex_unlock(&store->lock);
+        return NULL;
+    }
+    Tile* tile = &store->slots[slot];
+    if (tile->index != UINT64_MAX)
+        tile_store_unlink(store, slot);
+    tile->index = index;
+    tile->ready = FALSE;
+    tile->pins = 1;
+    tile->last_used = ++store->clock;
+    tile->next = store->buckets[index & store->bucket_mask];
+    store->buckets[index & store->bucket_mask] = slot;
+    store->misses++;
+    pthread_mutex_unlock(&store->lock);
+
+    // Decode outside the lock, other tiles can be found and decoded meanwhile
+    int result = 1;
+    if (tile->pixels == NULL)
+        tile->pixels = pixels_alloc(sizeof(float) * 3 * TILE_SIZE * TILE_SIZE, NULL);
+    if (tile->pixels != NULL)
+        result = tile_store_decode(store, tile, tile_x, tile_y);
+
+    pthread_mutex_lock(&store->lock);
+    if (result == 0) {
+        tile->ready = TRUE;
+    }
+    else {
+        tile_store_unlink(store, slot);
+        tile->pins = 0;
+        tile = NULL;
+    }
+    pthread_cond_broadcast(&store->loaded);
+    pthread_mutex_unlock(&store->lock);
+    return tile;
+}
+
+/**
+ * Unpin a tile returned by tile_store_acquire
+ * @param store
+ * @param tile
+ */
+void tile_store_release(TileStore* store, Tile* tile) {
+    pthread_mutex_lock(&store->lock);
+    tile->pins--;
+    pthread_mutex_unlock(&store->lock);
+}
+
+/**
+ * Read one pixel through the tile cache
+ * @param store
+ * @param x
+ * @param y
+ * @param rgb - Receives the pixel as values from 0 to 1
+ * @return
+ */
+int tile_store_sample(TileStore* store, uint32_t x, uint32_t y, float rgb[3]) {
+    Tile* tile = tile_store_acquire(store, x / TILE_SIZE, y / TILE_SIZE);
+    if (tile == NULL)
+        return 1;
+    memcpy(rgb, &tile->pixels[((size_t) (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE) * 3], sizeof(float) * 3);
+    tile_store_release(store, tile);
+    return 0;
+}
+
+/**
+ * A region of a tiled image being resampled into a view
+ */
+typedef struct TileView {
+    TileStore* store;
+    Image* view;
+    const uint32_t* rect;
+    int failed;
+} TileView;
+
+/**
+ * parallel_for body filling rows of a view with the nearest pixels of the
+ * region. Rows are filled a strip of columns at a time, each strip taken
+ * from a single column of tiles, so a task reads every tile it touches once
+ * however small the cache is. The current tile stays pinned until a pixel
+ * needs another one.
+ * @param view_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void tile_view_rows(void* view_ptr, int task, size_t begin, size_t end) {
+    TileView* pass = view_ptr;
+    Image* view = pass->view;
+    const uint32_t* rect = pass->rect;
+    double step_x = (double) (rect[2] - rect[0]) / view->width;
+    double step_y = (double) (rect[3] - rect[1]) / view->height;
+    Tile* tile = NULL;
+    uint32_t tile_x = 0, tile_y = 0;
+    uint32_t x0, x1, x;
+    size_t row;
+    for (x0=0; x0<view->width; x0=x1) {
+        // The strip ends where the columns cross into the next column of tiles
+        uint32_t column = (rect[0] + (uint32_t) ((x0 + 0.5) * step_x)) / TILE_SIZE;
+        for (x1=x0+1; x1<view->width && (rect[0] + (uint32_t) ((x1 + 0.5) * step_x)) / TILE_SIZE == column; x1++);
+
+        for (row=begin; row<end; row++) {
+            uint32_t sy = rect[1] + (uint32_t) ((row + 0.5) * step_y);
+            float* dst = (float*) &view->pixmap[row * view->width];
+            if (tile == NULL || column != tile_x || sy / TILE_SIZE != tile_y) {
+                if (tile != NULL)
+                    tile_store_release(pass->store, tile);
+                tile_x = column;
+                tile_y = sy / TILE_SIZE;
+                tile = tile_store_acquire(pass->store, tile_x, tile_y);
+                if (tile == NULL) {
+                    pass->failed = TRUE;
+                    return;
+                }
+            }
+            const float* src = &tile->pixels[(size_t) (sy % TILE_SIZE) * TILE_SIZE * 3];
+            for (x=x0; x<x1; x++) {
+                uint32_t sx = rect[0] + (uint32_t) ((x + 0.5) * step_x);
+                memcpy(&dst[x * 3], &src[(sx % TILE_SIZE) * 3], sizeof(float) * 3);
+            }
+        }
+    }
+    if (tile != NULL)
+        tile_store_release(pass->store, tile);
+}
+
+/**
+ * Resample a region of a tiled image into a float image, only the tiles
+ * under the sampled pixels are read
+ * @param store
+ * @param rect - Region as x0, y0, x1, y1 in pixels, exclusive at the end
+ * @param view - Receives the pixels, any earlier pixels are freed
+ * @param width
+ * @param height
+ * @return
+ */
+int tile_store_render(TileStore* store, const uint32_t rect[4], Image* view, uint32_t width, uint32_t height) {
+    image_recycle(view, NULL);
+    view->width = width;
+    view->height = height;
+    view->format = PIXEL_FORMAT_FLOAT;
+    view->layout = LAYOUT_INTERLEAVED;
+    view->color_max = store->color_max;
+    view->big_endian_samples = FALSE;
+    if (image_allocate(view, NULL) != 0)
+        return 1;
+    TileView pass = { store, view, rect, FALSE };
+    parallel_for(height, cpu_count() * 4, tile_view_rows, &pass);
+    if (pass.failed) {
+        fprintf(stderr, "Error: Could not read a tile from the source file\n");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Loads an PPM image in P3 or P6 formats into the specified image_ptr
+ * @param image_ptr
+ * @param fname
+ * @param options - Optional loading behavior, NULL for the defaults
+ * @return
+ */
+int load_image(Image* image_ptr, char* fname, LoadOptions* options) {
+    FILE* fp = fopen(fname, "r");
+    if (fp) {
+        double span = trace_begin();
+        int ppm_version = 0;
+        char buffer[IMAGE_READ_BUFFER_SIZE];
+        int bytes_read;
+        long long width;
+        long long height;
+        int color_max;
+
+        bytes_read = read_to_whitespace(fp, buffer, IMAGE_READ_BUFFER_SIZE);
+
+        // Check for the magic number
+        if (bytes_read != 2) {
+            fprintf(stderr, ERR_INVALID_FILE);
+            fclose(fp);
+            return 1;
+        }
+        if (strncmp("P3", buffer, 2) == 0) {
+            ppm_version = 3;
+        }
+        else if (strncmp("P6", buffer, 2) == 0) {
+            ppm_version = 6;
+        }
+        else {
+            fprintf(stderr, ERR_INVALID_FILE);
+            fclose(fp);
+            return 1;
+        }
+
+        // Read past the comments and whitespace
+        if (skip_whitespace(fp) != 0) {
+            fprintf(stderr, "Error: An error occurred skipping file whitespace\n");
+            fclose(fp);
+            return 1;
+        }
+
+        // We are at the first line of image header information
+        // Read in the dimensions of the image
+
+        // Read the width of the image
+        bytes_read = read_to_whitespace(fp, buffer, IMAGE_READ_BUFFER_SIZE);
+
+        if (bytes_read <= 0) {
+            fprintf(stderr, "Error: Expected a width value but read nothing\n");
+            fclose(fp);
+            return 1;
+        }
+
+        width = strtoll(buffer, NULL, 10);
+
+        if (width < 0 || width > UINT32_MAX)
+        {
+            fprintf(stderr, ERR_INVALID_FILE);
+            fclose(fp);
+            return 1;
+        }
+
+        // Read past the comments and whitespace
+        if (skip_whitespace(fp) != 0) {
+            fprintf(stderr, "Error: An error occurred skipping file whitespace\n");
+            fclose(fp);
+            return 1;
+        }
+
+        // Read the height of the image
+        bytes_read = read_to_whitespace(fp, buffer, IMAGE_READ_BUFFER_SIZE);
+
+        if (bytes_read <= 0) {
+            fprintf(stderr, "Error: Expected a height value but read nothing\n");
+            fclose(fp);
+            return 1;
+        }
+
+        height = strtoll(buffer, NULL, 10);
+
+        if (height < 0 || height > UINT32_MAX)
+        {
+            fprintf(stderr, ERR_INVALID_FILE);
+            fclose(fp);
+            return 1;
+        }
+
+        // Read past the comments and whitespace
+        if (skip_whitespace(fp) != 0) {
+            fprintf(stderr, "Error: An error occurred skipping file whitespace\n");
+            fclose(fp);
+            return 1;
+        }
+
+        // Read in the max color value
+        bytes_read = read_to_whitespace(fp, buffer, IMAGE_READ_BUFFER_SIZE);
+
+        if (bytes_read <= 0) {
+            fprintf(stderr, "Error: Expected a maximum color value but read nothing\n");
+            fclose(fp);
+            return 1;
+        }
+
+        color_max = atoi(buffer);
+
+        if (color_max < 0 || color_max > 65535)
+        {
+            fprintf(stderr, "Error: Expected maximum color value between 0 and 65536");
+            fclose(fp);
+            return 1;
+        }
+        trace_end("parse header", span);
+
+        image_ptr->width = (uint32_t) width;
+        image_ptr->height = (uint32_t) height;
+        image_ptr->color_max = color_max;
+        image_ptr->big_endian_samples = FALSE;
+        image_ptr->pixmap = NULL;
+        image_ptr->pixmap16 = NULL;
+        image_ptr->capacity = 0;
+        image_ptr->alignment = 0;
+        image_ptr->layout = LAYOUT_INTERLEAVED;
+
+        // Raw samples are only kept when there are more than 8 bits and nothing has to be converted
+        image_ptr->format = PIXEL_FORMAT_FLOAT;
+        if (options != NULL && options->format == PIXEL_FORMAT_U16 && color_max > 255 && !options->linearize)
+            image_ptr->format = PIXEL_FORMAT_U16;
+        if (options != NULL && options->format == PIXEL_FORMAT_HALF)
+            image_ptr->format = PIXEL_FORMAT_HALF;
+
+        // P6 files can be decoded a region at a time as they are shown, or kept on disk as tiles
+        RoiDecoder* roi = options != NULL && ppm_version == 6 ? options->roi : NULL;
+        TileStore* tiles = options != NULL && ppm_version == 6 ? options->tiles : NULL;
+
+        // Or read just enough of them for a thumbnail
+        uint32_t thumbnail_size = options != NULL && ppm_version == 6 ? options->thumbnail_size : 0;
+        if (thumbnail_size > 0 && width <= thumbnail_size && height <= thumbnail_size)
+            thumbnail_size = 0;
+
+        // Gather statistics in the same pass as decoding if they were asked for, they need the whole image
+        ImageStats* stats = NULL;
+        if (options != NULL && options->stats != NULL && options->histogram_bins > 0 && roi == NULL && tiles == NULL &&
+            thumbnail_size == 0) {
+            if (image_stats_init(options->stats, options->histogram_bins, color_max) != 0) {
+                fclose(fp);
+                return 1;
+            }
+            stats = options->stats;
+        }
+
+        // 8 bit and linearized samples are converted through a table
+        float* table = NULL;
+        if (color_max < 256 || (options != NULL && options->linearize)) {
+            table = sample_table(color_max, options != NULL && options->linearize);
+            if (table == NULL) {
+                fprintf(stderr, "Error: Could not allocate memory for the image\n");
+                if (stats != NULL)
+                    image_stats_free(stats);
+                fclose(fp);
+                return 1;
+            }
+        }
+
+        // Pixels come from the caller's pool when there is one
+        ImageBuffers* buffers = options != NULL ? options->buffers : NULL;
+        int result;
+        if (tiles != NULL) {
+            result = tile_store_open(tiles, fp, image_ptr, color_max, table, options->tile_cache_bytes);
+            if (result != 0)
+                tile_store_close(tiles);
+            table = NULL;
+        }
+        else if (roi != NULL) {
+            result = roi_open(roi, fp, image_ptr, color_max, table);
+            if (result != 0)
+                roi_close(roi);
+            table = NULL;
+        }
+        else if (thumbnail_size > 0)
+            result = image_load_p6_thumbnail(fp, image_ptr, color_max, table, thumbnail_size, buffers);
+        else if (image_allocate(image_ptr, buffers) != 0)
+            result = 1;
+        else if (ppm_version == 6) {
+            perf_counters_start(options != NULL ? options->counters : NULL);
+            result = image_load_p6(fp, image_ptr, color_max, stats, table);
+            perf_counters_stop(options != NULL ? options->counters : NULL);
+        }
+        else {
+            span = trace_begin();
+            perf_counters_start(options != NULL ? options->counters : NULL);
+            result = image_load_p3(fp, image_ptr, color_max, buffer, stats, table);
+            perf_counters_stop(options != NULL ? options->counters : NULL);
+            trace_end("decode p3", span);
+        }
+
+        free(table);
+
+        // Nothing allocated for a failed load outlives it
+        if (result != 0) {
+            image_recycle(image_ptr, buffers);
+            if (stats != NULL)
+                image_stats_free(stats);
+        }
+
+        fclose(fp);
+        return result;
+    }
+    else {
+        fprintf(stderr, ERR_OPEN_FILE_READING, fname);
+        return 1;
+    }
+}
+
+/**
+ * parallel_for body widening rows of 16 bit samples to floats
+ * @param image_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void image_to_float_rows(void* image_ptr, int task, size_t begin, size_t end) {
+    Image* image = image_ptr;
+    size_t first = begin * image->width * 3;
+    size_t last = end * image->width * 3;
+    float* dst = (float*) image->pixmap;
+    float color_max = (float) image->color_max;
+    int swap = image->big_endian_samples && host_is_little_endian();
+    size_t i;
+    if (image->format == PIXEL_FORMAT_HALF) {
+        for (i=first; i<last; i++)
+            dst[i] = half_to_float(image->pixmap16[i]);
+    }
+    else if (swap) {
+        for (i=first; i<last; i++)
+            dst[i] = (uint16_t) (image->pixmap16[i] << 8 | image->pixmap16[i] >> 8) / color_max;
+    }
+    else {
+        for (i=first; i<last; i++)
+            dst[i] = image->pixmap16[i] / color_max;
+    }
+}
+
+/**
+ * Convert an image to PIXEL_FORMAT_FLOAT in place, for the stages that only
+ * work on floats
+ * @param image
+ * @return
+ */
+int image_to_float(Image* image) {
+    if (image->format == PIXEL_FORMAT_FLOAT)
+        return 0;
+    size_t bytes = sizeof(RGBpixel) * image->width * image->height;
+    image->pixmap = pixels_alloc(bytes, &image->alignment);
+    if (image->pixmap == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for the image\n");
+        return 1;
+    }
+    parallel_for(image->height, cpu_count(), image_to_float_rows, image);
+    free(image->pixmap16);
+    image->pixmap16 = NULL;
+    image->capacity = bytes;
+    image->format = PIXEL_FORMAT_FLOAT;
+    image->big_endian_samples = FALSE;
+    return 0;
+}
+
+/**
+ * A conversion between pixel layouts, plane is the number of floats in one plane
+ */
+typedef struct LayoutPass {
+    const float* src;
+    float* dst;
+    size_t width;
+    size_t plane;
+} LayoutPass;
+
+/**
+ * parallel_for body splitting interleaved rows into three planes
+ * @param pass_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void layout_to_planar_rows(void* pass_ptr, int task, size_t begin, size_t end) {
+    LayoutPass* pass = pass_ptr;
+    size_t row;
+    size_t x;
+    for (row=begin; row<end; row++) {
+        const float* src = pass->src + row * pass->width * 3;
+        float* r = pass->dst + row * pass->width;
+        float* g = r + pass->plane;
+        float* b = g + pass->plane;
+        for (x=0; x<pass->width; x++) {
+            r[x] = src[x * 3];
+            g[x] = src[x * 3 + 1];
+            b[x] = src[x * 3 + 2];
+        }
+    }
+}
+
+/**
+ * parallel_for body merging three planes into interleaved rows
+ * @param pass_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void layout_to_interleaved_rows(void* pass_ptr, int task, size_t begin, size_t end) {
+    LayoutPass* pass = pass_ptr;
+    size_t row;
+    size_t x;
+    for (row=begin; row<end; row++) {
+        const float* r = pass->src + row * pass->width;
+        const float* g = r + pass->plane;
+        const float* b = g + pass->plane;
+        float* dst = pass->dst + row * pass->width * 3;
+        for (x=0; x<pass->width; x++) {
+            dst[x * 3] = r[x];
+            dst[x * 3 + 1] = g[x];
+            dst[x * 3 + 2] = b[x];
+        }
+    }
+}
+
+/**
+ * Convert an image to the layout a stage prefers, doing nothing when it
+ * already has it. Planar images are always PIXEL_FORMAT_FLOAT, so asking for
+ * LAYOUT_PLANAR converts the samples to floats first.
+ * @param image
+ * @param layout
+ * @return
+ */
+int image_set_layout(Image* image, PixelLayout layout) {
+    if (image->layout == layout)
+        return 0;
+    if (image_to_float(image) != 0)
+        return 1;
+
+    size_t bytes = sizeof(RGBpixel) * image->width * image->height;
+    size_t alignment;
+    float* pixels = pixels_alloc(bytes, &alignment);
+    if (pixels == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory to change the image layout\n");
+        return 1;
+    }
+    LayoutPass pass = { (const float*) image->pixmap, pixels, image->width, (size_t) image->width * image->height };
+    parallel_for(image->height, cpu_count(), layout == LAYOUT_PLANAR ? layout_to_planar_rows : layout_to_interleaved_rows, &pass);
+    free(image->pixmap);
+    image->pixmap = (RGBpixel*) pixels;
+    image->capacity = bytes;
+    image->alignment = alignment;
+    image->layout = layout;
+    return 0;
+}
+
+/**
+ * Convert one row of an image to floats, whatever its pixel format
+ * @param image
+ * @param row
+ * @param dst - Receives width * 3 floats
+ */
+void image_row_to_float(const Image* image, uint32_t row, float* dst) {
+    size_t count = (size_t) image->width * 3;
+    size_t first = (size_t) row * count;
+    size_t i;
+    if (image->layout == LAYOUT_PLANAR) {
+        size_t plane = (size_t) image->width * image->height;
+        const float* r = (const float*) image->pixmap + (size_t) row * image->width;
+        for (i=0; i<image->width; i++) {
+            dst[i * 3] = r[i];
+            dst[i * 3 + 1] = r[i + plane];
+            dst[i * 3 + 2] = r[i + 2 * plane];
+        }
+    }
+    else if (image->format == PIXEL_FORMAT_FLOAT) {
+        memcpy(dst, &image->pixmap[(size_t) row * image->width], sizeof(float) * count);
+    }
+    else if (image->format == PIXEL_FORMAT_HALF) {
+        for (i=0; i<count; i++)
+            dst[i] = half_to_float(image->pixmap16[first + i]);
+    }
+    else if (image->big_endian_samples && host_is_little_endian()) {
+        for (i=0; i<count; i++) {
+            uint16_t sample = image->pixmap16[first + i];
+            dst[i] = (uint16_t) (sample << 8 | sample >> 8) / (float) image->color_max;
+        }
+    }
+    else {
+        for (i=0; i<count; i++)
+            dst[i] = image->pixmap16[first + i] / (float) image->color_max;
+    }
+}
+
+/**
+ * Read one pixel of an image of any pixel format
+ * @param image
+ * @param x
+ * @param y
+ * @param rgb - Receives the normalized samples
+ */
+void image_sample(const Image* image, uint32_t x, uint32_t y, float rgb[3]) {
+    size_t i = (size_t) y * image->width + x;
+    int c;
+    if (image->layout == LAYOUT_PLANAR) {
+        size_t plane = (size_t) image->width * image->height;
+        for (c=0; c<3; c++)
+            rgb[c] = ((const float*) image->pixmap)[c * plane + i];
+        return;
+    }
+    if (image->format == PIXEL_FORMAT_FLOAT) {
+        rgb[0] = image->pixmap[i].r;
+        rgb[1] = image->pixmap[i].g;
+        rgb[2] = image->pixmap[i].b;
+        return;
+    }
+    for (c=0; c<3; c++) {
+        uint16_t sample = image->pixmap16[i * 3 + c];
+        if (image->format == PIXEL_FORMAT_HALF)
+            rgb[c] = half_to_float(sample);
+        else if (image->big_endian_samples && host_is_little_endian())
+            rgb[c] = (uint16_t) (sample << 8 | sample >> 8) / (float) image->color_max;
+        else
+            rgb[c] = sample / (float) image->color_max;
+    }
+}
+
+/**
+ * Free the pixels of an image
+ * @param image
+ */
+void image_free(Image* image) {
+    image_recycle(image, NULL);
+}
+
+/**
+ * Write an image of any pixel format as a P3 or P6 file with the image's
+ * maximum color value
+ * @param image
+ * @param fname
+ * @param ppm_version - 3 or 6
+ * @return
+ */
+int image_write(const Image* image, const char* fname, int ppm_version) {
+    FILE* fp = fopen(fname, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Could not open destination file for writing '%s'\n", fname);
+        return 1;
+    }
+    int color_max = image->color_max > 0 ? image->color_max : 255;
+    int bytes_per_sample = color_max < 256 ? 1 : 2;
+    size_t count = (size_t) image->width * 3;
+    float* row = malloc(sizeof(float) * count);
+    unsigned char* bytes = malloc(count * bytes_per_sample);
+    if (row == NULL || bytes == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for writing '%s'\n", fname);
+        free(row);
+        free(bytes);
+        fclose(fp);
+        return 1;
+    }
+
+    int result = 0;
+    uint32_t y;
+    size_t i;
+    fprintf(fp, "P%i\n%u %u\n%i\n", ppm_version, image->width, image->height, color_max);
+    for (y=0; y<image->height && result == 0; y++) {
+        image_row_to_float(image, y, row);
+        for (i=0; i<count; i++) {
+            float sample = row[i] * color_max + 0.5f;
+            unsigned int quantized = sample <= 0 ? 0 : (sample >= color_max ? (unsigned int) color_max : (unsigned int) sample);
+            if (ppm_version == 3) {
+                fprintf(fp, i % 3 == 2 ? "%u\n" : "%u ", quantized);
+            }
+            else if (bytes_per_sample == 1) {
+                bytes[i] = (unsigned char) quantized;
+            }
+            else {
+                bytes[i * 2] = (unsigned char) (quantized >> 8);
+                bytes[i * 2 + 1] = (unsigned char) quantized;
+            }
+        }
+        if (ppm_version == 6 && fwrite(bytes, bytes_per_sample, count, fp) != count)
+            result = 1;
+    }
+    free(row);
+    free(bytes);
+    if (fclose(fp) != 0)
+        result = 1;
+    if (result != 0)
+        fprintf(stderr, "Error: Could not write to '%s'\n", fname);
+    return result;
+}
+
+#define FILTER_TILE_ROWS 32
+#define FILTER_STRIP_FLOATS 4096
+#define FILTER_MAX 16
+
+// Filters convolve one plane at a time
+#define FILTER_LAYOUT LAYOUT_PLANAR
+
+/**
+ * Filter types
+ */
+typedef enum FilterType {
+    FILTER_GAUSSIAN,
+    FILTER_BOX,
+    FILTER_UNSHARP
+} FilterType;
+
+/**
+ * Filter, size is the Gaussian sigma or the box radius in pixels and amount
+ * is the unsharp mask strength
+ */
+typedef struct Filter {
+    FilterType type;
+    float size;
+    float amount;
+} Filter;
+
+/**
+ * Symmetric convolution kernel of 2 * radius + 1 weights
+ */
+typedef struct Kernel {
+    int radius;
+    float* weights;
+} Kernel;
+
+/**
+ * One pass of a separable convolution over rows of floats, channels is 3
+ * for interleaved RGB and 1 for a single plane of a planar image
+ */
+typedef struct ConvolvePass {
+    const float* src;
+    float* dst;
+    size_t width;
+    size_t height;
+    int channels;
+    const Kernel* kernel;
+    float* scratch;
+} ConvolvePass;
+
+/**
+ * The sharpening step of an unsharp mask
+ */
+typedef struct UnsharpPass {
+    const float* blurred;
+    float* image;
+    size_t width;
+    float amount;
+} UnsharpPass;
+
+/**
+ * Parse a filter from the command line, gaussian:<sigma>, box:<radius>, or
+ * unsharp:<sigma>:<amount>
+ * @param spec
+ * @param filter
+ * @return
+ */
+int filter_parse(const char* spec, Filter* filter) {
+    const char* args = strchr(spec, ':');
+    filter->amount = 1.0f;
+    if (args == NULL) {
+        fprintf(stderr, "Error: Expected a filter like gaussian:2 but got '%s'\n", spec);
+        return 1;
+    }
+    if (strncmp(spec, "gaussian:", 9) == 0)
+        filter->type = FILTER_GAUSSIAN;
+    else if (strncmp(spec, "box:", 4) == 0)
+        filter->type = FILTER_BOX;
+    else if (strncmp(spec, "unsharp:", 8) == 0)
+        filter->type = FILTER_UNSHARP;
+    else {
+        fprintf(stderr, "Error: Unknown filter '%s'\n", spec);
+        return 1;
+    }
+    filter->size = (float) atof(args + 1);
+    args = strchr(args + 1, ':');
+    if (args != NULL)
+        filter->amount = (float) atof(args + 1);
+    if (filter->size <= 0) {
+        fprintf(stderr, "Error: The filter size must be greater than 0 in '%s'\n", spec);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Build a normalized Gaussian kernel reaching out to 3 sigma
+ * @param kernel
+ * @param sigma
+ * @return
+ */
+int kernel_gaussian(Kernel* kernel, float sigma) {
+    int i;
+    float sum = 0;
+    kernel->radius = (int) ceilf(sigma * 3);
+    kernel->weights = malloc(sizeof(float) * (2 * kernel->radius + 1));
+    if (kernel->weights == NULL) {
+        fprintf(stderr, "Error: Could not allocate the filter kernel\n");
+        return 1;
+    }
+    for (i=-kernel->radius; i<=kernel->radius; i++) {
+        kernel->weights[i + kernel->radius] = expf(-(i * i) / (2 * sigma * sigma));
+        sum += kernel->weights[i + kernel->radius];
+    }
+    for (i=0; i<2 * kernel->radius + 1; i++)
+        kernel->weights[i] /= sum;
+    return 0;
+}
+
+/**
+ * Build a box kernel
+ * @param kernel
+ * @param radius
+ * @return
+ */
+int kernel_box(Kernel* kernel, int radius) {
+    int i;
+    kernel->radius = radius;
+    kernel->weights = malloc(sizeof(float) * (2 * radius + 1));
+    if (kernel->weights == NULL) {
+        fprintf(stderr, "Error: Could not allocate the filter kernel\n");
+        return 1;
+    }
+    for (i=0; i<2 * radius + 1; i++)
+        kernel->weights[i] = 1.0f / (2 * radius + 1);
+    return 0;
+}
+
+/**
+ * parallel_for body for the horizontal pass. Each row is copied into a
+ * scratch row padded with clamped edge pixels so the inner loop has no
+ * branches and runs over contiguous floats the compiler can vectorize.
+ * @param pass_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void convolve_rows(void* pass_ptr, int task, size_t begin, size_t end) {
+    ConvolvePass* pass = pass_ptr;
+    size_t width = pass->width;
+    int channels = pass->channels;
+    int radius = pass->kernel->radius;
+    float* padded = pass->scratch + (size_t) task * 3 * (width + 2 * radius);
+    size_t row;
+    size_t i;
+    int k;
+
+    for (row=begin; row<end; row++) {
+        const float* src = pass->src + row * width * channels;
+        float* dst = pass->dst + row * width * channels;
+
+        memcpy(padded + radius * channels, src, sizeof(float) * channels * width);
+        for (k=0; k<radius; k++) {
+            memcpy(padded + k * channels, src, sizeof(float) * channels);
+            memcpy(padded + (radius + width + k) * channels, src + (width - 1) * channels, sizeof(float) * channels);
+        }
+
+        for (i=0; i<width * channels; i++)
+            dst[i] = 0;
+        for (k=0; k<2 * radius + 1; k++) {
+            const float weight = pass->kernel->weights[k];
+            const float* tap = padded + k * channels;
+            for (i=0; i<width * channels; i++)
+                dst[i] += weight * tap[i];
+        }
+    }
+}
+
+/**
+ * parallel_for body for the vertical pass over tiles of FILTER_TILE_ROWS rows
+ * by FILTER_STRIP_FLOATS floats, small enough that the output strip and the
+ * source strips it reads stay in cache
+ * @param pass_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void convolve_columns(void* pass_ptr, int task, size_t begin, size_t end) {
+    ConvolvePass* pass = pass_ptr;
+    size_t stride = pass->width * pass->channels;
+    size_t strips = (stride + FILTER_STRIP_FLOATS - 1) / FILTER_STRIP_FLOATS;
+    int radius = pass->kernel->radius;
+    size_t tile;
+    size_t row;
+    size_t i;
+    int k;
+    for (tile=begin; tile<end; tile++) {
+        size_t first_row = (tile / strips) * FILTER_TILE_ROWS;
+        size_t last_row = first_row + FILTER_TILE_ROWS < pass->height ? first_row + FILTER_TILE_ROWS : pass->height;
+        size_t x0 = (tile % strips) * FILTER_STRIP_FLOATS;
+        size_t x1 = x0 + FILTER_STRIP_FLOATS < stride ? x0 + FILTER_STRIP_FLOATS : stride;
+        for (row=first_row; row<last_row; row++) {
+            float* dst = pass->dst + row * stride;
+            for (i=x0; i<x1; i++)
+                dst[i] = 0;
+            for (k=-radius; k<=radius; k++) {
+                long y = (long) row + k;
+                if (y < 0)
+                    y = 0;
+                if (y >= (long) pass->height)
+                    y = (long) pass->height - 1;
+                const float weight = pass->kernel->weights[k + radius];
+                const float* src = pass->src + y * stride;
+                for (i=x0; i<x1; i++)
+                    dst[i] += weight * src[i];
+            }
+        }
+    }
+}
+
+/**
+ * Convolve a float image with a separable kernel, horizontally and then
+ * vertically, on the worker pool
+ * @param image
+ * @param kernel
+ * @param dst - Receives the result, may be image->pixmap
+ * @return
+ */
+int image_convolve_separable(Image* image, const Kernel* kernel, RGBpixel* dst) {
+    size_t width = image->width;
+    size_t height = image->height;
+    int tasks = cpu_count() * 4;
+    float* temp = pixels_alloc(sizeof(float) * 3 * width * height, NULL);
+    float* scratch = malloc(sizeof(float) * 3 * (width + 2 * kernel->radius) * tasks);
+    if (temp == NULL || scratch == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for the filter\n");
+        free(temp);
+        free(scratch);
+        return 1;
+    }
+
+    // A planar image is convolved one plane at a time, so the taps are always contiguous
+    int planes = image->layout == LAYOUT_PLANAR ? 3 : 1;
+    int channels = 3 / planes;
+    size_t plane_floats = width * height * channels;
+    size_t strips = (width * channels + FILTER_STRIP_FLOATS - 1) / FILTER_STRIP_FLOATS;
+    size_t tiles = (height + FILTER_TILE_ROWS - 1) / FILTER_TILE_ROWS * strips;
+    int plane;
+    for (plane=0; plane<planes; plane++) {
+        ConvolvePass pass = { (float*) image->pixmap + plane * plane_floats, temp + plane * plane_floats,
+                              width, height, channels, kernel, scratch };
+        parallel_for(height, tasks, convolve_rows, &pass);
+        pass.src = temp + plane * plane_floats;
+        pass.dst = (float*) dst + plane * plane_floats;
+        parallel_for(tiles, tasks, convolve_columns, &pass);
+    }
+
+    free(temp);
+    free(scratch);
+    return 0;
+}
+
+/**
+ * parallel_for body adding back the difference from the blurred image
+ * @param pass_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void unsharp_rows(void* pass_ptr, int task, size_t begin, size_t end) {
+    UnsharpPass* pass = pass_ptr;
+    float* image = pass->image;
+    const float* blurred = pass->blurred;
+    size_t i;
+    for (i=begin * pass->width * 3; i<end * pass->width * 3; i++)
+        image[i] += pass->amount * (image[i] - blurred[i]);
+}
+
+/**
+ * Apply a filter to an image in place, converting it to planar floats first
+ * @param image
+ * @param filter
+ * @return
+ */
+int image_apply_filter(Image* image, const Filter* filter) {
+    Kernel kernel;
+    int result;
+    if (image_set_layout(image, FILTER_LAYOUT) != 0)
+        return 1;
+    if (image->width == 0 || image->height == 0)
+        return 0;
+
+    if (filter->type == FILTER_BOX)
+        result = kernel_box(&kernel, (int) filter->size);
+    else
+        result = kernel_gaussian(&kernel, filter->size);
+    if (result != 0)
+        return 1;
+
+    if (filter->type != FILTER_UNSHARP) {
+        result = image_convolve_separable(image, &kernel, image->pixmap);
+    }
+    else {
+        // Unsharp mask, image + amount * (image - blur(image))
+        RGBpixel* blurred = pixels_alloc(sizeof(RGBpixel) * image->width * image->height, NULL);
+        result = 1;
+        if (blurred == NULL)
+            fprintf(stderr, "Error: Could not allocate memory for the filter\n");
+        else if (image_convolve_separable(image, &kernel, blurred) == 0) {
+            UnsharpPass pass = { (float*) blurred, (float*) image->pixmap, image->width, filter->amount };
+            parallel_for(image->height, cpu_count(), unsharp_rows, &pass);
+            result = 0;
+        }
+        free(blurred);
+    }
+    free(kernel.weights);
+    return result;
+}
+
+/**
+ * Downsample an image into dst with a box filter, each destination pixel is
+ * the area weighted average of the source pixels it covers
+ * @param src
+ * @param dst - Receives a newly allocated pixmap
+ * @param width
+ * @param height
+ * @return
+ */
+int image_downsample_box(Image* src, Image* dst, uint32_t width, uint32_t height) {
+    memset(dst, 0, sizeof(Image));
+    dst->width = width;
+    dst->height = height;
+    dst->format = PIXEL_FORMAT_FLOAT;
+    dst->color_max = src->color_max;
+    if (image_allocate(dst, NULL) != 0)
+        return 1;
+
+    float x_ratio = src->width / (float) width;
+    float y_ratio = src->height / (float) height;
+    uint32_t i, j, x, y;
+    for (i=0; i<height; i++) {
+        uint32_t y0 = (uint32_t) (i * y_ratio);
+        uint32_t y1 = (uint32_t) ((i + 1) * y_ratio);
+        if (y1 <= y0)
+            y1 = y0 + 1;
+        if (y1 > src->height)
+            y1 = src->height;
+        for (j=0; j<width; j++) {
+            uint32_t x0 = (uint32_t) (j * x_ratio);
+            uint32_t x1 = (uint32_t) ((j + 1) * x_ratio);
+            if (x1 <= x0)
+                x1 = x0 + 1;
+            if (x1 > src->width)
+                x1 = src->width;
+            RGBpixel sum = { 0, 0, 0 };
+            for (y=y0; y<y1; y++) {
+                RGBpixel* row = &src->pixmap[(size_t) y * src->width];
+                for (x=x0; x<x1; x++) {
+                    sum.r += row[x].r;
+                    sum.g += row[x].g;
+                    sum.b += row[x].b;
+                }
+            }
+            float count = (float) ((y1 - y0) * (x1 - x0));
+            dst->pixmap[(size_t) i * width + j].r = sum.r / count;
+            dst->pixmap[(size_t) i * width + j].g = sum.g / count;
+            dst->pixmap[(size_t) i * width + j].b = sum.b / count;
+        }
+    }
+    return 0;
+}
+
+#define LANCZOS_LOBES 3
+
+/**
+ * Source taps and weights for every destination pixel along one axis,
+ * indices are already clamped to the edge
+ */
+typedef struct ResampleAxis {
+    int taps;
+    uint32_t* index;
+    float* weights;
+} ResampleAxis;
+
+/**
+ * State shared by the two passes of a Lanczos resample
+ */
+typedef struct LanczosPass {
+    const Image* src;
+    uint32_t width;
+    const ResampleAxis* columns;
+    const ResampleAxis* rows;
+    float* temp;
+    float* scratch;
+    float* dst;
+} LanczosPass;
+
+/**
+ * Evaluate the Lanczos-3 kernel
+ * @param x
+ * @return
+ */
+float lanczos(float x) {
+    if (x == 0)
+        return 1.0f;
+    if (x <= -LANCZOS_LOBES || x >= LANCZOS_LOBES)
+        return 0.0f;
+    float px = (float) M_PI * x;
+    return LANCZOS_LOBES * sinf(px) * sinf(px / LANCZOS_LOBES) / (px * px);
+}
+
+/**
+ * Compute the normalized Lanczos taps for resampling src_size pixels into
+ * dst_size pixels, the kernel is stretched by the ratio when shrinking
+ * @param axis
+ * @param src_size
+ * @param dst_size
+ * @return
+ */
+int resample_axis_init(ResampleAxis* axis, uint32_t src_size, uint32_t dst_size) {
+    double scale = (double) src_size / dst_size;
+    double stretch = scale > 1.0 ? scale : 1.0;
+    double support = LANCZOS_LOBES * stretch;
+    uint32_t i;
+    int t;
+
+    axis->taps = (int) ceil(2.0 * support) + 1;
+    axis->index = malloc(sizeof(uint32_t) * dst_size * axis->taps);
+    axis->weights = malloc(sizeof(float) * dst_size * axis->taps);
+    if (axis->index == NULL || axis->weights == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for the resampler\n");
+        free(axis->index);
+        free(axis->weights);
+        return 1;
+    }
+
+    for (i=0; i<dst_size; i++) {
+        double center = (i + 0.5) * scale - 0.5;
+        long first = (long) floor(center - support) + 1;
+        uint32_t* index = axis->index + (size_t) i * axis->taps;
+        float* weights = axis->weights + (size_t) i * axis->taps;
+        float sum = 0;
+        for (t=0; t<axis->taps; t++) {
+            long x = first + t;
+            weights[t] = lanczos((float) ((x - center) / stretch));
+            index[t] = x < 0 ? 0 : (x >= (long) src_size ? src_size - 1 : (uint32_t) x);
+            sum += weights[t];
+        }
+        for (t=0; t<axis->taps; t++)
+            weights[t] /= sum;
+    }
+    return 0;
+}
+
+/**
+ * Free the taps of a resample axis
+ * @param axis
+ */
+void resample_axis_free(ResampleAxis* axis) {
+    free(axis->index);
+    free(axis->weights);
+}
+
+/**
+ * parallel_for body for the horizontal pass, every source row is converted
+ * to floats and resampled to the destination width
+ * @param pass_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void lanczos_rows(void* pass_ptr, int task, size_t begin, size_t end) {
+    LanczosPass* pass = pass_ptr;
+    const ResampleAxis* columns = pass->columns;
+    float* row = pass->scratch + (size_t) task * pass->src->width * 3;
+    size_t y;
+    uint32_t x;
+    int t;
+    for (y=begin; y<end; y++) {
+        float* dst = pass->temp + y * pass->width * 3;
+        image_row_to_float(pass->src, (uint32_t) y, row);
+        for (x=0; x<pass->width; x++) {
+            const uint32_t* index = columns->index + (size_t) x * columns->taps;
+            const float* weights = columns->weights + (size_t) x * columns->taps;
+            float r = 0, g = 0, b = 0;
+            for (t=0; t<columns->taps; t++) {
+                const float* tap = row + (size_t) index[t] * 3;
+                r += weights[t] * tap[0];
+                g += weights[t] * tap[1];
+                b += weights[t] * tap[2];
+            }
+            dst[x * 3] = r;
+            dst[x * 3 + 1] = g;
+            dst[x * 3 + 2] = b;
+        }
+    }
+}
+
+/**
+ * parallel_for body for the vertical pass, each destination row is a
+ * weighted sum of whole rows so the inner loop runs over contiguous floats
+ * the compiler can vectorize
+ * @param pass_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void lanczos_columns(void* pass_ptr, int task, size_t begin, size_t end) {
+    LanczosPass* pass = pass_ptr;
+    const ResampleAxis* rows = pass->rows;
+    size_t stride = (size_t) pass->width * 3;
+    size_t y;
+    size_t i;
+    int t;
+    for (y=begin; y<end; y++) {
+        float* dst = pass->dst + y * stride;
+        const uint32_t* index = rows->index + y * rows->taps;
+        const float* weights = rows->weights + y * rows->taps;
+        for (i=0; i<stride; i++)
+            dst[i] = 0;
+        for (t=0; t<rows->taps; t++) {
+            const float weight = weights[t];
+            const float* src = pass->temp + index[t] * stride;
+            if (weight == 0)
+                continue;
+            for (i=0; i<stride; i++)
+                dst[i] += weight * src[i];
+        }
+    }
+}
+
+/**
+ * Resample an image of any pixel format into dst with a separable Lanczos-3
+ * filter, horizontally and then vertically, on the worker pool
+ * @param src
+ * @param dst - Receives a newly allocated float pixmap
+ * @param width
+ * @param height
+ * @return
+ */
+int image_resample_lanczos(const Image* src, Image* dst, uint32_t width, uint32_t height) {
+    ResampleAxis columns;
+    ResampleAxis rows;
+    int tasks = cpu_count() * 4;
+    memset(dst, 0, sizeof(Image));
+    dst->width = width;
+    dst->height = height;
+    dst->format = PIXEL_FORMAT_FLOAT;
+    dst->color_max = src->color_max;
+    if (image_allocate(dst, NULL) != 0)
+        return 1;
+    if (resample_axis_init(&columns, src->width, width) != 0) {
+        image_free(dst);
+        return 1;
+    }
+    if (resample_axis_init(&rows, src->height, height) != 0) {
+        resample_axis_free(&columns);
+        image_free(dst);
+        return 1;
+    }
+
+    float* temp = pixels_alloc(sizeof(float) * 3 * width * src->height, NULL);
+    float* scratch = malloc(sizeof(float) * 3 * src->width * tasks);
+    int result = 1;
+    if (temp == NULL || scratch == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for the resampler\n");
+    }
+    else {
+        LanczosPass pass = { src, width, &columns, &rows, temp, scratch, (float*) dst->pixmap };
+        parallel_for(src->height, tasks, lanczos_rows, &pass);
+        parallel_for(height, tasks, lanczos_columns, &pass);
+        result = 0;
+    }
+
+    free(temp);
+    free(scratch);
+    resample_axis_free(&columns);
+    resample_axis_free(&rows);
+    if (result != 0) {
+        image_free(dst);
+    }
+    return result;
+}
+
+#define BC1_BLOCK_BYTES 8
+
+/**
+ * Pack an 8 bit color into RGB565
+ * @param rgb
+ * @return
+ */
+static uint16_t rgb_to_565(const int rgb[3]) {
+    return (uint16_t) ((rgb[0] >> 3) << 11 | (rgb[1] >> 2) << 5 | rgb[2] >> 3);
+}
+
+/**
+ * Expand an RGB565 color to 8 bits per channel the way the GPU does
+ * @param color
+ * @param rgb
+ */
+static void rgb_from_565(uint16_t color, int rgb[3]) {
+    int r = (color >> 11) & 31;
+    int g = (color >> 5) & 63;
+    int b = color & 31;
+    rgb[0] = r << 3 | r >> 2;
+    rgb[1] = g << 2 | g >> 4;
+    rgb[2] = b << 3 | b >> 2;
+}
+
+/**
+ * Order two endpoints for four color mode and pick the nearest palette
+ * color for every pixel
+ * @param pixels - 16 pixels in rows of four
+ * @param color0 - Endpoint, swapped with color1 if it is the smaller
+ * @param color1
+ * @param indices - Receives two bits per pixel, the first pixel lowest
+ * @return The squared error of the block
+ */
+static int bc1_fit_indices(const unsigned char pixels[16][3], uint16_t* color0, uint16_t* color1, uint32_t* indices) {
+    int palette[4][3];
+    int error = 0;
+    int i, c;
+    // The first endpoint has to be the larger one to select four colors
+    if (*color0 < *color1) {
+        uint16_t swap = *color0;
+        *color0 = *color1;
+        *color1 = swap;
+    }
+    rgb_from_565(*color0, palette[0]);
+    rgb_from_565(*color1, palette[1]);
+    for (c=0; c<3; c++) {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+    *indices = 0;
+    for (i=0; i<16; i++) {
+        int best = 0;
+        int best_distance = INT32_MAX;
+        int p;
+        // Equal endpoints are three color mode, where only index 0 is safe
+        for (p=0; p<(*color0 != *color1 ? 4 : 1); p++) {
+            int dr = pixels[i][0] - palette[p][0];
+            int dg = pixels[i][1] - palette[p][1];
+            int db = pixels[i][2] - palette[p][2];
+            int distance = dr * dr + dg * dg + db * db;
+            if (distance < best_distance) {
+                best_distance = distance;
+                best = p;
+            }
+        }
+        *indices |= (uint32_t) best << (2 * i);
+        error += best_distance;
+    }
+    return error;
+}
+
+/**
+ * Encode a 4x4 block as BC1. The endpoints start at the corners of the
+ * block's color bounding box inset by a sixteenth of its size, every pixel
+ * takes the nearest of the four palette colors, and the endpoints are then
+ * refit once by least squares to those choices. This is far faster than
+ * an iterative cluster fit and close in quality for photographic images.
+ * @param pixels - 16 pixels in rows of four
+ * @param block - Receives BC1_BLOCK_BYTES bytes
+ */
+void bc1_encode_block(const unsigned char pixels[16][3], unsigned char* block) {
+    int low[3] = { 255, 255, 255 };
+    int high[3] = { 0, 0, 0 };
+    int i, c;
+    for (i=0; i<16; i++) {
+        for (c=0; c<3; c++) {
+            low[c] = pixels[i][c] < low[c] ? pixels[i][c] : low[c];
+            high[c] = pixels[i][c] > high[c] ? pixels[i][c] : high[c];
+        }
+    }
+    for (c=0; c<3; c++) {
+        int inset = (high[c] - low[c]) >> 4;
+        low[c] += inset;
+        high[c] -= inset;
+    }
+    uint16_t color0 = rgb_to_565(high);
+    uint16_t color1 = rgb_to_565(low);
+    uint32_t indices;
+    int error = bc1_fit_indices(pixels, &color0, &color1, &indices);
+
+    // One least squares refit of the endpoints to the chosen indices
+    if (error > 0 && color0 != color1) {
+        static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+        float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+        for (i=0; i<16; i++) {
+            float a = weights[(indices >> (2 * i)) & 3];
+            float b = 1.0f - a;
+            aa += a * a;
+            ab += a * b;
+            bb += b * b;
+            for (c=0; c<3; c++) {
+                ax[c] += a * pixels[i][c];
+                bx[c] += b * pixels[i][c];
+            }
+        }
+        float det = aa * bb - ab * ab;
+        if (fabsf(det) > 1e-6f) {
+            int refit0[3], refit1[3];
+            for (c=0; c<3; c++) {
+                float first = (ax[c] * bb - bx[c] * ab) / det + 0.5f;
+                float second = (bx[c] * aa - ax[c] * ab) / det + 0.5f;
+                refit0[c] = first <= 0 ? 0 : (first >= 255 ? 255 : (int) first);
+                refit1[c] = second <= 0 ? 0 : (second >= 255 ? 255 : (int) second);
+            }
+            uint16_t refit_color0 = rgb_to_565(refit0);
+            uint16_t refit_color1 = rgb_to_565(refit1);
+            uint32_t refit_indices;
+            if (bc1_fit_indices(pixels, &refit_color0, &refit_color1, &refit_indices) < error) {
+                color0 = refit_color0;
+                color1 = refit_color1;
+                indices = refit_indices;
+            }
+        }
+    }
+
+    block[0] = (unsigned char) color0;
+    block[1] = (unsigned char) (color0 >> 8);
+    block[2] = (unsigned char) color1;
+    block[3] = (unsigned char) (color1 >> 8);
+    block[4] = (unsigned char) indices;
+    block[5] = (unsigned char) (indices >> 8);
+    block[6] = (unsigned char) (indices >> 16);
+    block[7] = (unsigned char) (indices >> 24);
+}
+
+/**
+ * A BC1 encode in progress
+ */
+typedef struct Bc1Pass {
+    const Image* image;
+    unsigned char* blocks;
+    uint32_t blocks_x;
+    float* scratch;
+} Bc1Pass;
+
+/**
+ * parallel_for body encoding rows of blocks. The four image rows of a block
+ * row are converted to floats together, edge blocks repeat the last row
+ * and column.
+ * @param pass_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void bc1_encode_rows(void* pass_ptr, int task, size_t begin, size_t end) {
+    Bc1Pass* pass = pass_ptr;
+    const Image* image = pass->image;
+    size_t row_floats = (size_t) image->width * 3;
+    float* rows = pass->scratch + (size_t) task * 4 * row_floats;
+    unsigned char pixels[16][3];
+    size_t block_row;
+    uint32_t bx, x, y;
+    int c;
+    for (block_row=begin; block_row<end; block_row++) {
+        for (y=0; y<4; y++) {
+            uint32_t row = (uint32_t) block_row * 4 + y;
+            image_row_to_float(image, row < image->height ? row : image->height - 1, rows + y * row_floats);
+        }
+        for (bx=0; bx<pass->blocks_x; bx++) {
+            for (y=0; y<4; y++) {
+                for (x=0; x<4; x++) {
+                    uint32_t column = bx * 4 + x < image->width ? bx * 4 + x : image->width - 1;
+                    const float* src = rows + y * row_floats + (size_t) column * 3;
+                    for (c=0; c<3; c++) {
+                        float value = src[c] * 255.0f + 0.5f;
+                        pixels[y * 4 + x][c] = value <= 0 ? 0 : (value >= 255 ? 255 : (unsigned char) value);
+                    }
+                }
+            }
+            bc1_encode_block((const unsigned char (*)[3]) pixels,
+                             pass->blocks + ((size_t) block_row * pass->blocks_x + bx) * BC1_BLOCK_BYTES);
+        }
+    }
+}
+
+/**
+ * Encode an image of any pixel format as BC1 blocks on the worker pool,
+ * samples are quantized to 8 bits first
+ * @param image
+ * @param size - Receives the size of the encoded image in bytes
+ * @return The blocks in row order, free when done, or NULL
+ */
+unsigned char* image_encode_bc1(const Image* image, size_t* size) {
+    uint32_t blocks_x = (image->width + 3) / 4;
+    uint32_t blocks_y = (image->height + 3) / 4;
+    int tasks = cpu_count() * 4;
+    *size = (size_t) blocks_x * blocks_y * BC1_BLOCK_BYTES;
+    unsigned char* blocks = malloc(*size > 0 ? *size : 1);
+    float* scratch = malloc(sizeof(float) * 4 * 3 * image->width * tasks);
+    if (blocks == NULL || scratch == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for texture compression\n");
+        free(blocks);
+        free(scratch);
+        return NULL;
+    }
+    Bc1Pass pass = { image, blocks, blocks_x, scratch };
+    parallel_for(blocks_y, tasks, bc1_encode_rows, &pass);
+    free(scratch);
+    return blocks;
+}
+
+/**
+ * GLFW Window
+ */
+GLFWwindow* window;
+
+/**
+ * Vertex Struct
+ */
+typedef struct {
+    float position[3];
+    float color[4];
+    float texcords[2];
+} Vertex;
+
+/**
+ * A simple set of vertieces that define a square with correctly mapped texture cords
+ */
+const Vertex Vertices[] = {
+        {{1, -1, 0}, {1, 1, 1, 1}, {1, 1}},
+        {{1, 1, 0}, {1, 1, 1, 1}, {1, 0}},
+        {{-1, 1, 0}, {1, 1, 1, 1}, {0, 0}},
+        {{-1, -1, 0}, {1, 1, 1, 1}, {0, 1}}
+};
+
+/**
+ * Specifies the connections between vertices
+ */
+const GLubyte Indices[] = {
+        0, 1, 2,
+        2, 3, 0
+};
+
+/**
+ * The vertex shader for the applciation, this is where almost all the
+ * action happens in reguards to transformations of the image. We simply
+ * pass values for Scale, Translation, Shear, and Rotation into here and
+ * the shader performs the appropriate matrix operations to transform the
+ * displayed underlying geometry.
+ */
+char* vertex_shader_src =
+        "attribute vec4 Position;\n"
+        "attribute vec4 SourceColor;\n"
+        "attribute vec2 SourceTexcoord;\n"
+        "uniform vec2 Scale;\n"
+        "uniform vec2 Translation;"
+        "uniform vec2 Shear;\n"
+        "uniform float Rotation;\n"
+        "varying vec4 DestinationColor;\n"
+        "varying vec2 DestinationTexcoord;\n"
+        "mat4 RotationMatrix = mat4( cos(Rotation), -sin(Rotation), 0.0, 0.0,\n"
+        "                            sin(Rotation),  cos(Rotation), 0.0, 0.0,\n"
+        "                            0.0,            0.0,           1.0, 0.0,\n"
+        "                            0.0,            0.0,           0.0, 1.0 );\n"
+        "\n"
+        "mat4 TranslationMatrix = mat4(1.0, 0.0, 0.0, Translation.x,\n"
+        "                              0.0, 1.0, 0.0, Translation.y,\n"
+        "                              0.0, 0.0, 1.0, 0.0,\n"
+        "                              0.0, 0.0, 0.0, 1.0 );\n"
+        "\n"
+        "mat4 ScaleMatrix = mat4(Scale.x, 0.0,     0.0, 0.0,\n"
+        "                        0.0,     Scale.y, 0.0, 0.0,\n"
+        "                        0.0,     0.0,     1.0, 0.0,\n"
+        "                        0.0,     0.0,     0.0, 1.0 );\n"
+        "\n"
+        "mat4 ShearMatrix = mat4(1.0,     Shear.x, 0.0, 0.0,\n"
+        "                        Shear.y, 1.0,     0.0, 0.0,\n"
+        "                        0.0,     0.0,     1.0, 0.0,\n"
+        "                        0.0,     0.0,     0.0, 1.0 );\n"
+        "\n"
+        "void main(void) {\n"
+        "    DestinationColor = SourceColor;\n"
+        "    DestinationTexcoord = SourceTexcoord;\n"
+        "    gl_Position = Position*ScaleMatrix*ShearMatrix*RotationMatrix*TranslationMatrix;\n"
+        "}";
+
+
+/**
+ * The fragment shader for the application. Handles actually mapping the
+ * input image onto the geometry and applying the levels and image
+ * adjustments, these are all uniforms so changing one never touches the
+ * texture. When the texture holds linear light the result is encoded back
+ * to sRGB for display. A texture holding only TextureRect of the image
+ * leaves the rest of the quad black.
+ */
+char* fragment_shader_src =
+        "varying vec4 DestinationColor;\n"
+        "varying vec2 DestinationTexcoord;\n"
+        "uniform sampler2D Texture;\n"
+        "uniform float SampleScale;\n"
+        "uniform vec4 TextureRect;\n"
+        "uniform vec3 LevelsLow;\n"
+        "uniform vec3 LevelsHigh;\n"
+        "uniform vec3 Gains;\n"
+        "uniform float Exposure;\n"
+        "uniform float Brightness;\n"
+        "uniform float Contrast;\n"
+        "uniform float Gamma;\n"
+        "uniform float EncodeSrgb;\n"
+        "\n"
+        "vec3 linear_to_srgb(vec3 c) {\n"
+        "    vec3 low = c * 12.92;\n"
+        "    vec3 high = 1.055 * pow(c, vec3(1.0 / 2.4)) - 0.055;\n"
+        "    return mix(high, low, vec3(lessThanEqual(c, vec3(0.0031308))));\n"
+        "}\n"
+        "\n"
+        "void main(void) {\n"
+        "    vec2 texcoord = (DestinationTexcoord - TextureRect.xy) / (TextureRect.zw - TextureRect.xy);\n"
+        "    if (any(lessThan(texcoord, vec2(0.0))) || any(greaterThan(texcoord, vec2(1.0)))) {\n"
+        "        gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
+        "        return;\n"
+        "    }\n"
+        "    vec4 color = texture2D(Texture, texcoord) * DestinationColor;\n"
+        "    color.rgb *= SampleScale;\n"
+        "    vec3 rgb = (color.rgb - LevelsLow) / max(LevelsHigh - LevelsLow, 1e-5);\n"
+        "    rgb = rgb * Gains * exp2(Exposure);\n"
+        "    rgb = (rgb - 0.5) * Contrast + 0.5 + Brightness;\n"
+        "    rgb = pow(max(rgb, 0.0), vec3(1.0 / Gamma));\n"
+        "    if (EncodeSrgb > 0.5)\n"
+        "        rgb = linear_to_srgb(rgb);\n"
+        "    gl_FragColor = vec4(rgb, color.a);\n"
+        "}";
+
+/**
+ * Print the shader sources and where the program came from
+ */
+int Verbose = FALSE;
+
+/**
+ * GL_ARB_get_program_binary, loaded at runtime since the context is only 2.0
+ */
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+typedef void (APIENTRY *GetProgramBinaryProc)(GLuint program, GLsizei size, GLsizei* length, GLenum* format, void* binary);
+typedef void (APIENTRY *ProgramBinaryProc)(GLuint program, GLenum format, const void* binary, GLsizei length);
+typedef void (APIENTRY *ProgramParameteriProc)(GLuint program, GLenum name, GLint value);
+
+#define PROGRAM_CACHE_MAGIC 0x42505a45u
+
+/**
+ * Where a linked program is cached and the entry points to get it back in
+ */
+typedef struct ProgramCache {
+    GetProgramBinaryProc get_program_binary;
+    ProgramBinaryProc program_binary;
+    ProgramParameteriProc program_parameteri;
+    uint64_t key;
+    char dir[1024];
+    char path[1100];
+} ProgramCache;
+
+/**
+ * Header in front of a cached program binary
+ */
+typedef struct ProgramCacheHeader {
+    uint32_t magic;
+    uint32_t format;
+    uint64_t key;
+    uint64_t length;
+} ProgramCacheHeader;
+
+/**
+ * Mix a string into a 64 bit FNV-1a hash
+ * @param hash
+ * @param text - NULL is hashed as an empty string
+ * @return
+ */
+static uint64_t fnv1a_string(uint64_t hash, const char* text) {
+    for (; text != NULL && *text; text++)
+        hash = (hash ^ (unsigned char) *text) * 0x100000001B3ull;
+    // Separate the strings so moving text between them changes the hash
+    return (hash ^ 0xFF) * 0x100000001B3ull;
+}
+
+/**
+ * Set up the program cache for the current context. The key covers the GL
+ * vendor, renderer and version so a driver update never sees an old binary,
+ * and the shader sources so editing them does not either.
+ * @param cache
+ * @return 0 when program binaries can be used
+ */
+int program_cache_init(ProgramCache* cache) {
+    if (!glfwExtensionSupported("GL_ARB_get_program_binary"))
+        return 1;
+    cache->get_program_binary = (GetProgramBinaryProc) glfwGetProcAddress("glGetProgramBinary");
+    cache->program_binary = (ProgramBinaryProc) glfwGetProcAddress("glProgramBinary");
+    cache->program_parameteri = (ProgramParameteriProc) glfwGetProcAddress("glProgramParameteri");
+    if (cache->get_program_binary == NULL || cache->program_binary == NULL || cache->program_parameteri == NULL)
+        return 1;
+
+    // Drivers may support the extension without any format to save
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats <= 0)
+        return 1;
+
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (xdg != NULL && *xdg)
+        snprintf(cache->dir, sizeof cache->dir, "%s/ezview", xdg);
+    else if (home != NULL && *home)
+        snprintf(cache->dir, sizeof cache->dir, "%s/.cache/ezview", home);
+    else
+        return 1;
+
+    uint64_t key = 0xCBF29CE484222325ull;
+    key = fnv1a_string(key, (const char*) glGetString(GL_VENDOR));
+    key = fnv1a_string(key, (const char*) glGetString(GL_RENDERER));
+    key = fnv1a_string(key, (const char*) glGetString(GL_VERSION));
+    key = fnv1a_string(key, vertex_shader_src);
+    key = fnv1a_string(key, fragment_shader_src);
+    cache->key = key;
+    snprintf(cache->path, sizeof cache->path, "%s/program-%016llx.bin", cache->dir, (unsigned long long) key);
+    return 0;
+}
+
+/**
+ * Create a program from the cached binary
+ * @param cache
+ * @return the linked program, or 0 if there is no usable binary
+ */
+GLuint program_cache_load(ProgramCache* cache) {
+    FILE* fp = fopen(cache->path, "rb");
+    if (fp == NULL)
+        return 0;
+
+    ProgramCacheHeader header;
+    void* binary = NULL;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != PROGRAM_CACHE_MAGIC ||
+        header.key != cache->key || header.length == 0 || header.length > INT32_MAX ||
+        (binary = malloc(header.length)) == NULL || fread(binary, 1, header.length, fp) != header.length) {
+        free(binary);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+
+    GLuint program_id = glCreateProgram();
+    cache->program_binary(program_id, header.format, binary, (GLsizei) header.length);
+    free(binary);
+
+    // The driver rejects binaries it can no longer use, they are compiled again
+    GLint link_success = GL_FALSE;
+    glGetProgramiv(program_id, GL_LINK_STATUS, &link_success);
+    if (link_success == GL_FALSE) {
+        glDeleteProgram(program_id);
+        while (glGetError() != GL_NO_ERROR);
+        return 0;
+    }
+    return program_id;
+}
+
+/**
+ * Save a linked program to the cache, a failure only costs a compile next time
+ * @param cache
+ * @param program_id - Linked with GL_PROGRAM_BINARY_RETRIEVABLE_HINT set
+ */
+void program_cache_store(ProgramCache* cache, GLuint program_id) {
+    GLint length = 0;
+    glGetProgramiv(program_id, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    void* binary = malloc(length);
+    if (binary == NULL)
+        return;
+
+    GLenum format = 0;
+    GLsizei written = 0;
+    cache->get_program_binary(program_id, length, &written, &format, binary);
+    if (written <= 0) {
+        free(binary);
+        return;
+    }
+
+    // Create the cache directory and its parent, then replace the file in one step
+    char parent[1024];
+    struct stat dir_stat;
+    snprintf(parent, sizeof parent, "%s", cache->dir);
+    char* slash = strrchr(parent, '/');
+    if (slash != NULL && slash != parent) {
+        *slash = '\0';
+        if (stat(parent, &dir_stat) != 0)
+            mkdir(parent, 0777);
+    }
+    if (stat(cache->dir, &dir_stat) != 0)
+        mkdir(cache->dir, 0777);
+
+    char temp[1200];
+    snprintf(temp, sizeof temp, "%s.%ld.tmp", cache->path, (long) getpid());
+    FILE* fp = fopen(temp, "wb");
+    if (fp == NULL) {
+        free(binary);
+        return;
+    }
+    ProgramCacheHeader header = { PROGRAM_CACHE_MAGIC, format, cache->key, (uint64_t) written };
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(binary, 1, written, fp) == (size_t) written;
+    ok = fclose(fp) == 0 && ok;
+    free(binary);
+    if (!ok || rename(temp, cache->path) != 0)
+        remove(temp);
+    else if (Verbose)
+        printf("Cached the shader program in %s\n", cache->path);
+}
+
+/**
+ * Compile the specified shader, provides output and checks for errors
+ * along the way.
+ * @param shader_type - The OpenGL Shader Type
+ * @param shader_src - The shader in string form
+ * @return The compiled shader id
+ */
+GLint simple_shader(GLint shader_type, char* shader_src) {
+    GLint compile_success = 0;
+    double span = trace_begin();
+
+    // Generate a new shader to work with
+    GLuint shader_id = glCreateShader(shader_type);
+
+    // Tell the shader where the source is
+    glShaderSource(shader_id, 1, &shader_src, 0);
+
+    // Print the shader before we compile it
+    if (Verbose) {
+        printf("===Compiling Shader===\n");
+        printf("%s\n", shader_src);
+        printf("======================\n");
+    }
+
+    // Actually compile the shader
+    glCompileShader(shader_id);
+
+    // Check the status of the compile
+    glGetShaderiv(shader_id, GL_COMPILE_STATUS, &compile_success);
+
+    // If it failed print an error
+    if (compile_success == GL_FALSE) {
+        GLchar message[256];
+        glGetShaderInfoLog(shader_id, sizeof(message), 0, &message[0]);
+        printf("glCompileShader Error: %s\n", message);
+        exit(1);
+    }
+
+    trace_end(shader_type == GL_VERTEX_SHADER ? "compile vertex shader" : "compile fragment shader", span);
+    return shader_id;
+}
+
+/**
+ * Start the OpenGL program, loading it from the program cache when the
+ * driver has a binary from an earlier run, otherwise compile the shaders,
+ * link the program and cache it
+ * @return
+ */
+int simple_program() {
+
+    GLint link_success = 0;
+    double span = trace_begin();
+
+    ProgramCache cache;
+    int cacheable = program_cache_init(&cache) == 0;
+    if (cacheable) {
+        GLuint cached_id = program_cache_load(&cache);
+        if (cached_id != 0) {
+            if (Verbose)
+                printf("Loaded the shader program from %s\n", cache.path);
+            trace_end("simple_program", span);
+            return cached_id;
+        }
+    }
+
+    // Generate a new program to work with
+    GLint program_id = glCreateProgram();
+    // Compile the shaders
+    GLint vertex_shader = simple_shader(GL_VERTEX_SHADER, vertex_shader_src);
+    GLint fragment_shader = simple_shader(GL_FRAGMENT_SHADER, fragment_shader_src);
+
+    // Attach the shaders to the program
+    glAttachShader(program_id, vertex_shader);
+    glAttachShader(program_id, fragment_shader);
+
+    // Link the program, asking to keep it retrievable for the cache
+    if (cacheable)
+        cache.program_parameteri(program_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program_id);
+
+    // Check the link status
+    glGetProgramiv(program_id, GL_LINK_STATUS, &link_success);
+
+    // If it failed print an error
+    if (link_success == GL_FALSE) {
+        GLchar message[256];
+        glGetProgramInfoLog(program_id, sizeof(message), 0, &message[0]);
+        printf("glLinkProgram Error: %s\n", message);
+        exit(1);
+    }
+
+    if (cacheable)
+        program_cache_store(&cache, program_id);
+    trace_end("simple_program", span);
+    return program_id;
+}
+
+/**
+ * Shader attribute and uniform locations
+ */
+typedef struct ShaderSlots {
+    GLuint position;
+    GLuint color;
+    GLuint texcoord;
+    GLuint scale;
+    GLuint translation;
+    GLuint rotation;
+    GLuint shear;
+    GLuint sample_scale;
+    GLuint texture_rect;
+    GLuint levels_low;
+    GLuint levels_high;
+    GLuint gains;
+    GLuint exposure;
+    GLuint brightness;
+    GLuint contrast;
+    GLuint gamma;
+    GLuint encode_srgb;
+} ShaderSlots;
+
+/**
+ * Look up all the attribute and uniform locations used by the program
+ * @param program_id
+ * @param slots
+ */
+void shader_slots_init(GLint program_id, ShaderSlots* slots) {
+    slots->position = glGetAttribLocation(program_id, "Position");
+    slots->color = glGetAttribLocation(program_id, "SourceColor");
+    slots->texcoord = glGetAttribLocation(program_id, "SourceTexcoord");
+    slots->scale = glGetUniformLocation(program_id, "Scale");
+    slots->translation = glGetUniformLocation(program_id, "Translation");
+    slots->rotation = glGetUniformLocation(program_id, "Rotation");
+    slots->shear = glGetUniformLocation(program_id, "Shear");
+    slots->sample_scale = glGetUniformLocation(program_id, "SampleScale");
+    slots->texture_rect = glGetUniformLocation(program_id, "TextureRect");
+    slots->levels_low = glGetUniformLocation(program_id, "LevelsLow");
+    slots->levels_high = glGetUniformLocation(program_id, "LevelsHigh");
+    slots->gains = glGetUniformLocation(program_id, "Gains");
+    slots->exposure = glGetUniformLocation(program_id, "Exposure");
+    slots->brightness = glGetUniformLocation(program_id, "Brightness");
+    slots->contrast = glGetUniformLocation(program_id, "Contrast");
+    slots->gamma = glGetUniformLocation(program_id, "Gamma");
+    slots->encode_srgb = glGetUniformLocation(program_id, "EncodeSrgb");
+    glEnableVertexAttribArray(slots->position);
+    glEnableVertexAttribArray(slots->color);
+    glEnableVertexAttribArray(slots->texcoord);
+}
+
+/**
+ * Point the vertex attributes at the Vertex layout of the bound GL_ARRAY_BUFFER
+ * @param slots
+ */
+void shader_slots_bind_vertices(ShaderSlots* slots) {
+    glVertexAttribPointer(slots->position,
+                          3,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          sizeof(Vertex),
+                          0);
+
+    glVertexAttribPointer(slots->color,
+                          4,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          sizeof(Vertex),
+                          (GLvoid*) (sizeof(float) * 3));
+
+    glVertexAttribPointer(slots->texcoord,
+                          2,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          sizeof(Vertex),
+                          (GLvoid*) (sizeof(float) * 7));
+}
+
+/**
+ * Print an error that occured in GLFW
+ * @param error
+ * @param description
+ */
+static void error_callback(int error, const char* description) {
+    fputs(description, stderr);
+}
+
+/**
+ * The animated transform channels, every channel lives side by side in the
+ * Transform arrays so the animator can process them as one batch
+ */
+enum TransformChannel {
+    CHANNEL_SCALE_X,
+    CHANNEL_SCALE_Y,
+    CHANNEL_SHEAR_X,
+    CHANNEL_SHEAR_Y,
+    CHANNEL_TRANSLATION_X,
+    CHANNEL_TRANSLATION_Y,
+    CHANNEL_ROTATION,
+    CHANNEL_COUNT
+};
+
+// Define variables to hold our current Scale, Shear, Translation, and Rotation states
+const float TransformIdentity[CHANNEL_COUNT] = { 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+float TransformTo[CHANNEL_COUNT] = { 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+float Transform[CHANNEL_COUNT] = { 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+/**
+ * Map a point in normalized device coordinates back onto the image through
+ * the inverse of the vertex shader transform, which scales, shears, rotates
+ * and then translates the quad spanning -1 to 1
+ * @param transform - Transform channels
+ * @param image
+ * @param x
+ * @param y
+ * @param image_x - Receives the column in pixels, 0 at the left edge
+ * @param image_y - Receives the row in pixels, 0 at the top edge
+ * @return FALSE when the transform is singular
+ */
+int transform_to_image(const float* transform, const Image* image, float x, float y, float* image_x, float* image_y) {
+    float det = 1.0f - transform[CHANNEL_SHEAR_X] * transform[CHANNEL_SHEAR_Y];
+    if (det == 0 || transform[CHANNEL_SCALE_X] == 0 || transform[CHANNEL_SCALE_Y] == 0)
+        return FALSE;
+
+    // Undo the translation and then the rotation
+    float c = cosf(transform[CHANNEL_ROTATION]);
+    float s = sinf(transform[CHANNEL_ROTATION]);
+    float tx = x - transform[CHANNEL_TRANSLATION_X];
+    float ty = y - transform[CHANNEL_TRANSLATION_Y];
+    float rx = c * tx + s * ty;
+    float ry = -s * tx + c * ty;
+
+    // Undo the shear and then the scale
+    float qx = (rx - transform[CHANNEL_SHEAR_X] * ry) / det / transform[CHANNEL_SCALE_X];
+    float qy = (ry - transform[CHANNEL_SHEAR_Y] * rx) / det / transform[CHANNEL_SCALE_Y];
+
+    // The quad's texture coordinates put the first row at the top
+    *image_x = (qx + 1.0f) * 0.5f * image->width;
+    *image_y = (1.0f - qy) * 0.5f * image->height;
+    return TRUE;
+}
+
+/**
+ * Find the part of the image visible in the window, the bounding box of the
+ * window corners mapped back onto the image
+ * @param transform - Transform channels
+ * @param image
+ * @param margin - Pixels added on every side
+ * @param rect - Receives the region as x0, y0, x1, y1 in pixels, exclusive at the end
+ * @return FALSE when nothing is visible
+ */
+int transform_visible_rect(const float* transform, const Image* image, uint32_t margin, uint32_t rect[4]) {
+    const float corners[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+    float x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    int i;
+    for (i=0; i<4; i++) {
+        float x, y;
+        if (!transform_to_image(transform, image, corners[i][0], corners[i][1], &x, &y))
+            return FALSE;
+        x0 = i == 0 || x < x0 ? x : x0;
+        y0 = i == 0 || y < y0 ? y : y0;
+        x1 = i == 0 || x > x1 ? x : x1;
+        y1 = i == 0 || y > y1 ? y : y1;
+    }
+    x0 = floorf(x0) - margin;
+    y0 = floorf(y0) - margin;
+    x1 = ceilf(x1) + margin;
+    y1 = ceilf(y1) + margin;
+    if (x1 <= 0 || y1 <= 0 || x0 >= image->width || y0 >= image->height)
+        return FALSE;
+    rect[0] = x0 > 0 ? (uint32_t) x0 : 0;
+    rect[1] = y0 > 0 ? (uint32_t) y0 : 0;
+    rect[2] = x1 < image->width ? (uint32_t) x1 : image->width;
+    rect[3] = y1 < image->height ? (uint32_t) y1 : image->height;
+    return TRUE;
+}
+
+/**
+ * Apply the vertex shader transform to a point on the quad
+ * @param transform - Transform channels
+ * @param x
+ * @param y
+ * @param out_x - Receives the point in normalized device coordinates
+ * @param out_y
+ */
+void transform_apply(const float* transform, float x, float y, float* out_x, float* out_y) {
+    float sx = x * transform[CHANNEL_SCALE_X];
+    float sy = y * transform[CHANNEL_SCALE_Y];
+    float hx = sx + transform[CHANNEL_SHEAR_X] * sy;
+    float hy = transform[CHANNEL_SHEAR_Y] * sx + sy;
+    float c = cosf(transform[CHANNEL_ROTATION]);
+    float s = sinf(transform[CHANNEL_ROTATION]);
+    *out_x = c * hx - s * hy + transform[CHANNEL_TRANSLATION_X];
+    *out_y = s * hx + c * hy + transform[CHANNEL_TRANSLATION_Y];
+}
+
+#define EXPORT_TILE_SIZE 64
+
+/**
+ * Set by the export key, the render loop writes the current view out
+ */
+int ExportRequested = FALSE;
+
+/**
+ * Set by the M key, the render loop prints the memory report
+ */
+int MemoryStatsRequested = FALSE;
+
+/**
+ * A band of EXPORT_TILE_SIZE output rows being transformed. The transform
+ * is affine, so the inverse mapping from output pixels to image pixels is
+ * kept as the six coefficients of ix = a * x + b * y + c, iy = d * x + e * y + f.
+ */
+typedef struct ExportPass {
+    const Image* image;
+    float inverse[6];
+    uint32_t width;
+    uint32_t first_row;
+    uint32_t rows;
+    int bytes_per_sample;
+    int encode_srgb;
+    unsigned char* bytes;
+} ExportPass;
+
+/**
+ * parallel_for body transforming EXPORT_TILE_SIZE square tiles of a band.
+ * Every output pixel center is mapped back onto the image and bilinearly
+ * interpolated, pixels that fall outside the image are black.
+ * @param pass_ptr
+ * @param task
+ * @param begin
+ * @param end
+ */
+static void export_tiles(void* pass_ptr, int task, size_t begin, size_t end) {
+    ExportPass* pass = pass_ptr;
+    const Image* image = pass->image;
+    const float* inverse = pass->inverse;
+    float color_max = (float) image->color_max;
+    size_t tile;
+    uint32_t x, y;
+    int c;
+    for (tile=begin; tile<end; tile++) {
+        uint32_t x0 = (uint32_t) tile * EXPORT_TILE_SIZE;
+        uint32_t x1 = x0 + EXPORT_TILE_SIZE < pass->width ? x0 + EXPORT_TILE_SIZE : pass->width;
+        for (y=0; y<pass->rows; y++) {
+            unsigned char* row = pass->bytes + (size_t) y * pass->width * 3 * pass->bytes_per_sample;
+            float oy = pass->first_row + y + 0.5f;
+            for (x=x0; x<x1; x++) {
+                float ox = x + 0.5f;
+                float ix = inverse[0] * ox + inverse[1] * oy + inverse[2];
+                float iy = inverse[3] * ox + inverse[4] * oy + inverse[5];
+                float value[3] = { 0, 0, 0 };
+                if (ix >= 0 && iy >= 0 && ix < image->width && iy < image->height) {
+                    // Interpolate between the four nearest pixel centers, clamped to the edges
+                    float fx = ix - 0.5f;
+                    float fy = iy - 0.5f;
+                    long sx = (long) floorf(fx);
+                    long sy = (long) floorf(fy);
+                    float wx = fx - sx;
+                    float wy = fy - sy;
+                    uint32_t left = sx < 0 ? 0 : (uint32_t) sx;
+                    uint32_t top = sy < 0 ? 0 : (uint32_t) sy;
+                    uint32_t right = sx + 1 < (long) image->width ? (uint32_t) (sx + 1) : image->width - 1;
+                    uint32_t bottom = sy + 1 < (long) image->height ? (uint32_t) (sy + 1) : image->height - 1;
+                    float a[3], b[3], d[3], e[3];
+                    image_sample(image, left, top, a);
+                    image_sample(image, right, top, b);
+                    image_sample(image, left, bottom, d);
+                    image_sample(image, right, bottom, e);
+                    for (c=0; c<3; c++)
+                        value[c] = (a[c] * (1 - wx) + b[c] * wx) * (1 - wy) + (d[c] * (1 - wx) + e[c] * wx) * wy;
+                }
+                for (c=0; c<3; c++) {
+                    if (pass->encode_srgb)
+                        value[c] = linear_to_srgb(value[c] < 0 ? 0 : value[c]);
+                    float sample = value[c] * color_max + 0.5f;
+                    unsigned int quantized = sample <= 0 ? 0 : (sample >= color_max ? (unsigned int) color_max : (unsigned int) sample);
+                    if (pass->bytes_per_sample == 1) {
+                        row[x * 3 + c] = (unsigned char) quantized;
+                    }
+                    else {
+                        row[(x * 3 + c) * 2] = (unsigned char) (quantized >> 8);
+                        row[(x * 3 + c) * 2 + 1] = (unsigned char) quantized;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Apply a transform to the full resolution image on the CPU and write the
+ * result as a P6 file sized to the exact bounding box of the transformed
+ * image. Output is produced in bands of tiles transformed in parallel, so
+ * only one band is held in memory at a time.
+ * @param image
+ * @param transform - Transform channels
+ * @param fname
+ * @param encode_srgb - TRUE when the image holds linear light, it is written sRGB encoded like its source
+ * @return
+ */
+int image_export(const Image* image, const float* transform, const char* fname, int encode_srgb) {
+    const float corners[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+    float min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+    int i;
+
+    // Bounding box of the transformed corners in source pixels
+    for (i=0; i<4; i++) {
+        float x, y;
+        transform_apply(transform, corners[i][0], corners[i][1], &x, &y);
+        x = (x + 1.0f) * 0.5f * image->width;
+        y = (1.0f - y) * 0.5f * image->height;
+        min_x = i == 0 || x < min_x ? x : min_x;
+        min_y = i == 0 || y < min_y ? y : min_y;
+        max_x = i == 0 || x > max_x ? x : max_x;
+        max_y = i == 0 || y > max_y ? y : max_y;
+    }
+
+    // Ignore rounding error in the corners so an identity transform keeps its size
+    long origin_x = (long) floorf(min_x + 0.001f);
+    long origin_y = (long) floorf(min_y + 0.001f);
+    long width = (long) ceilf(max_x - 0.001f) - origin_x;
+    long height = (long) ceilf(max_y - 0.001f) - origin_y;
+    if (width <= 0 || height <= 0 || width > 1L << 20 || height > 1L << 20) {
+        fprintf(stderr, "Error: The transformed image would be %li by %li pixels\n", width, height);
+        return 1;
+    }
+
+    // Map the output origin and one step along each axis back onto the image
+    ExportPass pass;
+    float points[3][2];
+    const float steps[3][2] = { { 0, 0 }, { 1, 0 }, { 0, 1 } };
+    for (i=0; i<3; i++) {
+        float x = (origin_x + steps[i][0]) / (image->width * 0.5f) - 1.0f;
+        float y = 1.0f - (origin_y + steps[i][1]) / (image->height * 0.5f);
+        if (!transform_to_image(transform, image, x, y, &points[i][0], &points[i][1])) {
+            fprintf(stderr, "Error: The transform can not be inverted\n");
+            return 1;
+        }
+    }
+    pass.inverse[0] = points[1][0] - points[0][0];
+    pass.inverse[1] = points[2][0] - points[0][0];
+    pass.inverse[2] = points[0][0];
+    pass.inverse[3] = points[1][1] - points[0][1];
+    pass.inverse[4] = points[2][1] - points[0][1];
+    pass.inverse[5] = points[0][1];
+
+    FILE* fp = fopen(fname, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Could not open destination file for writing '%s'\n", fname);
+        return 1;
+    }
+    int bytes_per_sample = image->color_max < 256 ? 1 : 2;
+    pass.image = image;
+    pass.width = (uint32_t) width;
+    pass.bytes_per_sample = bytes_per_sample;
+    pass.encode_srgb = encode_srgb;
+    pass.bytes = malloc((size_t) width * 3 * bytes_per_sample * EXPORT_TILE_SIZE);
+    if (pass.bytes == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for the export\n");
+        fclose(fp);
+        return 1;
+    }
+
+    int result = 0;
+    size_t tiles = ((size_t) width + EXPORT_TILE_SIZE - 1) / EXPORT_TILE_SIZE;
+    fprintf(fp, "P6\n%li %li\n%i\n", width, height, image->color_max);
+    for (pass.first_row=0; pass.first_row<(uint32_t) height; pass.first_row+=EXPORT_TILE_SIZE) {
+        pass.rows = height - pass.first_row < EXPORT_TILE_SIZE ? (uint32_t) height - pass.first_row : EXPORT_TILE_SIZE;
+        parallel_for(tiles, cpu_count() * 4, export_tiles, &pass);
+        size_t band_bytes = (size_t) width * 3 * bytes_per_sample * pass.rows;
+        if (fwrite(pass.bytes, 1, band_bytes, fp) != band_bytes) {
+            fprintf(stderr, "Error: Could not write to '%s'\n", fname);
+            result = 1;
+            break;
+        }
+    }
+    free(pass.bytes);
+    if (fclose(fp) != 0)
+        result = 1;
+    if (result == 0)
+        printf("Exported %li x %li pixels to '%s'\n", width, height, fname);
+    return result;
+}
+
+/**
+ * Export the image with the current transform to the first unused
+ * ezview_export_NNN.ppm in the working directory
+ * @param image
+ * @param encode_srgb - TRUE when the image holds linear light
+ * @return
+ */
+int export_current_view(const Image* image, int encode_srgb) {
+    static int counter = 0;
+    char fname[64];
+    struct stat existing;
+    do {
+        snprintf(fname, sizeof fname, "ezview_export_%03i.ppm", ++counter);
+    } while (stat(fname, &existing) == 0);
+    return image_export(image, TransformTo, fname, encode_srgb);
+}
+
+#define RESIDENCY_IDLE_SECONDS 2.0
+
+/**
+ * What happens to the host copy of an image once it is on the GPU
+ */
+typedef enum ResidencyPolicy {
+    RESIDENCY_KEEP,
+    RESIDENCY_DROP,
+    RESIDENCY_SPILL
+} ResidencyPolicy;
+
+/**
+ * Residency manager for the host copy of the image being shown. Once the
+ * texture is uploaded nothing reads the host copy until an export, the
+ * pixel inspector, or a zoom level needs it, so it can be dropped and
+ * decoded again from the source file, or spilled to an unlinked temporary
+ * file of raw samples that is read back without parsing. Users pin the
+ * host copy while they read it and it is evicted again once it has been
+ * idle for RESIDENCY_IDLE_SECONDS.
+ */
+typedef struct Residency {
+    ResidencyPolicy policy;
+    Image* image;
+    PixelFormat format;
+    PixelLayout layout;
+    const char* fname;
+    LoadOptions options;
+    const Filter* filters;
+    int filter_count;
+    FILE* spill;
+    int users;
+    double last_used;
+    pthread_mutex_t lock;
+} Residency;
+
+/**
+ * Parse a residency policy name
+ * @param name
+ * @param policy
+ * @return
+ */
+int residency_policy_from_name(const char* name, ResidencyPolicy* policy) {
+    if (strcmp(name, "keep") == 0)
+        *policy = RESIDENCY_KEEP;
+    else if (strcmp(name, "drop") == 0)
+        *policy = RESIDENCY_DROP;
+    else if (strcmp(name, "spill") == 0)
+        *policy = RESIDENCY_SPILL;
+    else {
+        fprintf(stderr, "Error: Unknown residency policy '%s'\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Start managing the host copy of a loaded image
+ * @param residency
+ * @param policy
+ * @param image
+ * @param fname - Source file, decoded again when a dropped copy is needed
+ * @param options - Options the image was loaded with
+ * @param filters - Filters applied after loading, kept by the caller
+ * @param filter_count
+ */
+void residency_init(Residency* residency, ResidencyPolicy policy, Image* image, const char* fname,
+                    const LoadOptions* options, const Filter* filters, int filter_count) {
+    memset(residency, 0, sizeof(Residency));
+    residency->policy = policy;
+    residency->image = image;
+    residency->fname = fname;
+    residency->options = *options;
+    // Reloads only need the pixels
+    residency->options.histogram_bins = 0;
+    residency->options.stats = NULL;
+    residency->options.roi = NULL;
+    residency->options.tiles = NULL;
+    residency->options.buffers = NULL;
+    residency->options.counters = NULL;
+    residency->filters = filters;
+    residency->filter_count = filter_count;
+    pthread_mutex_init(&residency->lock, NULL);
+}
+
+/**
+ * Bytes of samples in the host copy
+ * @param image
+ * @return
+ */
+static size_t residency_bytes(const Image* image) {
+    size_t samples = (size_t) image->width * image->height * 3;
+    return samples * (image->format == PIXEL_FORMAT_FLOAT ? sizeof(float) : sizeof(uint16_t));
+}
+
+/**
+ * Bring the host copy back in the format and layout it was evicted in,
+ * the residency lock must be held
+ * @param residency
+ * @return
+ */
+static int residency_restore(Residency* residency) {
+    Image* image = residency->image;
+    int i;
+    if (residency->spill != NULL) {
+        if (image_allocate(image, NULL) != 0)
+            return 1;
+        void* pixels = image->format == PIXEL_FORMAT_FLOAT ? (void*) image->pixmap : (void*) image->pixmap16;
+        rewind(residency->spill);
+        if (fread(pixels, 1, residency_bytes(image), residency->spill) != residency_bytes(image)) {
+            fprintf(stderr, "Error: Could not read the spilled image back\n");
+            image_free(image);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (load_image(image, (char*) residency->fname, &residency->options) != 0)
+        return 1;
+    for (i=0; i<residency->filter_count; i++) {
+        if (image_apply_filter(image, &residency->filters[i]) != 0) {
+            image_free(image);
+            return 1;
+        }
+    }
+    if (residency->format == PIXEL_FORMAT_FLOAT && image->format != PIXEL_FORMAT_FLOAT && image_to_float(image) != 0) {
+        image_free(image);
+        return 1;
+    }
+    return image_set_layout(image, residency->layout);
+}
+
+/**
+ * Pin the host copy, bringing it back first if it was evicted
+ * @param residency
+ * @return
+ */
+int residency_acquire(Residency* residency) {
+    int result = 0;
+    pthread_mutex_lock(&residency->lock);
+    if (residency->policy != RESIDENCY_KEEP && residency->image->pixmap == NULL && residency->image->pixmap16 == NULL)
+        result = residency_restore(residency);
+    if (result == 0)
+        residency->users++;
+    residency->last_used = monotonic_seconds();
+    pthread_mutex_unlock(&residency->lock);
+    return result;
+}
+
+/**
+ * Unpin the host copy, safe to call from any thread
+ * @param residency
+ */
+void residency_release(Residency* residency) {
+    pthread_mutex_lock(&residency->lock);
+    residency->users--;
+    residency->last_used = monotonic_seconds();
+    pthread_mutex_unlock(&residency->lock);
+}
+
+/**
+ * Evict the host copy unless the policy keeps it or somebody is using it.
+ * The host copy never changes once uploaded, so it is spilled only once.
+ * @param residency
+ * @return
+ */
+int residency_evict(Residency* residency) {
+    Image* image = residency->image;
+    int result = 0;
+    pthread_mutex_lock(&residency->lock);
+    if (residency->policy == RESIDENCY_KEEP || residency->users > 0 ||
+        (image->pixmap == NULL && image->pixmap16 == NULL)) {
+        pthread_mutex_unlock(&residency->lock);
+        return 0;
+    }
+    residency->format = image->format;
+    residency->layout = image->layout;
+    if (residency->policy == RESIDENCY_SPILL && residency->spill == NULL) {
+        const void* pixels = image->format == PIXEL_FORMAT_FLOAT ? (const void*) image->pixmap : (const void*) image->pixmap16;
+        residency->spill = tmpfile();
+        if (residency->spill == NULL || fwrite(pixels, 1, residency_bytes(image), residency->spill) != residency_bytes(image) ||
+            fflush(residency->spill) != 0) {
+            fprintf(stderr, "Error: Could not spill the image to disk, keeping it in memory\n");
+            if (residency->spill != NULL)
+                fclose(residency->spill);
+            residency->spill = NULL;
+            residency->policy = RESIDENCY_KEEP;
+            result = 1;
+        }
+    }
+    if (result == 0)
+        image_free(image);
+    pthread_mutex_unlock(&residency->lock);
+    return result;
+}
+
+/**
+ * Evict the host copy once it has been idle long enough
+ * @param residency
+ * @return Seconds until the host copy should be looked at again, negative when it never needs to be
+ */
+double residency_idle(Residency* residency) {
+    const Image* image = residency->image;
+    double idle;
+    pthread_mutex_lock(&residency->lock);
+    int waiting = residency->policy != RESIDENCY_KEEP && residency->users == 0 &&
+                  (image->pixmap != NULL || image->pixmap16 != NULL);
+    idle = monotonic_seconds() - residency->last_used;
+    pthread_mutex_unlock(&residency->lock);
+    if (!waiting)
+        return -1;
+    if (idle < RESIDENCY_IDLE_SECONDS)
+        return RESIDENCY_IDLE_SECONDS - idle;
+    residency_evict(residency);
+    return -1;
+}
+
+/**
+ * Read one pixel of the host copy. A spilled copy is read a pixel at a
+ * time from the spill file, a dropped copy is decoded again.
+ * @param residency
+ * @param x
+ * @param y
+ * @param rgb - Receives the pixel as values from 0 to 1
+ * @return
+ */
+int residency_sample(Residency* residency, uint32_t x, uint32_t y, float rgb[3]) {
+    Image* image = residency->image;
+    pthread_mutex_lock(&residency->lock);
+    if (image->pixmap == NULL && image->pixmap16 == NULL && residency->spill != NULL) {
+        // Spilled samples are in the format and layout they had in memory
+        float samples[3];
+        Image pixel = *image;
+        uint64_t index = (uint64_t) y * image->width + x;
+        int fd = fileno(residency->spill);
+        int result = 0;
+        pixel.width = 1;
+        pixel.height = 1;
+        pixel.pixmap = (RGBpixel*) samples;
+        pixel.pixmap16 = (uint16_t*) samples;
+        if (residency->layout == LAYOUT_PLANAR) {
+            // Planar images are floats, one plane per channel
+            uint64_t plane = (uint64_t) image->width * image->height;
+            int c;
+            for (c=0; c<3 && result == 0; c++) {
+                off_t offset = (off_t) ((c * plane + index) * sizeof(float));
+                result = pread(fd, &samples[c], sizeof(float), offset) == (ssize_t) sizeof(float) ? 0 : 1;
+            }
+            pixel.layout = LAYOUT_INTERLEAVED;
+            pixel.format = PIXEL_FORMAT_FLOAT;
+        }
+        else {
+            size_t bytes = residency_bytes(image) / ((size_t) image->width * image->height);
+            result = pread(fd, samples, bytes, (off_t) (index * bytes)) == (ssize_t) bytes ? 0 : 1;
+        }
+        pthread_mutex_unlock(&residency->lock);
+        if (result == 0)
+            image_sample(&pixel, 0, 0, rgb);
+        return result;
+    }
+    pthread_mutex_unlock(&residency->lock);
+
+    if (residency_acquire(residency) != 0)
+        return 1;
+    image_sample(image, x, y, rgb);
+    residency_release(residency);
+    return 0;
+}
+
+/**
+ * Close the spill file
+ * @param residency
+ */
+void residency_destroy(Residency* residency) {
+    if (residency->spill != NULL)
+        fclose(residency->spill);
+    residency->spill = NULL;
+    pthread_mutex_destroy(&residency->lock);
+}
+
+/**
+ * Image Adjustments, applied in the fragment shader
+ */
+typedef struct Adjustments {
+    float levels_low[3];
+    float levels_high[3];
+    float gains[3];
+    float exposure;
+    float brightness;
+    float contrast;
+    float gamma;
+} Adjustments;
+
+const Adjustments AdjustmentsIdentity = { { 0.0, 0.0, 0.0 }, { 1.0, 1.0, 1.0 }, { 1.0, 1.0, 1.0 }, 0.0, 0.0, 1.0, 1.0 };
+Adjustments CurrentAdjustments = { { 0.0, 0.0, 0.0 }, { 1.0, 1.0, 1.0 }, { 1.0, 1.0, 1.0 }, 0.0, 0.0, 1.0, 1.0 };
+
+/**
+ * Statistics of the displayed image, bins is 0 when none were gathered
+ */
+ImageStats CurrentStats;
+
+/**
+ * How sRGB encoded images are handled. With SRGB_TEXTURE the texture is
+ * uploaded as GL_SRGB8 and the GPU linearizes on sampling, with SRGB_DECODE
+ * the loader linearizes through its sample table. Either way filtering and
+ * the adjustments happen in linear light.
+ */
+typedef enum SrgbMode {
+    SRGB_OFF,
+    SRGB_TEXTURE,
+    SRGB_DECODE
+} SrgbMode;
+
+SrgbMode CurrentSrgbMode = SRGB_OFF;
+
+/**
+ * Get the internal texture format matching the sRGB mode
+ * @return
+ */
+GLint texture_internal_format() {
+    switch (CurrentSrgbMode) {
+        case SRGB_TEXTURE:
+            return GL_SRGB8;
+        case SRGB_DECODE:
+            // Linear values need more than 8 bits to avoid banding in the shadows
+            return GL_RGB16;
+        case SRGB_OFF:
+        default:
+            return GL_RGB;
+    }
+}
+
+/**
+ * Scale applied to texture samples so that color_max maps to white, raw
+ * 16 bit samples are normalized by the GPU against 65535 rather than color_max
+ */
+float TextureSampleScale = 1.0;
+
+/**
+ * Part of the image held by the texture as x0, y0, x1, y1 in texture
+ * coordinates, the whole image unless a view of a tiled image is shown
+ */
+float TextureRect[4] = { 0.0, 0.0, 1.0, 1.0 };
+
+/**
+ * Upload 8 bit images as BC1 compressed textures, only set when the driver
+ * supports S3TC
+ */
+int TextureCompression = FALSE;
+
+/**
+ * Pick the internal format and data type for uploading an image and set the
+ * unpack state and sample scale to match. Raw 16 bit samples are uploaded as
+ * GL_UNSIGNED_SHORT without any conversion, byte swapping from the file
+ * order happens in the driver through GL_UNPACK_SWAP_BYTES.
+ * @param image
+ * @param internal_format - Receives the internal format
+ * @return The data type
+ */
+static GLenum texture_begin_upload(const Image* image, GLint* internal_format) {
+    *internal_format = texture_internal_format();
+    if (image->format == PIXEL_FORMAT_U16) {
+        if (*internal_format == GL_RGB)
+            *internal_format = GL_RGB16;
+        // Rows of 16 bit RGB samples are only guaranteed to be 2 byte aligned
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glPixelStorei(GL_UNPACK_SWAP_BYTES, image->big_endian_samples && host_is_little_endian());
+        TextureSampleScale = 65535.0f / image->color_max;
+        return GL_UNSIGNED_SHORT;
+    }
+    TextureSampleScale = 1.0f;
+    if (image->format == PIXEL_FORMAT_HALF) {
+        if (*internal_format == GL_RGB)
+            *internal_format = GL_RGB16F_ARB;
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        return GL_HALF_FLOAT_ARB;
+    }
+    return GL_FLOAT;
+}
+
+/**
+ * Restore the default unpack state after an upload
+ */
+static void texture_end_upload() {
+    glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+}
+
+/**
+ * Widen half floats first if the driver lacks half float textures
+ * @param image
+ */
+static void texture_check_half(Image* image) {
+    if (image->format == PIXEL_FORMAT_HALF &&
+        !(glfwExtensionSupported("GL_ARB_texture_float") && glfwExtensionSupported("GL_ARB_half_float_pixel")) &&
+        glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR) < 3) {
+        fprintf(stderr, "Half float textures are not supported, uploading floats instead\n");
+        image_to_float(image);
+    }
+}
+
+/**
+ * Upload an image into the bound GL_TEXTURE_2D as BC1 blocks encoded on
+ * the CPU
+ * @param image
+ * @return
+ */
+static int texture_upload_compressed(const Image* image) {
+    size_t size;
+    double span = trace_begin();
+    unsigned char* blocks = image_encode_bc1(image, &size);
+    trace_end("encode bc1", span);
+    if (blocks == NULL)
+        return 1;
+    glCompressedTexImage2D(GL_TEXTURE_2D, 0, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, image->width, image->height, 0,
+                           (GLsizei) size, blocks);
+    free(blocks);
+    TextureSampleScale = 1.0f;
+    return 0;
+}
+
+/**
+ * Upload an image into the bound GL_TEXTURE_2D
+ * @param image
+ */
+void image_upload_texture(Image* image) {
+    GLint internal_format;
+    double span = trace_begin();
+    // 8 bit samples shown in gamma space lose little to block compression
+    if (TextureCompression && image->color_max <= 255 && CurrentSrgbMode == SRGB_OFF &&
+        texture_upload_compressed(image) == 0) {
+        trace_end("texture upload", span);
+        return;
+    }
+    // Textures are uploaded from interleaved RGB
+    image_set_layout(image, LAYOUT_INTERLEAVED);
+    texture_check_half(image);
+    GLenum type = texture_begin_upload(image, &internal_format);
+    const void* texels = image->format == PIXEL_FORMAT_FLOAT ? (const void*) image->pixmap : (const void*) image->pixmap16;
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, image->width, image->height, 0, GL_RGB, type, texels);
+    texture_end_upload();
+    trace_end("texture upload", span);
+}
+
+/**
+ * Allocate the bound GL_TEXTURE_2D for an image without uploading anything,
+ * regions are filled in later with image_upload_region
+ * @param image
+ */
+void image_reserve_texture(Image* image) {
+    GLint internal_format;
+    texture_check_half(image);
+    GLenum type = texture_begin_upload(image, &internal_format);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, image->width, image->height, 0, GL_RGB, type, NULL);
+    texture_end_upload();
+}
+
+/**
+ * Upload a region of an image into the bound GL_TEXTURE_2D
+ * @param image
+ * @param rect - Region as x0, y0, x1, y1 in pixels, exclusive at the end
+ */
+void image_upload_region(Image* image, const uint32_t rect[4]) {
+    GLint internal_format;
+    double span = trace_begin();
+    GLenum type = texture_begin_upload(image, &internal_format);
+    const void* texels = image->format == PIXEL_FORMAT_FLOAT ? (const void*) image->pixmap : (const void*) image->pixmap16;
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, image->width);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, rect[0]);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, rect[1]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, rect[0], rect[1], rect[2] - rect[0], rect[3] - rect[1], GL_RGB, type, texels);
+    texture_end_upload();
+    trace_end_arg("texture upload region", span, (int64_t) rect[1]);
+}
+
+/**
+ * Show the visible part of a tiled image. The region in view, grown by half
+ * its size on every side so small pans stay covered, is resampled to at most
+ * twice the framebuffer size and uploaded to the bound GL_TEXTURE_2D, and
+ * TextureRect is pointed at it.
+ * @param store
+ * @param image - Dimensions of the tiled image
+ * @param view - Scratch image for the resampled region
+ * @param buffer_width
+ * @param buffer_height
+ * @return
+ */
+int tile_view_update(TileStore* store, const Image* image, Image* view, int buffer_width, int buffer_height) {
+    uint32_t rect[4];
+    if (!transform_visible_rect(Transform, image, 0, rect)) {
+        // Nothing of the image is in view, a rect past its corner keeps the quad black
+        TextureRect[0] = TextureRect[1] = 2.0f;
+        TextureRect[2] = TextureRect[3] = 3.0f;
+        return 0;
+    }
+    uint32_t grow_x = (rect[2] - rect[0]) / 2;
+    uint32_t grow_y = (rect[3] - rect[1]) / 2;
+    rect[0] = rect[0] > grow_x ? rect[0] - grow_x : 0;
+    rect[1] = rect[1] > grow_y ? rect[1] - grow_y : 0;
+    rect[2] = image->width - rect[2] > grow_x ? rect[2] + grow_x : image->width;
+    rect[3] = image->height - rect[3] > grow_y ? rect[3] + grow_y : image->height;
+
+    uint32_t width = rect[2] - rect[0];
+    uint32_t height = rect[3] - rect[1];
+    if (width > (uint32_t) buffer_width * 2)
+        width = (uint32_t) buffer_width * 2;
+    if (height > (uint32_t) buffer_height * 2)
+        height = (uint32_t) buffer_height * 2;
+    if (width == 0 || height == 0)
+        return 0;
+    if (tile_store_render(store, rect, view, width, height) != 0)
+        return 1;
+    image_upload_texture(view);
+    image_free(view);
+
+    TextureRect[0] = (float) rect[0] / image->width;
+    TextureRect[1] = (float) rect[1] / image->height;
+    TextureRect[2] = (float) rect[2] / image->width;
+    TextureRect[3] = (float) rect[3] / image->height;
+    return 0;
+}
+
+/**
+ * Toggle auto levels, stretching the 0.1 and 99.9 percentiles of each
+ * channel to black and white using the statistics gathered while loading
+ */
+void toggle_auto_levels() {
+    int c;
+    if (memcmp(CurrentAdjustments.levels_low, AdjustmentsIdentity.levels_low, sizeof(float) * 3) != 0 ||
+        memcmp(CurrentAdjustments.levels_high, AdjustmentsIdentity.levels_high, sizeof(float) * 3) != 0) {
+        memcpy(CurrentAdjustments.levels_low, AdjustmentsIdentity.levels_low, sizeof(float) * 3);
+        memcpy(CurrentAdjustments.levels_high, AdjustmentsIdentity.levels_high, sizeof(float) * 3);
+        return;
+    }
+    if (CurrentStats.bins == 0 || CurrentStats.count == 0) {
+        fprintf(stderr, "Auto levels need image statistics, none were gathered\n");
+        return;
+    }
+    for (c=0; c<3; c++) {
+        CurrentAdjustments.levels_low[c] = image_stats_percentile(&CurrentStats, c, 0.001);
+        CurrentAdjustments.levels_high[c] = image_stats_percentile(&CurrentStats, c, 0.999);
+        // The statistics are of the encoded samples but the shader sees linear light
+        if (CurrentSrgbMode != SRGB_OFF) {
+            CurrentAdjustments.levels_low[c] = srgb_to_linear(CurrentAdjustments.levels_low[c]);
+            CurrentAdjustments.levels_high[c] = srgb_to_linear(CurrentAdjustments.levels_high[c]);
+        }
+    }
+}
+
+/**
+ * The callback called when a key is pressed on the keyboard,
+ * this should handle all user input.
+ * @param window
+ * @param key
+ * @param scancode
+ * @param action
+ * @param mods
+ */
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (action == GLFW_PRESS)
+        switch (key) {
+            // Scale up the whole image
+            case GLFW_KEY_UP:
+                TransformTo[CHANNEL_SCALE_X] += 0.5;
+                TransformTo[CHANNEL_SCALE_Y] += 0.5;
+                break;
+            // Scale down the whole image
+            case GLFW_KEY_DOWN:
+                TransformTo[CHANNEL_SCALE_X] -= 0.5;
+                TransformTo[CHANNEL_SCALE_Y] -= 0.5;
+                if (TransformTo[CHANNEL_SCALE_X] < 0)
+                    TransformTo[CHANNEL_SCALE_X] = 0;
+                if (TransformTo[CHANNEL_SCALE_Y] < 0)
+                    TransformTo[CHANNEL_SCALE_Y] = 0;
+                break;
+            // Scale up in the Y direction
+            case GLFW_KEY_T:
+                TransformTo[CHANNEL_SCALE_Y] += 0.5;
+                break;
+            // Scale down in the Y direction
+            case GLFW_KEY_G:
+                TransformTo[CHANNEL_SCALE_Y] -= 0.5;
+                if (TransformTo[CHANNEL_SCALE_Y] < 0)
+                    TransformTo[CHANNEL_SCALE_Y] = 0;
+                break;
+            // Scale up in the X direction
+            case GLFW_KEY_H:
+                TransformTo[CHANNEL_SCALE_X] += 0.5;
+                break;
+            // Scale down in the X direction
+            case GLFW_KEY_F:
+                TransformTo[CHANNEL_SCALE_X] -= 0.5;
+                if (TransformTo[CHANNEL_SCALE_X] < 0)
+                    TransformTo[CHANNEL_SCALE_X] = 0;
+                break;
+            // Translate down in the X direction
+            case GLFW_KEY_A:
+                TransformTo[CHANNEL_TRANSLATION_X] -= 0.5;
+                break;
+            // Translate up in the X direction
+            case GLFW_KEY_D:
+                TransformTo[CHANNEL_TRANSLATION_X] += 0.5;
+                break;
+            // Translate down in the Y direction
+            case GLFW_KEY_S:
+                TransformTo[CHANNEL_TRANSLATION_Y] -= 0.5;
+                break;
+            // Translate up in the Y direction
+            case GLFW_KEY_W:
+                TransformTo[CHANNEL_TRANSLATION_Y] += 0.5;
+                break;
+            // Add rotation
+            case GLFW_KEY_E:
+                TransformTo[CHANNEL_ROTATION] += 0.1;
+                break;
+            // Subtract rotation
+            case GLFW_KEY_Q:
+                TransformTo[CHANNEL_ROTATION] -= 0.1;
+                break;
+            // Shear up in the X direction
+            case GLFW_KEY_J:
+                TransformTo[CHANNEL_SHEAR_X] += 0.1;
+                break;
+            // Shear down in the X direction
+            case GLFW_KEY_L:
+                TransformTo[CHANNEL_SHEAR_X] -= 0.1;
+                break;
+            // Shear up in the Y direction
+            case GLFW_KEY_I:
+                TransformTo[CHANNEL_SHEAR_Y] += 0.1;
+                break;
+            // Shear down in the Y direction
+            case GLFW_KEY_K:
+                TransformTo[CHANNEL_SHEAR_Y] -= 0.1;
+                break;
+            // Reset all values to their original
+            case GLFW_KEY_R:
+                memcpy(TransformTo, TransformIdentity, sizeof(TransformTo));
+                break;
+            // Brightness down and up
+            case GLFW_KEY_1:
+                CurrentAdjustments.brightness -= 0.05;
+                break;
+            case GLFW_KEY_2:
+                CurrentAdjustments.brightness += 0.05;
+                break;
+            // Contrast down and up
+            case GLFW_KEY_3:
+                CurrentAdjustments.contrast -= 0.1;
+                if (CurrentAdjustments.contrast < 0)
+                    CurrentAdjustments.contrast = 0;
+                break;
+            case GLFW_KEY_4:
+                CurrentAdjustments.contrast += 0.1;
+                break;
+            // Gamma down and up
+            case GLFW_KEY_5:
+                CurrentAdjustments.gamma -= 0.1;
+                if (CurrentAdjustments.gamma < 0.1)
+                    CurrentAdjustments.gamma = 0.1;
+                break;
+            case GLFW_KEY_6:
+                CurrentAdjustments.gamma += 0.1;
+                break;
+            // Exposure down and up by a quarter stop
+            case GLFW_KEY_7:
+                CurrentAdjustments.exposure -= 0.25;
+                break;
+            case GLFW_KEY_8:
+                CurrentAdjustments.exposure += 0.25;
+                break;
+            // Red, green, and blue gain, hold shift to lower
+            case GLFW_KEY_Z:
+            case GLFW_KEY_X:
+            case GLFW_KEY_C: {
+                float* gain = &CurrentAdjustments.gains[key == GLFW_KEY_Z ? 0 : key == GLFW_KEY_X ? 1 : 2];
+                *gain += (mods & GLFW_MOD_SHIFT) ? -0.1 : 0.1;
+                if (*gain < 0)
+                    *gain = 0;
+                break;
+            }
+            // Toggle auto levels
+            case GLFW_KEY_V:
+                toggle_auto_levels();
+                break;
+            // Reset all adjustments
+            case GLFW_KEY_BACKSPACE:
+                CurrentAdjustments = AdjustmentsIdentity;
+                break;
+            // Export the current view at full resolution
+            case GLFW_KEY_O:
+                ExportRequested = TRUE;
+                break;
+            // Print the memory report
+            case GLFW_KEY_M:
+                MemoryStatsRequested = TRUE;
+                break;
+        }
+}
+
+/**
+ * The callback called when the mouse is scrolled
+ * @param window
+ * @param xoffset
+ * @param yoffset
+ */
+void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
+{
+    // Scale the image by some portion of the amount scrolled in the Y direction
+    TransformTo[CHANNEL_SCALE_X] += yoffset * 0.5;
+    TransformTo[CHANNEL_SCALE_Y] += yoffset * 0.5;
+
+    if (TransformTo[CHANNEL_SCALE_X] < 0)
+        TransformTo[CHANNEL_SCALE_X] = 0;
+    if (TransformTo[CHANNEL_SCALE_Y] < 0)
+        TransformTo[CHANNEL_SCALE_Y] = 0;
+}
+
+/**
+ * Pixel inspector, shows the image coordinates and sample values under the
+ * cursor in the window title
+ */
+typedef struct Inspector {
+    const Image* image;
+    TileStore* tiles;
+    Residency* residency;
+    const char* title;
+    double cursor_x;
+    double cursor_y;
+    long pixel_x;
+    long pixel_y;
+} Inspector;
+
+Inspector CurrentInspector = { NULL, NULL, NULL, NULL, -1, -1, -1, -1 };
+
+/**
+ * Map the cursor back onto the image and update the window title when it
+ * lands on a different pixel. This is a constant time lookup in the host
+ * copy of the image, in the tile cache for a tiled image, or in the spill
+ * file for a spilled image, nothing is read back from the GPU.
+ * @param window
+ */
+void inspector_update(GLFWwindow* window) {
+    Inspector* inspector = &CurrentInspector;
+    int window_width, window_height;
+    float image_x, image_y;
+    long x = -1, y = -1;
+    if (inspector->image == NULL)
+        return;
+
+    glfwGetWindowSize(window, &window_width, &window_height);
+    if (window_width > 0 && window_height > 0 &&
+        transform_to_image(Transform, inspector->image,
+                           (float) (inspector->cursor_x / window_width * 2.0 - 1.0),
+                           (float) (1.0 - inspector->cursor_y / window_height * 2.0),
+                           &image_x, &image_y) &&
+        image_x >= 0 && image_y >= 0 && image_x < inspector->image->width && image_y < inspector->image->height) {
+        x = (long) image_x;
+        y = (long) image_y;
+    }
+    if (x == inspector->pixel_x && y == inspector->pixel_y)
+        return;
+    inspector->pixel_x = x;
+    inspector->pixel_y = y;
+
+    if (x < 0) {
+        glfwSetWindowTitle(window, inspector->title);
+        return;
+    }
+    char title[256];
+    float rgb[3];
+    float color_max = (float) inspector->image->color_max;
+    if (inspector->tiles != NULL) {
+        if (tile_store_sample(inspector->tiles, (uint32_t) x, (uint32_t) y, rgb) != 0)
+            return;
+    }
+    else if (inspector->residency != NULL) {
+        if (residency_sample(inspector->residency, (uint32_t) x, (uint32_t) y, rgb) != 0)
+            return;
+    }
+    else {
+        image_sample(inspector->image, (uint32_t) x, (uint32_t) y, rgb);
+    }
+    snprintf(title, sizeof title, "%s - (%li, %li) = %.6g %.6g %.6g / %i",
+             inspector->title, x, y, rgb[0] * color_max, rgb[1] * color_max, rgb[2] * color_max,
+             inspector->image->color_max);
+    glfwSetWindowTitle(window, title);
+}
+
+/**
+ * Handle the cursor moving over the window
+ * @param window
+ * @param xpos
+ * @param ypos
+ */
+void cursor_callback(GLFWwindow* window, double xpos, double ypos)
+{
+    CurrentInspector.cursor_x = xpos;
+    CurrentInspector.cursor_y = ypos;
+    inspector_update(window);
+}
+
+/**
+ * Easing curves for transform animations
+ */
+typedef enum Easing {
+    EASING_LINEAR,
+    EASING_OUT_QUAD,
+    EASING_OUT_CUBIC,
+    EASING_IN_OUT_CUBIC,
+    EASING_OUT_EXPO
+} Easing;
+
+/**
+ * Easing curve names as accepted on the command line, indexed by Easing
+ */
+const char* EasingNames[] = { "linear", "quad", "cubic", "smooth", "expo" };
+
+/**
+ * Animator, moves every transform channel from where it was when its target
+ * last changed to the new target over a fixed duration. Progress depends only
+ * on elapsed time so animations look the same at any refresh rate and end
+ * exactly on their target.
+ */
+typedef struct Animator {
+    float from[CHANNEL_COUNT];
+    float to[CHANNEL_COUNT];
+    double start[CHANNEL_COUNT];
+    double duration;
+    Easing easing;
+} Animator;
+
+Animator TransformAnimator = { { 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0 },
+                               { 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0 },
+                               { 0 },
+                               0.25,
+                               EASING_OUT_CUBIC };
+
+/**
+ * Look up an easing curve by name
+ * @param name
+ * @param easing_ptr
+ * @return
+ */
+int easing_from_name(const char* name, Easing* easing_ptr) {
+    int i;
+    for (i=0; i<(int) (sizeof(EasingNames) / sizeof(EasingNames[0])); i++) {
+        if (strcmp(name, EasingNames[i]) == 0) {
+            *easing_ptr = (Easing) i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: Unknown easing curve '%s'\n", name);
+    return 1;
+}
+
+/**
+ * Evaluate an easing curve
+ * @param easing
+ * @param t - The animation progress from 0 to 1
+ * @return The eased progress, 0 at t = 0 and 1 at t = 1
+ */
+float ease(Easing easing, float t) {
+    float u = 1 - t;
+    switch (easing) {
+        case EASING_OUT_QUAD:
+            return 1 - u * u;
+        case EASING_OUT_CUBIC:
+            return 1 - u * u * u;
+        case EASING_IN_OUT_CUBIC:
+            return t < 0.5f ? 4 * t * t * t : 1 - 4 * u * u * u;
+        case EASING_OUT_EXPO:
+            return t >= 1 ? 1 : 1 - powf(2, -10 * t);
+        case EASING_LINEAR:
+        default:
+            return t;
+    }
+}
+
+/**
+ * Advance every channel of an animation to the specified time. A channel whose
+ * target changed since the last update restarts from its current value.
+ * @param animator
+ * @param values - The current values, updated in place
+ * @param targets - The destination values
+ * @param now - The current time in seconds
+ * @return TRUE while any channel is still moving, FALSE once all are at rest
+ */
+int animator_update(Animator* animator, float* values, const float* targets, double now) {
+    int running = FALSE;
+    int i;
+    for (i=0; i<CHANNEL_COUNT; i++) {
+        if (targets[i] != animator->to[i]) {
+            animator->from[i] = values[i];
+            animator->to[i] = targets[i];
+            animator->start[i] = now;
+        }
+    }
+    for (i=0; i<CHANNEL_COUNT; i++) {
+        float t = animator->duration > 0 ? (float) ((now - animator->start[i]) / animator->duration) : 1;
+        if (t >= 1) {
+            values[i] = animator->to[i];
+            continue;
+        }
+        values[i] = animator->from[i] + (animator->to[i] - animator->from[i]) * ease(animator->easing, t < 0 ? 0 : t);
+        running = TRUE;
+    }
+    return running;
+}
+
+/**
+ * Animate the transform toward its targets and send it to the shader
+ * @param slots
+ * @return TRUE while the transform is still animating
+ */
+int update_transform(ShaderSlots* slots)
+{
+    int running = animator_update(&TransformAnimator, Transform, TransformTo, glfwGetTime());
+
+    // Send updated values to the shader
+    glUniform2f(slots->scale, Transform[CHANNEL_SCALE_X], Transform[CHANNEL_SCALE_Y]);
+    glUniform2f(slots->translation, Transform[CHANNEL_TRANSLATION_X], Transform[CHANNEL_TRANSLATION_Y]);
+    glUniform2f(slots->shear, Transform[CHANNEL_SHEAR_X], Transform[CHANNEL_SHEAR_Y]);
+    glUniform1f(slots->rotation, Transform[CHANNEL_ROTATION]);
+    return running;
+}
+
+/**
+ * Send the current image adjustments to the shader
+ * @param slots
+ */
+void update_adjustments(ShaderSlots* slots)
+{
+    glUniform1f(slots->sample_scale, TextureSampleScale);
+    glUniform4fv(slots->texture_rect, 1, TextureRect);
+    glUniform3fv(slots->levels_low, 1, CurrentAdjustments.levels_low);
+    glUniform3fv(slots->levels_high, 1, CurrentAdjustments.levels_high);
+    glUniform3f(slots->gains, CurrentAdjustments.gains[0], CurrentAdjustments.gains[1], CurrentAdjustments.gains[2]);
+    glUniform1f(slots->exposure, CurrentAdjustments.exposure);
+    glUniform1f(slots->brightness, CurrentAdjustments.brightness);
+    glUniform1f(slots->contrast, CurrentAdjustments.contrast);
+    glUniform1f(slots->gamma, CurrentAdjustments.gamma);
+    glUniform1f(slots->encode_srgb, CurrentSrgbMode != SRGB_OFF ? 1.0f : 0.0f);
+}
+
+/**
+ * Wait for the next event when nothing is animating, otherwise just poll so
+ * the next frame is drawn right away
+ * @param animating
+ * @param timeout - Longest wait in seconds, negative to wait for an event however long it takes
+ */
+void wait_for_events(int animating, double timeout) {
+    if (animating)
+        glfwPollEvents();
+    else if (timeout >= 0)
+        glfwWaitEventsTimeout(timeout);
+    else
+        glfwWaitEvents();
+}
+
+#define ZOOM_MAX_LEVELS 16
+
+/**
+ * Progress of one level of the zoom cache
+ */
+typedef enum ZoomLevelState {
+    ZOOM_LEVEL_EMPTY,
+    ZOOM_LEVEL_BUILDING,
+    ZOOM_LEVEL_BUILT,
+    ZOOM_LEVEL_UPLOADED,
+    ZOOM_LEVEL_FAILED
+} ZoomLevelState;
+
+/**
+ * Lanczos downscaled copies of the image, one per power of two zoom out
+ * level. Level 0 is the full resolution texture, level n is built on the
+ * worker pool at 1/2^n of the size and uploaded by the main thread.
+ */
+typedef struct ZoomCache {
+    const Image* source;
+    Residency* residency;
+    ZoomLevelState states[ZOOM_MAX_LEVELS];
+    Image levels[ZOOM_MAX_LEVELS];
+    GLuint textures[ZOOM_MAX_LEVELS];
+    float sample_scales[ZOOM_MAX_LEVELS];
+    int current;
+    pthread_mutex_t lock;
+} ZoomCache;
+
+/**
+ * A level to build on the worker pool
+ */
+typedef struct ZoomBuild {
+    ZoomCache* cache;
+    int level;
+} ZoomBuild;
+
+/**
+ * Start a zoom cache around the already uploaded full resolution texture
+ * @param cache
+ * @param source
+ * @param texture
+ */
+void zoom_cache_init(ZoomCache* cache, const Image* source, GLuint texture) {
+    memset(cache, 0, sizeof(ZoomCache));
+    cache->source = source;
+    cache->states[0] = ZOOM_LEVEL_UPLOADED;
+    cache->textures[0] = texture;
+    cache->sample_scales[0] = TextureSampleScale;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+/**
+ * Find the level matching the current transform, the deepest level that
+ * still has at least one texel for every pixel on screen
+ * @param cache
+ * @param buffer_width
+ * @param buffer_height
+ * @return
+ */
+int zoom_cache_level(const ZoomCache* cache, int buffer_width, int buffer_height) {
+    float shown_width = fabsf(Transform[CHANNEL_SCALE_X]) * buffer_width;
+    float shown_height = fabsf(Transform[CHANNEL_SCALE_Y]) * buffer_height;
+    float ratio = fminf(cache->source->width / shown_width, cache->source->height / shown_height);
+    int level = 0;
+    while (level + 1 < ZOOM_MAX_LEVELS && ratio >= 2.0f &&
+           (cache->source->width >> (level + 1)) > 0 && (cache->source->height >> (level + 1)) > 0) {
+        ratio /= 2.0f;
+        level++;
+    }
+    return level;
+}
+
+/**
+ * Worker pool task building one level
+ * @param build_ptr
+ */
+static void zoom_cache_build(void* build_ptr) {
+    ZoomBuild* build = build_ptr;
+    ZoomCache* cache = build->cache;
+    Image level;
+    int result = image_resample_lanczos(cache->source, &level,
+                                        cache->source->width >> build->level,
+                                        cache->source->height >> build->level);
+    if (cache->residency != NULL)
+        residency_release(cache->residency);
+    pthread_mutex_lock(&cache->lock);
+    if (result == 0) {
+        cache->levels[build->level] = level;
+        cache->states[build->level] = ZOOM_LEVEL_BUILT;
+    }
+    else {
+        cache->states[build->level] = ZOOM_LEVEL_FAILED;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(build);
+
+    // Wake the main thread so it can swap the level in
+    glfwPostEmptyEvent();
+}
+
+/**
+ * Upload finished levels and, once the transform has settled, build the
+ * wanted level or swap it in. Binds the texture of the current level.
+ * @param cache
+ * @param level - Level wanted for the current transform
+ * @param settled - Whether the transform has stopped animating
+ */
+void zoom_cache_update(ZoomCache* cache, int level, int settled) {
+    ZoomBuild* task = NULL;
+    int i;
+    pthread_mutex_lock(&cache->lock);
+    for (i=1; i<ZOOM_MAX_LEVELS; i++) {
+        if (cache->states[i] != ZOOM_LEVEL_BUILT)
+            continue;
+        glGenTextures(1, &cache->textures[i]);
+        glBindTexture(GL_TEXTURE_2D, cache->textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        image_upload_texture(&cache->levels[i]);
+        cache->sample_scales[i] = TextureSampleScale;
+        free(cache->levels[i].pixmap);
+        cache->levels[i].pixmap = NULL;
+        cache->states[i] = ZOOM_LEVEL_UPLOADED;
+    }
+    if (settled && cache->states[level] == ZOOM_LEVEL_EMPTY) {
+        task = malloc(sizeof(ZoomBuild));
+        cache->states[level] = task != NULL ? ZOOM_LEVEL_BUILDING : ZOOM_LEVEL_FAILED;
+    }
+    if (settled && cache->states[level] == ZOOM_LEVEL_UPLOADED)
+        cache->current = level;
+    pthread_mutex_unlock(&cache->lock);
+
+    // The source stays pinned until the level is built
+    if (task != NULL && cache->residency != NULL && residency_acquire(cache->residency) != 0) {
+        pthread_mutex_lock(&cache->lock);
+        cache->states[level] = ZOOM_LEVEL_FAILED;
+        pthread_mutex_unlock(&cache->lock);
+        free(task);
+        task = NULL;
+    }
+
+    // Submit outside the lock, a full queue blocks until a worker is free
+    if (task != NULL) {
+        task->cache = cache;
+        task->level = level;
+        thread_pool_submit(worker_pool(), zoom_cache_build, task);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, cache->textures[cache->current]);
+    TextureSampleScale = cache->sample_scales[cache->current];
+}
+
+/**
+ * List the textures of every uploaded level
+ * @param cache
+ * @param textures - Receives up to ZOOM_MAX_LEVELS textures
+ * @return The number of textures
+ */
+int zoom_cache_textures(ZoomCache* cache, GLuint* textures) {
+    int count = 0;
+    int i;
+    pthread_mutex_lock(&cache->lock);
+    for (i=0; i<ZOOM_MAX_LEVELS; i++) {
+        if (cache->states[i] == ZOOM_LEVEL_UPLOADED)
+            textures[count++] = cache->textures[i];
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return count;
+}
+
+/**
+ * Wait for any level still being built and free the downscaled textures
+ * @param cache
+ */
+void zoom_cache_destroy(ZoomCache* cache) {
+    int i;
+    thread_pool_wait(worker_pool());
+    for (i=1; i<ZOOM_MAX_LEVELS; i++) {
+        free(cache->levels[i].pixmap);
+        if (cache->states[i] == ZOOM_LEVEL_UPLOADED)
+            glDeleteTextures(1, &cache->textures[i]);
+    }
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/**
+ * What load_image allocated for the image being shown
+ */
+AllocationStats LoadAllocations = { 0, 0 };
+
+/**
+ * Peak resident set size of the process
+ * @return Bytes
+ */
+uint64_t peak_rss_bytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return (uint64_t) usage.ru_maxrss;
+#else
+    return (uint64_t) usage.ru_maxrss * 1024;
+#endif
+}
+
+/**
+ * Estimate the memory a texture takes up on the GPU from the component
+ * sizes the driver reports for level 0. Three component formats are
+ * counted as four, drivers pad them. Compressed textures report their size.
+ * @param texture
+ * @return Bytes
+ */
+uint64_t texture_memory_bytes(GLuint texture) {
+    GLint bound, width = 0, height = 0, bits = 0, size, i;
+    const GLenum components[4] = { GL_TEXTURE_RED_SIZE, GL_TEXTURE_GREEN_SIZE, GL_TEXTURE_BLUE_SIZE, GL_TEXTURE_ALPHA_SIZE };
+    GLint largest = 0;
+    GLint compressed = GL_FALSE, compressed_size = 0;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+    if (compressed) {
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &compressed_size);
+        glBindTexture(GL_TEXTURE_2D, (GLuint) bound);
+        return (uint64_t) compressed_size;
+    }
+    for (i=0; i<4; i++) {
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, components[i], &size);
+        bits += size;
+        largest = size > largest ? size : largest;
+    }
+    glBindTexture(GL_TEXTURE_2D, (GLuint) bound);
+    if (bits < largest * 4)
+        bits = largest * 4;
+    return (uint64_t) width * height * bits / 8;
+}
+
+/**
+ * Print peak RSS, the host copy of the image, the tile cache, the
+ * estimated texture memory and what load_image allocated
+ * @param image - NULL when there is no single image
+ * @param tiles - NULL unless the image is tiled
+ * @param textures
+ * @param texture_count
+ * @param fp
+ */
+void memory_stats_print(const Image* image, const TileStore* tiles, const GLuint* textures, int texture_count, FILE* fp) {
+    const double mb = 1024.0 * 1024.0;
+    uint64_t texture_bytes = 0;
+    int i;
+    fprintf(fp, "peak rss      %.2f MB\n", peak_rss_bytes() / mb);
+    if (image != NULL) {
+        uint64_t pixels = (uint64_t) image->width * image->height;
+        size_t sample_bytes = image->format == PIXEL_FORMAT_FLOAT ? sizeof(float) : sizeof(uint16_t);
+        uint64_t resident = image->pixmap == NULL && image->pixmap16 == NULL ? 0 :
+                            (image->capacity > 0 ? image->capacity : pixels * 3 * sample_bytes);
+        fprintf(fp, "image         %ux%u, %.2f bytes per pixel, %.2f MB resident\n",
+                image->width, image->height, pixels > 0 ? resident / (double) pixels : 0, resident / mb);
+    }
+    if (tiles != NULL && tiles->slots != NULL) {
+        size_t used = 0;
+        for (i=0; i<(int) tiles->capacity; i++)
+            used += tiles->slots[i].pixels != NULL;
+        fprintf(fp, "tile cache    %zu of %zu tiles, %.2f MB, %llu hits %llu misses\n",
+                used, tiles->capacity, used * sizeof(float) * 3 * TILE_SIZE * TILE_SIZE / mb,
+                (unsigned long long) tiles->hits, (unsigned long long) tiles->misses);
+    }
+    for (i=0; i<texture_count; i++)
+        texture_bytes += texture_memory_bytes(textures[i]);
+    fprintf(fp, "textures      %i, estimated %.2f MB\n", texture_count, texture_bytes / mb);
+    fprintf(fp, "load_image    %llu allocations, %.2f MB\n",
+            (unsigned long long) LoadAllocations.count, LoadAllocations.bytes / mb);
+}
+
+/**
+ * Stages of getting the first frame on screen, timed for --first-frame
+ */
+typedef enum StartupStage {
+    STARTUP_PROCESS,
+    STARTUP_LOAD,
+    STARTUP_GLFW_INIT,
+    STARTUP_WINDOW,
+    STARTUP_PROGRAM,
+    STARTUP_UPLOAD,
+    STARTUP_SWAP,
+    STARTUP_STAGES
+} StartupStage;
+
+const char* StartupStageNames[STARTUP_STAGES] = {
+    "process start to main", "load_image", "glfwInit", "window creation", "simple_program", "texture upload",
+    "first glfwSwapBuffers"
+};
+
+double StartupSeconds[STARTUP_STAGES];
+
+/**
+ * Time since the process was created, from the start time the kernel keeps
+ * for it. Linux only records it in clock ticks, usually 10 ms.
+ * @return Seconds, negative when it is not known
+ */
+double process_age_seconds() {
+#if defined(__linux__)
+    char stat_line[1024];
+    FILE* fp = fopen("/proc/self/stat", "r");
+    if (fp == NULL)
+        return -1;
+    size_t length = fread(stat_line, 1, sizeof(stat_line) - 1, fp);
+    fclose(fp);
+    stat_line[length] = '\0';
+
+    // The command name may hold spaces, fields are counted after its closing parenthesis
+    char* field = strrchr(stat_line, ')');
+    int i;
+    for (i=2; field != NULL && i<22; i++) {
+        field = strchr(field + 1, ' ');
+    }
+    if (field == NULL)
+        return -1;
+    unsigned long long start_ticks = strtoull(field + 1, NULL, 10);
+    struct timespec now;
+    if (clock_gettime(CLOCK_BOOTTIME, &now) != 0)
+        return -1;
+    return now.tv_sec + now.tv_nsec * 1e-9 - (double) start_ticks / sysconf(_SC_CLK_TCK);
+#elif defined(__APPLE__)
+    int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, (int) getpid() };
+    struct kinfo_proc info;
+    size_t size = sizeof(info);
+    struct timeval now;
+    if (sysctl(mib, 4, &info, &size, NULL, 0) != 0 || gettimeofday(&now, NULL) != 0)
+        return -1;
+    struct timeval start = info.kp_proc.p_starttime;
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Print the time every startup stage took and the time from main to the
+ * first frame. Whatever was not in a stage is shown as other.
+ * @param main_to_frame - Seconds from entering main to the end of the first frame
+ * @param fp
+ */
+void startup_print(double main_to_frame, FILE* fp) {
+    double staged = 0;
+    int i;
+    for (i=0; i<STARTUP_STAGES; i++) {
+        if (i == STARTUP_PROCESS && StartupSeconds[i] < 0)
+            fprintf(fp, "%-22s %10s\n", StartupStageNames[i], "-");
+        else
+            fprintf(fp, "%-22s %10.2f ms\n", StartupStageNames[i], StartupSeconds[i] * 1e3);
+        if (i != STARTUP_PROCESS)
+            staged += StartupSeconds[i];
+    }
+    fprintf(fp, "%-22s %10.2f ms\n", "other", (main_to_frame - staged) * 1e3);
+    fprintf(fp, "%-22s %10.2f ms\n", "main to first frame", main_to_frame * 1e3);
+    if (StartupSeconds[STARTUP_PROCESS] >= 0)
+        fprintf(fp, "%-22s %10.2f ms\n", "time to first frame", (StartupSeconds[STARTUP_PROCESS] + main_to_frame) * 1e3);
+}
+
+#define SHEET_COLUMNS 8
+#define SHEET_CELL_SIZE 128
+#define SHEET_ATLAS_SIZE 2048
+#define SHEET_CELLS_PER_ATLAS ((SHEET_ATLAS_SIZE / SHEET_CELL_SIZE) * (SHEET_ATLAS_SIZE / SHEET_CELL_SIZE))
+
+/**
+ * The decode state of a contact sheet thumbnail
+ */
+typedef enum ThumbnailState {
+    THUMB_PENDING,
+    THUMB_DECODING,
+    THUMB_READY,
+    THUMB_UPLOADED,
+    THUMB_FAILED
+} ThumbnailState;
+
+/**
+ * Contact Sheet Thumbnail
+ */
+typedef struct Thumbnail {
+    char* fname;
+    ThumbnailState state;
+    Image image;
+} Thumbnail;
+
+/**
+ * Contact Sheet, a grid of thumbnails decoded in the background and packed
+ * into atlas textures of SHEET_CELLS_PER_ATLAS cells each. Thumbnail i always
+ * lives in atlas i / SHEET_CELLS_PER_ATLAS so every atlas is drawn with a
+ * single contiguous range of indices.
+ */
+typedef struct ContactSheet {
+    Thumbnail* thumbs;
+    int count;
+    int capacity;
+    int first_visible;
+    int last_visible;
+    int cancelled;
+    LoadOptions options;
+    ImageBuffers buffers;
+    pthread_mutex_t lock;
+    ThreadPool pool;
+    GLuint* atlases;
+    int atlas_count;
+} ContactSheet;
+
+/**
+ * Compare two strings for qsort
+ * @param a
+ * @param b
+ * @return
+ */
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/**
+ * Add an image file to the contact sheet
+ * @param sheet
+ * @param fname
+ * @return
+ */
+int contact_sheet_add(ContactSheet* sheet, const char* fname) {
+    if (sheet->count == sheet->capacity) {
+        int capacity = sheet->capacity ? sheet->capacity * 2 : 64;
+        Thumbnail* thumbs = realloc(sheet->thumbs, sizeof(Thumbnail) * capacity);
+        if (thumbs == NULL) {
+            fprintf(stderr, "Error: Could not allocate the contact sheet\n");
+            return 1;
+        }
+        sheet->thumbs = thumbs;
+        sheet->capacity = capacity;
+    }
+    Thumbnail* thumb = &sheet->thumbs[sheet->count++];
+    memset(thumb, 0, sizeof(Thumbnail));
+    thumb->fname = strdup(fname);
+    thumb->state = THUMB_PENDING;
+    return 0;
+}
+
+/**
+ * List every .ppm file in a directory in name order
+ * @param dirname
+ * @param names_ptr - Receives an array of paths, the caller frees each path and the array
+ * @param count_ptr - Receives the number of paths
+ * @return
+ */
+int list_ppm_files(const char* dirname, char*** names_ptr, int* count_ptr) {
+    DIR* dir = opendir(dirname);
+    if (dir == NULL) {
+        fprintf(stderr, ERR_OPEN_FILE_READING, dirname);
+        return 1;
+    }
+
+    char** names = NULL;
+    int count = 0;
+    int capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length < 4 || strcasecmp(entry->d_name + length - 4, ".ppm") != 0)
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            names = realloc(names, sizeof(char*) * capacity);
+        }
+        names[count] = malloc(strlen(dirname) + length + 2);
+        sprintf(names[count++], "%s/%s", dirname, entry->d_name);
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(char*), compare_strings);
+    *names_ptr = names;
+    *count_ptr = count;
+    return 0;
+}
+
+/**
+ * Add every .ppm file in a directory to the contact sheet in name order
+ * @param sheet
+ * @param dirname
+ * @return
+ */
+int contact_sheet_add_directory(ContactSheet* sheet, const char* dirname) {
+    char** names;
+    int count;
+    if (list_ppm_files(dirname, &names, &count) != 0)
+        return 1;
+
+    int i;
+    int result = 0;
+    for (i=0; i<count; i++) {
+        if (result == 0)
+            result = contact_sheet_add(sheet, names[i]);
+        free(names[i]);
+    }
+    free(names);
+    return result;
+}
+
+/**
+ * Pick the next thumbnail to decode, visible cells first and then outward
+ * from the visible range. Must be called with the sheet locked.
+ * @param sheet
+ * @return The thumbnail index or -1 if nothing is left
+ */
+static int contact_sheet_next_pending(ContactSheet* sheet) {
+    int i;
+    int d;
+    for (i=sheet->first_visible; i<=sheet->last_visible && i<sheet->count; i++)
+        if (sheet->thumbs[i].state == THUMB_PENDING)
+            return i;
+    for (d=1; sheet->last_visible + d < sheet->count || sheet->first_visible - d >= 0; d++) {
+        i = sheet->last_visible + d;
+        if (i < sheet->count && sheet->thumbs[i].state == THUMB_PENDING)
+            return i;
+        i = sheet->first_visible - d;
+        if (i >= 0 && sheet->thumbs[i].state == THUMB_PENDING)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Thread pool task, decodes whichever thumbnail is currently most wanted
+ * @param sheet_ptr
+ */
+static void contact_sheet_decode_next(void* sheet_ptr) {
+    ContactSheet* sheet = sheet_ptr;
+
+    pthread_mutex_lock(&sheet->lock);
+    int index = sheet->cancelled ? -1 : contact_sheet_next_pending(sheet);
+    if (index < 0) {
+        pthread_mutex_unlock(&sheet->lock);
+        return;
+    }
+    sheet->thumbs[index].state = THUMB_DECODING;
+    char* fname = sheet->thumbs[index].fname;
+    pthread_mutex_unlock(&sheet->lock);
+
+    Image full;
+    Image thumb;
+    int failed;
+    memset(&full, 0, sizeof(Image));
+    memset(&thumb, 0, sizeof(Image));
+    // P6 files are read at thumbnail size, P3 files have to be decoded whole and downsampled
+    failed = load_image(&full, fname, &sheet->options) != 0 || full.width == 0 || full.height == 0;
+    if (!failed) {
+        // Fit the thumbnail inside a cell keeping the aspect ratio
+        float fit = SHEET_CELL_SIZE / (float) (full.width > full.height ? full.width : full.height);
+        if (fit > 1)
+            fit = 1;
+        uint32_t width = (uint32_t) (full.width * fit);
+        uint32_t height = (uint32_t) (full.height * fit);
+        failed = image_downsample_box(&full, &thumb, width ? width : 1, height ? height : 1) != 0;
+    }
+    image_recycle(&full, sheet->options.buffers);
+
+    pthread_mutex_lock(&sheet->lock);
+    sheet->thumbs[index].image = thumb;
+    sheet->thumbs[index].state = failed ? THUMB_FAILED : THUMB_READY;
+    pthread_mutex_unlock(&sheet->lock);
+    glfwPostEmptyEvent();
+}
+
+/**
+ * Start decoding every thumbnail in the background
+ * @param sheet
+ * @return
+ */
+int contact_sheet_start(ContactSheet* sheet) {
+    int i;
+    pthread_mutex_init(&sheet->lock, NULL);
+    image_buffers_init(&sheet->buffers);
+    sheet->options.buffers = &sheet->buffers;
+    sheet->options.thumbnail_size = SHEET_CELL_SIZE;
+    sheet->first_visible = 0;
+    sheet->last_visible = SHEET_COLUMNS * SHEET_COLUMNS;
+    sheet->atlas_count = (sheet->count + SHEET_CELLS_PER_ATLAS - 1) / SHEET_CELLS_PER_ATLAS;
+    sheet->atlases = calloc(sheet->atlas_count, sizeof(GLuint));
+    if (thread_pool_create(&sheet->pool, 0, sheet->count) != 0)
+        return 1;
+    // Every task decodes whichever thumbnail is most wanted when it runs
+    for (i=0; i<sheet->count; i++)
+        thread_pool_submit(&sheet->pool, contact_sheet_decode_next, sheet);
+    return 0;
+}
+
+/**
+ * Cancel outstanding decodes and release the contact sheet
+ * @param sheet
+ */
+void contact_sheet_destroy(ContactSheet* sheet) {
+    int i;
+    pthread_mutex_lock(&sheet->lock);
+    sheet->cancelled = TRUE;
+    pthread_mutex_unlock(&sheet->lock);
+    thread_pool_destroy(&sheet->pool);
+    pthread_mutex_destroy(&sheet->lock);
+    image_buffers_destroy(&sheet->buffers);
+
+    glDeleteTextures(sheet->atlas_count, sheet->atlases);
+    for (i=0; i<sheet->count; i++) {
+        free(sheet->thumbs[i].fname);
+        free(sheet->thumbs[i].image.pixmap);
+    }
+    free(sheet->thumbs);
+    free(sheet->atlases);
+}
+
+/**
+ * Copy finished thumbnails into their atlas slots
+ * @param sheet
+ * @return The number of thumbnails uploaded
+ */
+int contact_sheet_upload(ContactSheet* sheet) {
+    int i;
+    int uploaded = 0;
+    pthread_mutex_lock(&sheet->lock);
+    for (i=0; i<sheet->count; i++) {
+        Thumbnail* thumb = &sheet->thumbs[i];
+        if (thumb->state != THUMB_READY)
+            continue;
+
+        int atlas = i / SHEET_CELLS_PER_ATLAS;
+        int slot = i % SHEET_CELLS_PER_ATLAS;
+        if (sheet->atlases[atlas] == 0) {
+            glGenTextures(1, &sheet->atlases[atlas]);
+            glBindTexture(GL_TEXTURE_2D, sheet->atlases[atlas]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexImage2D(GL_TEXTURE_2D, 0, texture_internal_format(), SHEET_ATLAS_SIZE, SHEET_ATLAS_SIZE, 0, GL_RGB, GL_FLOAT, NULL);
+        }
+        glBindTexture(GL_TEXTURE_2D, sheet->atlases[atlas]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0,
+                        (slot % (SHEET_ATLAS_SIZE / SHEET_CELL_SIZE)) * SHEET_CELL_SIZE,
+                        (slot / (SHEET_ATLAS_SIZE / SHEET_CELL_SIZE)) * SHEET_CELL_SIZE,
+                        thumb->image.width, thumb->image.height, GL_RGB, GL_FLOAT, thumb->image.pixmap);
+
+        // The atlas holds the thumbnail now, only the dimensions are still needed
+        free(thumb->image.pixmap);
+        thumb->image.pixmap = NULL;
+        thumb->state = THUMB_UPLOADED;
+        uploaded++;
+    }
+    pthread_mutex_unlock(&sheet->lock);
+    return uploaded;
+}
+
+/**
+ * Rebuild the vertex and index buffers for every uploaded thumbnail. Cells are
+ * laid out SHEET_COLUMNS wide across the window with square cells.
+ * @param sheet
+ * @param aspect - The framebuffer width divided by its height
+ * @param atlas_offsets - Receives the first index of each atlas, atlas_count + 1 entries
+ * @return
+ */
+int contact_sheet_build_geometry(ContactSheet* sheet, float aspect, GLuint* atlas_offsets) {
+    Vertex* vertices = malloc(sizeof(Vertex) * 4 * sheet->count);
+    GLuint* indices = malloc(sizeof(GLuint) * 6 * sheet->count);
+    if (vertices == NULL || indices == NULL) {
+        fprintf(stderr, "Error: Could not allocate the contact sheet geometry\n");
+        free(vertices);
+        free(indices);
+        return 1;
+    }
+
+    float cell_w = 2.0f / SHEET_COLUMNS;
+    float cell_h = cell_w * aspect;
+    int cells_across = SHEET_ATLAS_SIZE / SHEET_CELL_SIZE;
+    int quads = 0;
+    int i;
+    int k;
+    for (i=0; i<sheet->count; i++) {
+        if (i % SHEET_CELLS_PER_ATLAS == 0)
+            atlas_offsets[i / SHEET_CELLS_PER_ATLAS] = quads * 6;
+        Thumbnail* thumb = &sheet->thumbs[i];
+        if (thumb->state != THUMB_UPLOADED)
+            continue;
+
+        // Center the thumbnail in its cell leaving a small gutter
+        float w = cell_w * 0.9f * thumb->image.width / SHEET_CELL_SIZE;
+        float h = cell_h * 0.9f * thumb->image.height / SHEET_CELL_SIZE;
+        float cx = -1 + cell_w * (i % SHEET_COLUMNS + 0.5f);
+        float cy = 1 - cell_h * (i / SHEET_COLUMNS + 0.5f);
+
+        int slot = i % SHEET_CELLS_PER_ATLAS;
+        float s0 = (slot % cells_across) * SHEET_CELL_SIZE / (float) SHEET_ATLAS_SIZE;
+        float t0 = (slot / cells_across) * SHEET_CELL_SIZE / (float) SHEET_ATLAS_SIZE;
+        float s1 = s0 + thumb->image.width / (float) SHEET_ATLAS_SIZE;
+        float t1 = t0 + thumb->image.height / (float) SHEET_ATLAS_SIZE;
+
+        Vertex quad[4] = {
+                {{cx + w / 2, cy - h / 2, 0}, {1, 1, 1, 1}, {s1, t1}},
+                {{cx + w / 2, cy + h / 2, 0}, {1, 1, 1, 1}, {s1, t0}},
+                {{cx - w / 2, cy + h / 2, 0}, {1, 1, 1, 1}, {s0, t0}},
+                {{cx - w / 2, cy - h / 2, 0}, {1, 1, 1, 1}, {s0, t1}}
+        };
+        memcpy(&vertices[quads * 4], quad, sizeof(quad));
+        for (k=0; k<6; k++)
+            indices[quads * 6 + k] = quads * 4 + Indices[k];
+        quads++;
+    }
+    atlas_offsets[sheet->atlas_count] = quads * 6;
+
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * 4 * quads, vertices, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * 6 * quads, indices, GL_DYNAMIC_DRAW);
+    free(vertices);
+    free(indices);
+    return 0;
+}
+
+/**
+ * Work out which cells are on screen from the current scale and translation
+ * so the decoders can favor them
+ * @param sheet
+ * @param aspect
+ */
+void contact_sheet_update_visible(ContactSheet* sheet, float aspect) {
+    float cell_h = 2.0f / SHEET_COLUMNS * aspect;
+    float scale = Transform[CHANNEL_SCALE_Y] > 0.01f ? Transform[CHANNEL_SCALE_Y] : 0.01f;
+    float y_min = (-1 - Transform[CHANNEL_TRANSLATION_Y]) / scale;
+    float y_max = (1 - Transform[CHANNEL_TRANSLATION_Y]) / scale;
+    int first_row = (int) ((1 - y_max) / cell_h);
+    int last_row = (int) ((1 - y_min) / cell_h);
+    if (first_row < 0)
+        first_row = 0;
+    if (last_row < first_row)
+        last_row = first_row;
+
+    pthread_mutex_lock(&sheet->lock);
+    sheet->first_visible = first_row * SHEET_COLUMNS;
+    sheet->last_visible = (last_row + 1) * SHEET_COLUMNS - 1;
+    pthread_mutex_unlock(&sheet->lock);
+}
+
+/**
+ * Run the render loop for the contact sheet, every atlas is drawn with one call
+ * @param sheet
+ * @param slots
+ * @param buffer_width
+ * @param buffer_height
+ */
+void contact_sheet_run(ContactSheet* sheet, ShaderSlots* slots, int buffer_width, int buffer_height) {
+    float aspect = buffer_width / (float) buffer_height;
+    GLuint* atlas_offsets = calloc(sheet->atlas_count + 1, sizeof(GLuint));
+    int i;
+    int64_t frame = 0;
+
+    while (!glfwWindowShouldClose(window)) {
+        double span = trace_begin();
+        contact_sheet_update_visible(sheet, aspect);
+
+        if (contact_sheet_upload(sheet) > 0)
+            contact_sheet_build_geometry(sheet, aspect, atlas_offsets);
+
+        int animating = update_transform(slots);
+        update_adjustments(slots);
+
+        // Thumbnails are all loaded the same way, so the report counts every load so far
+        if (MemoryStatsRequested) {
+            MemoryStatsRequested = FALSE;
+            LoadAllocations = Allocations;
+            memory_stats_print(NULL, NULL, sheet->atlases, sheet->atlas_count, stdout);
+        }
+
+        glClearColor(0, 0.0, 0.0, 1.0);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glViewport(0, 0, buffer_width, buffer_height);
+
+        for (i=0; i<sheet->atlas_count; i++) {
+            GLsizei count = atlas_offsets[i + 1] - atlas_offsets[i];
+            if (count == 0)
+                continue;
+            glBindTexture(GL_TEXTURE_2D, sheet->atlases[i]);
+            glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT,
+                           (GLvoid*) (sizeof(GLuint) * atlas_offsets[i]));
+        }
+
+        glfwSwapBuffers(window);
+        trace_end_arg("frame", span, frame++);
+        wait_for_events(animating, -1);
+    }
+
+    free(atlas_offsets);
+}
+
+/**
+ * Show the help message for the batch converter
+ */
+void show_convert_help() {
+    printf("Usage: ezconvert [options] -o <directory> <directory | input.ppm ...>\n");
+    printf("       ezview --convert [options] -o <directory> <directory | input.ppm ...>\n");
+    printf("\n");
+    printf("\t Options:\n");
+    printf("\t\t      -o <directory> - Directory the converted files are written to\n");
+    printf("\t\t        --to <p3|p6> - Output format (default p6)\n");
+    printf("\t\t      --resize <WxH> - Resample every image to exactly W by H pixels\n");
+    printf("\t\t  --thumbnail <size> - Shrink every image to fit within size by size pixels\n");
+    printf("\t\t          --jobs <n> - Files converted at once (default one per processor)\n");
+    printf("\n");
+    printf("\t Example: ezconvert --thumbnail 256 -o thumbs renders/\n");
+}
+
+/**
+ * A batch conversion, the options shared by every file and the totals
+ * gathered as files finish
+ */
+typedef struct ConvertBatch {
+    const char* output;
+    int ppm_version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t thumbnail;
+    ImageBuffers buffers;
+    pthread_mutex_t lock;
+    int converted;
+    int failed;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+} ConvertBatch;
+
+/**
+ * One file waiting to be converted
+ */
+typedef struct ConvertJob {
+    ConvertBatch* batch;
+    char* input;
+} ConvertJob;
+
+/**
+ * Work out the size a converted image should have
+ * @param batch
+ * @param image
+ * @param width - Receives the width
+ * @param height - Receives the height
+ */
+static void convert_size(const ConvertBatch* batch, const Image* image, uint32_t* width, uint32_t* height) {
+    *width = image->width;
+    *height = image->height;
+    if (batch->width > 0) {
+        *width = batch->width;
+        *height = batch->height;
+    }
+    else if (batch->thumbnail > 0 && (image->width > batch->thumbnail || image->height > batch->thumbnail)) {
+        // Fit the longer side and keep the aspect ratio, never enlarging
+        if (image->width >= image->height) {
+            *width = batch->thumbnail;
+            *height = (uint32_t) ((uint64_t) image->height * batch->thumbnail / image->width);
+        }
+        else {
+            *height = batch->thumbnail;
+            *width = (uint32_t) ((uint64_t) image->width * batch->thumbnail / image->height);
+        }
+        if (*width == 0)
+            *width = 1;
+        if (*height == 0)
+            *height = 1;
+    }
+}
+
+/**
+ * Get the file name part of a path
+ * @param path
+ * @return
+ */
+static const char* path_basename(const char* path) {
+    const char* name = strrchr(path, '/');
+    return name != NULL ? name + 1 : path;
+}
+
+/**
+ * Compare two paths by their file names for qsort
+ * @param a
+ * @param b
+ * @return
+ */
+static int compare_basenames(const void* a, const void* b) {
+    return strcmp(path_basename(*(char* const*) a), path_basename(*(char* const*) b));
+}
+
+/**
+ * Check whether an output path names the same file as an input, through any
+ * spelling of the path such as ./, .. or symlinks
+ * @param input
+ * @param output
+ * @return TRUE if writing output would overwrite input
+ */
+static int convert_overwrites_input(const char* input, const char* output) {
+    struct stat input_stat;
+    struct stat output_stat;
+    if (stat(output, &output_stat) != 0 || stat(input, &input_stat) != 0)
+        return FALSE;
+    return input_stat.st_dev == output_stat.st_dev && input_stat.st_ino == output_stat.st_ino;
+}
+
+/**
+ * Thread pool task decoding, resizing and encoding one file
+ * @param job_ptr
+ */
+static void convert_file(void* job_ptr) {
+    ConvertJob* job = job_ptr;
+    ConvertBatch* batch = job->batch;
+    const char* name = path_basename(job->input);
+    char* output = malloc(strlen(batch->output) + strlen(name) + 2);
+    sprintf(output, "%s/%s", batch->output, name);
+
+    Image image;
+    Image resized;
+    struct stat file_stat;
+    uint32_t width, height;
+    int result = 1;
+    LoadOptions options = { 0, NULL, FALSE, PIXEL_FORMAT_U16, NULL, &batch->buffers, NULL, 0, NULL, 0 };
+    memset(&image, 0, sizeof(Image));
+    memset(&resized, 0, sizeof(Image));
+    if (convert_overwrites_input(job->input, output)) {
+        fprintf(stderr, "Error: Converting '%s' would overwrite it\n", job->input);
+    }
+    else if (load_image(&image, job->input, &options) == 0) {
+        convert_size(batch, &image, &width, &height);
+        if (width == image.width && height == image.height)
+            result = image_write(&image, output, batch->ppm_version);
+        else if (image_resample_lanczos(&image, &resized, width, height) == 0)
+            result = image_write(&resized, output, batch->ppm_version);
+    }
+    image_recycle(&image, &batch->buffers);
+    image_free(&resized);
+
+    pthread_mutex_lock(&batch->lock);
+    if (result == 0) {
+        batch->converted++;
+        if (stat(job->input, &file_stat) == 0)
+            batch->bytes_read += file_stat.st_size;
+        if (stat(output, &file_stat) == 0)
+            batch->bytes_written += file_stat.st_size;
+    }
+    else {
+        fprintf(stderr, "Could not convert '%s'\n", job->input);
+        batch->failed++;
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    free(output);
+    free(job->input);
+    free(job);
+}
+
+/**
+ * Queue a file for conversion, blocks while the queue is full so only a
+ * bounded number of files are waiting or in memory at any time
+ * @param pool
+ * @param batch
+ * @param input
+ */
+static void convert_submit(ThreadPool* pool, ConvertBatch* batch, const char* input) {
+    ConvertJob* job = malloc(sizeof(ConvertJob));
+    job->batch = batch;
+    job->input = strdup(input);
+    thread_pool_submit(pool, convert_file, job);
+}
+
+/**
+ * Make sure no two inputs would be written to the same output file, which
+ * happens when files in different directories share a name, and that no
+ * input would be overwritten by its own output
+ * @param files
+ * @param count
+ * @param output - The output directory
+ * @return
+ */
+static int convert_check_names(char** files, int count, const char* output) {
+    char** sorted = malloc(sizeof(char*) * (count + 1));
+    int duplicates = 0;
+    int i;
+    if (count > 0)
+        memcpy(sorted, files, sizeof(char*) * count);
+    qsort(sorted, count, sizeof(char*), compare_basenames);
+    for (i=1; i<count; i++) {
+        if (compare_basenames(&sorted[i - 1], &sorted[i]) == 0) {
+            fprintf(stderr, "Error: '%s' and '%s' would both be written to '%s/%s'\n",
+                    sorted[i - 1], sorted[i], output, path_basename(sorted[i]));
+            duplicates++;
+        }
+    }
+    free(sorted);
+
+    for (i=0; i<count; i++) {
+        const char* name = path_basename(files[i]);
+        char* path = malloc(strlen(output) + strlen(name) + 2);
+        sprintf(path, "%s/%s", output, name);
+        if (convert_overwrites_input(files[i], path)) {
+            fprintf(stderr, "Error: Converting '%s' would overwrite it\n", files[i]);
+            duplicates++;
+        }
+        free(path);
+    }
+    return duplicates == 0 ? 0 : 1;
+}
+
+/**
+ * Batch converter entry point, decodes, resizes and encodes every input on
+ * a bounded thread pool and reports the throughput
+ * @param argc
+ * @param argv - Arguments after the program name or --convert
+ * @return
+ */
+int convert_main(int argc, char* argv[]) {
+    ConvertBatch batch;
+    int jobs = 0;
+    int i;
+    memset(&batch, 0, sizeof(ConvertBatch));
+    batch.ppm_version = 6;
+
+    char** inputs = malloc(sizeof(char*) * (argc + 1));
+    int input_count = 0;
+    for (i=0; i<argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            batch.output = argv[++i];
+        }
+        else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            i++;
+            if (strcasecmp(argv[i], "p3") == 0)
+                batch.ppm_version = 3;
+            else if (strcasecmp(argv[i], "p6") == 0)
+                batch.ppm_version = 6;
+            else {
+                fprintf(stderr, "Error: Unknown output format '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--resize") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%ux%u", &batch.width, &batch.height) != 2 || batch.width == 0 || batch.height == 0) {
+                fprintf(stderr, "Error: Expected a size written as WxH but got '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--thumbnail") == 0 && i + 1 < argc) {
+            batch.thumbnail = (uint32_t) atoi(argv[++i]);
+            if (batch.thumbnail == 0) {
+                fprintf(stderr, "Error: The thumbnail size must be at least 1\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        }
+        else if (strncmp(argv[i], "-", 1) == 0) {
+            fprintf(stderr, "Error: Unknown or incomplete option '%s'\n", argv[i]);
+            show_convert_help();
+            return 1;
+        }
+        else {
+            inputs[input_count++] = argv[i];
+        }
+    }
+    if (input_count < 1 || batch.output == NULL) {
+        fprintf(stderr, "Error: Not enough arguments provided\n");
+        show_convert_help();
+        return 1;
+    }
+
+    struct stat input_stat;
+    if (stat(batch.output, &input_stat) != 0 && mkdir(batch.output, 0777) != 0) {
+        fprintf(stderr, "Error: Could not create the output directory '%s'\n", batch.output);
+        return 1;
+    }
+
+    // Twice as many queued files as workers keeps every worker busy without reading ahead
+    ThreadPool pool;
+    if (jobs <= 0)
+        jobs = cpu_count();
+    pthread_mutex_init(&batch.lock, NULL);
+    image_buffers_init(&batch.buffers);
+    if (thread_pool_create(&pool, jobs, jobs * 2) != 0)
+        return 1;
+
+    // Expand directories first so clashing output names are caught before anything is written
+    char** files = NULL;
+    int file_count = 0;
+    int file_capacity = 0;
+    for (i=0; i<input_count; i++) {
+        char** names = NULL;
+        int count = 1;
+        int j;
+        if (stat(inputs[i], &input_stat) == 0 && S_ISDIR(input_stat.st_mode)) {
+            if (list_ppm_files(inputs[i], &names, &count) != 0) {
+                batch.failed++;
+                continue;
+            }
+        }
+        if (file_count + count > file_capacity) {
+            file_capacity = (file_count + count) * 2;
+            files = realloc(files, sizeof(char*) * file_capacity);
+        }
+        for (j=0; j<count; j++)
+            files[file_count++] = names != NULL ? names[j] : strdup(inputs[i]);
+        free(names);
+    }
+    if (convert_check_names(files, file_count, batch.output) != 0) {
+        for (i=0; i<file_count; i++)
+            free(files[i]);
+        free(files);
+        thread_pool_destroy(&pool);
+        pthread_mutex_destroy(&batch.lock);
+        image_buffers_destroy(&batch.buffers);
+        free(inputs);
+        return 1;
+    }
+
+    double start = monotonic_seconds();
+    for (i=0; i<file_count; i++) {
+        convert_submit(&pool, &batch, files[i]);
+        free(files[i]);
+    }
+    free(files);
+    thread_pool_wait(&pool);
+    thread_pool_destroy(&pool);
+    double elapsed = monotonic_seconds() - start;
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+
+    printf("Converted %i files, %i failed, in %.2f s\n", batch.converted, batch.failed, elapsed);
+    printf("%.1f files/s, %.1f MB/s read, %.1f MB/s written\n",
+           batch.converted / elapsed,
+           batch.bytes_read / elapsed / (1024 * 1024),
+           batch.bytes_written / elapsed / (1024 * 1024));
+    pthread_mutex_destroy(&batch.lock);
+    image_buffers_destroy(&batch.buffers);
+    free(inputs);
+    return batch.failed == 0 ? 0 : 1;
+}
+
+/**
+ * Show the help message for the corpus generator
+ */
+void show_generate_help() {
+    printf("Usage: ezview --generate [options] <output.ppm | ->\n");
+    printf("       ezview --generate [options] --corpus <directory>\n");
+    printf("\n");
+    printf("\t Options:\n");
+    printf("\t\t        --to <p3|p6> - Output format (default p6)\n");
+    printf("\t\t        --size <WxH> - Image size (default 256x256)\n");
+    printf("\t\t       --max <value> - Maximum color value from 1 to 65535 (default 255)\n");
+    printf("\t\t    --comments <0-1> - Fraction of line breaks followed by comments (default 0)\n");
+    printf("\t\t--whitespace <style> - lf (default), crlf, spaces, tabs, or mixed\n");
+    printf("\t\t          --seed <n> - Seed for the pixels and the layout (default 1)\n");
+    printf("\t\t--corpus <directory> - Write every format, maximum, whitespace and comment combination\n");
+    printf("\n");
+    printf("\t Example: ezview --generate --to p3 --size 4000x3000 --max 65535 --whitespace mixed big.ppm\n");
+}
+
+/**
+ * How tokens of a generated file are separated
+ */
+typedef enum WhitespaceStyle {
+    WHITESPACE_LF,
+    WHITESPACE_CRLF,
+    WHITESPACE_SPACES,
+    WHITESPACE_TABS,
+    WHITESPACE_MIXED,
+    WHITESPACE_STYLES
+} WhitespaceStyle;
+
+const char* WhitespaceNames[WHITESPACE_STYLES] = { "lf", "crlf", "spaces", "tabs", "mixed" };
+
+/**
+ * Settings of a generated PPM file. Pixels and layout come from separate
+ * random streams, so the same seed gives the same pixels in every format
+ * and whitespace style.
+ */
+typedef struct Generator {
+    int ppm_version;
+    uint32_t width;
+    uint32_t height;
+    int color_max;
+    double comments;
+    WhitespaceStyle whitespace;
+    uint64_t seed;
+    uint64_t pixel_state;
+    uint64_t layout_state;
+} Generator;
+
+/**
+ * Next value of an xorshift64* stream
+ * @param state
+ * @return
+ */
+static uint64_t generator_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Write a line break in the file's style, followed by comment lines as
+ * often as asked for. The loader only recognizes comments at the start of
+ * a line, so this is the only place they are written.
+ * @param gen
+ * @param fp
+ */
+static void generator_line_break(Generator* gen, FILE* fp) {
+    static const char* breaks[] = { "\n", "\r\n", "\r" };
+    static const char* comments[] = { "# ezview synthetic image", "#", "#no space after the hash",
+                                      "# 255 255 255 numbers in a comment", "#\t# nested # hashes" };
+    const char* line_break = "\n";
+    if (gen->whitespace == WHITESPACE_CRLF)
+        line_break = "\r\n";
+    else if (gen->whitespace == WHITESPACE_MIXED)
+        line_break = breaks[generator_random(&gen->layout_state) % 3];
+    fputs(line_break, fp);
+
+    while (gen->comments > 0 && (generator_random(&gen->layout_state) >> 11) * (1.0 / 9007199254740992.0) < gen->comments) {
+        uint64_t choice = generator_random(&gen->layout_state);
+        if (choice % 8 == 7) {
+            // Longer than the loader's token buffer, comments are never buffered
+            int i;
+            fputc('#', fp);
+            for (i=0; i<IMAGE_READ_BUFFER_SIZE + 100; i++)
+                fputc('a' + i % 26, fp);
+        }
+        else {
+            fputs(comments[choice % 5], fp);
+        }
+        fputs(line_break, fp);
+        // Keep the odds of another comment below one so this always ends
+        if (gen->comments >= 1.0 && choice % 2 == 0)
+            break;
+    }
+}
+
+/**
+ * Write the whitespace between two tokens on a line
+ * @param gen
+ * @param fp
+ */
+static void generator_separator(Generator* gen, FILE* fp) {
+    static const char* runs[] = { " ", "\t", "  ", " \t ", "\t\t" };
+    switch (gen->whitespace) {
+        case WHITESPACE_SPACES:
+            fputs(&"   "[2 - generator_random(&gen->layout_state) % 3], fp);
+            break;
+        case WHITESPACE_TABS:
+            fputc('\t', fp);
+            break;
+        case WHITESPACE_MIXED:
+            if (generator_random(&gen->layout_state) % 16 == 0)
+                generator_line_break(gen, fp);
+            else
+                fputs(runs[generator_random(&gen->layout_state) % 5], fp);
+            break;
+        default:
+            fputc(' ', fp);
+            break;
+    }
+}
+
+/**
+ * The sample of a channel at a pixel, a gradient per channel with noise
+ * on top. Samples are drawn in file order.
+ * @param gen
+ * @param x
+ * @param y
+ * @param channel
+ * @return
+ */
+static uint32_t generator_sample(Generator* gen, uint32_t x, uint32_t y, int channel) {
+    double ramp;
+    if (channel == 0)
+        ramp = (x + 0.5) / gen->width;
+    else if (channel == 1)
+        ramp = (y + 0.5) / gen->height;
+    else
+        ramp = (x + y + 1.0) / ((double) gen->width + gen->height);
+    int64_t noise_range = gen->color_max / 8 + 1;
+    int64_t value = (int64_t) (ramp * gen->color_max + 0.5) +
+                    (int64_t) (generator_random(&gen->pixel_state) % (2 * noise_range + 1)) - noise_range;
+    return value < 0 ? 0 : (value > gen->color_max ? (uint32_t) gen->color_max : (uint32_t) value);
+}
+
+/**
+ * Write a generated PPM file a row at a time, so files larger than memory
+ * can be written
+ * @param gen
+ * @param fp - May be a pipe, nothing seeks or asks for the position
+ * @return
+ */
+int generator_write(Generator* gen, FILE* fp) {
+    gen->pixel_state = gen->seed * 0x9E3779B97F4A7C15ULL + 1;
+    gen->layout_state = gen->seed * 0xD1B54A32D192ED03ULL + 2;
+    int bytes_per_sample = gen->color_max < 256 ? 1 : 2;
+    unsigned char* row_bytes = NULL;
+    uint32_t x, y;
+    int c;
+
+    fprintf(fp, "P%i", gen->ppm_version);
+    generator_line_break(gen, fp);
+    fprintf(fp, "%u", gen->width);
+    generator_separator(gen, fp);
+    fprintf(fp, "%u", gen->height);
+    generator_line_break(gen, fp);
+    fprintf(fp, "%i", gen->color_max);
+
+    if (gen->ppm_version == 6) {
+        // Exactly one whitespace character comes before the samples
+        fputc(gen->whitespace == WHITESPACE_TABS ? '\t' : (gen->whitespace == WHITESPACE_SPACES ? ' ' : '\n'), fp);
+        row_bytes = malloc((size_t) gen->width * 3 * bytes_per_sample);
+        if (row_bytes == NULL) {
+            fprintf(stderr, "Error: Could not allocate memory for a row\n");
+            return 1;
+        }
+        for (y=0; y<gen->height; y++) {
+            unsigned char* dst = row_bytes;
+            for (x=0; x<gen->width; x++) {
+                for (c=0; c<3; c++) {
+                    uint32_t sample = generator_sample(gen, x, y, c);
+                    if (bytes_per_sample == 2)
+                        *dst++ = (unsigned char) (sample >> 8);
+                    *dst++ = (unsigned char) sample;
+                }
+            }
+            if (fwrite(row_bytes, 1, (size_t) (dst - row_bytes), fp) != (size_t) (dst - row_bytes))
+                break;
+        }
+        free(row_bytes);
+    }
+    else {
+        generator_line_break(gen, fp);
+        for (y=0; y<gen->height; y++) {
+            for (x=0; x<gen->width; x++) {
+                for (c=0; c<3; c++) {
+                    uint32_t sample = generator_sample(gen, x, y, c);
+                    // Mixed files sometimes pad samples with leading zeros
+                    if (gen->whitespace == WHITESPACE_MIXED && generator_random(&gen->layout_state) % 32 == 0)
+                        fprintf(fp, "%05u", sample);
+                    else
+                        fprintf(fp, "%u", sample);
+                    if (x + 1 < gen->width || c < 2)
+                        generator_separator(gen, fp);
+                }
+            }
+            // Every sample, the last one included, is followed by whitespace
+            generator_line_break(gen, fp);
+        }
+    }
+
+    if (fflush(fp) != 0 || ferror(fp)) {
+        fprintf(stderr, "Error: Could not write the generated image\n");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Write one generated file
+ * @param gen
+ * @param fname - Path of the file, - for stdout
+ * @return
+ */
+int generator_write_file(Generator* gen, const char* fname) {
+    int to_stdout = strcmp(fname, "-") == 0;
+    FILE* fp = to_stdout ? stdout : fopen(fname, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Could not open '%s' for writing\n", fname);
+        return 1;
+    }
+    setvbuf(fp, NULL, _IOFBF, 1024 * 1024);
+    if (generator_write(gen, fp) != 0) {
+        if (!to_stdout)
+            fclose(fp);
+        return 1;
+    }
+    if (to_stdout)
+        return 0;
+
+    // Only files have a position to report the size from, stdout may be a pipe
+    off_t bytes = ftello(fp);
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Error: Could not write to '%s'\n", fname);
+        return 1;
+    }
+    fprintf(stderr, "Wrote '%s', %.2f MB\n", fname, bytes / (1024.0 * 1024.0));
+    return 0;
+}
+
+/**
+ * Generate synthetic PPM files for benchmarks and loader tests, either one
+ * file or a corpus of every format, bit depth, whitespace style and
+ * comment density the loader handles
+ * @param argc - Arguments after --generate
+ * @param argv
+ * @return
+ */
+int generate_main(int argc, char* argv[]) {
+    Generator gen = { 6, 256, 256, 255, 0.0, WHITESPACE_LF, 1, 0, 0 };
+    const char* corpus = NULL;
+    const char* output = NULL;
+    int i;
+    for (i=0; i<argc; i++) {
+        if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            i++;
+            if (strcasecmp(argv[i], "p3") == 0)
+                gen.ppm_version = 3;
+            else if (strcasecmp(argv[i], "p6") == 0)
+                gen.ppm_version = 6;
+            else {
+                fprintf(stderr, "Error: Unknown output format '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%ux%u", &gen.width, &gen.height) != 2 || gen.width == 0 || gen.height == 0) {
+                fprintf(stderr, "Error: Expected a size written as WxH but got '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc) {
+            gen.color_max = atoi(argv[++i]);
+            if (gen.color_max < 1 || gen.color_max > 65535) {
+                fprintf(stderr, "Error: The maximum color value must be between 1 and 65535\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--comments") == 0 && i + 1 < argc) {
+            gen.comments = atof(argv[++i]);
+            if (gen.comments < 0 || gen.comments > 1) {
+                fprintf(stderr, "Error: The comment density must be between 0 and 1\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--whitespace") == 0 && i + 1 < argc) {
+            int style;
+            i++;
+            for (style=0; style<WHITESPACE_STYLES && strcmp(argv[i], WhitespaceNames[style]) != 0; style++);
+            if (style == WHITESPACE_STYLES) {
+                fprintf(stderr, "Error: Unknown whitespace style '%s'\n", argv[i]);
+                return 1;
+            }
+            gen.whitespace = (WhitespaceStyle) style;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            gen.seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+            corpus = argv[++i];
+        }
+        else if (strcmp(argv[i], "-") != 0 && strncmp(argv[i], "-", 1) == 0) {
+            fprintf(stderr, "Error: Unknown or incomplete option '%s'\n", argv[i]);
+            show_generate_help();
+            return 1;
+        }
+        else {
+            output = argv[i];
+        }
+    }
+    if (corpus == NULL && output == NULL) {
+        fprintf(stderr, "Error: Not enough arguments provided\n");
+        show_generate_help();
+        return 1;
     }
+    if (corpus == NULL)
+        return generator_write_file(&gen, output);
 
-    return program_id;
+    // Every format, 1 to 16 bit maximums, whitespace style and comment density
+    static const int maximums[] = { 1, 15, 255, 256, 1023, 65535 };
+    static const double densities[] = { 0.0, 0.25, 1.0 };
+    struct stat corpus_stat;
+    char fname[1024];
+    int version, m, style, d, count = 0;
+    if (stat(corpus, &corpus_stat) != 0 && mkdir(corpus, 0777) != 0) {
+        fprintf(stderr, "Error: Could not create the output directory '%s'\n", corpus);
+        return 1;
+    }
+    for (version=3; version<=6; version+=3) {
+        for (m=0; m<(int) (sizeof(maximums) / sizeof(maximums[0])); m++) {
+            for (style=0; style<WHITESPACE_STYLES; style++) {
+                for (d=0; d<(int) (sizeof(densities) / sizeof(densities[0])); d++) {
+                    gen.ppm_version = version;
+                    gen.color_max = maximums[m];
+                    gen.whitespace = (WhitespaceStyle) style;
+                    gen.comments = densities[d];
+                    snprintf(fname, sizeof fname, "%s/p%i_max%i_%s_comments%i_%ux%u.ppm", corpus, version,
+                             gen.color_max, WhitespaceNames[style], (int) (gen.comments * 100), gen.width, gen.height);
+                    if (generator_write_file(&gen, fname) != 0)
+                        return 1;
+                    count++;
+                }
+            }
+        }
+    }
+    fprintf(stderr, "Wrote %i files to '%s'\n", count, corpus);
+    return 0;
 }
 
 /**
- * Print an error that occured in GLFW
- * @param error
- * @param description
+ * Shows the usage of the benchmark mode
  */
-static void error_callback(int error, const char* description) {
-    fputs(description, stderr);
+void show_benchmark_help() {
+    printf("Usage: ezview --benchmark [options] [input.ppm ...]\n");
+    printf("\n");
+    printf("\t Options:\n");
+    printf("\t\t        --repeat <n> - Timed runs of every stage (default 5)\n");
+    printf("\t\t          --counters - Count cycles, instructions, cache and branch misses with perf_event_open\n");
+    printf("\t\t        --size <WxH> - Size of the generated P3 and P6 files used without inputs (default 2048x2048)\n");
+    printf("\t\t       --max <value> - Maximum color value of the generated files (default 255)\n");
+    printf("\n");
+    printf("\t Example: ezview --benchmark --counters --size 4000x3000\n");
 }
 
-// Define variables to hold our current Scale, Shear, Translation, and Rotation states
-float ScaleTo[] = { 1.0, 1.0 };
-float Scale[] = { 1.0, 1.0 };
-float ShearTo[] = { 0.0, 0.0 };
-float Shear[] = { 0.0, 0.0 };
-float TranslationTo[] = { 0.0, 0.0 };
-float Translation[] = { 0, 0 };
-float RotationTo = 0;
-float Rotation = 0;
+/**
+ * Forget the totals of the last stage, keeping the counters open
+ * @param counters
+ */
+void perf_counters_clear(PerfCounters* counters) {
+    memset(counters->values, 0, sizeof(counters->values));
+    counters->seconds = 0;
+    counters->runs = 0;
+}
 
 /**
- * The callback called when a key is pressed on the keyboard,
- * this should handle all user input.
- * @param window
- * @param key
- * @param scancode
- * @param action
- * @param mods
+ * Print one benchmarked stage as time per run, throughput, and every
+ * hardware count per MB processed
+ * @param stage
+ * @param counters
+ * @param mb - MB processed by each run
  */
-void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
-{
-    if (action == GLFW_PRESS)
-        switch (key) {
-            // Scale up the whole image
-            case GLFW_KEY_UP:
-                ScaleTo[0] += 0.5;
-                ScaleTo[1] += 0.5;
-                break;
-            // Scale down the whole image
-            case GLFW_KEY_DOWN:
-                ScaleTo[0] -= 0.5;
-                ScaleTo[1] -= 0.5;
-                if (ScaleTo[0] < 0)
-                    ScaleTo[0] = 0;
-                if (ScaleTo[1] < 0)
-                    ScaleTo[1] = 0;
-                break;
-            // Scale up in the Y direction
-            case GLFW_KEY_T:
-                ScaleTo[1] += 0.5;
-                break;
-            // Scale down in the Y direction
-            case GLFW_KEY_G:
-                ScaleTo[1] -= 0.5;
-                if (ScaleTo[1] < 0)
-                    ScaleTo[1] = 0;
-                break;
-            // Scale up in the X direction
-            case GLFW_KEY_H:
-                ScaleTo[0] += 0.5;
-                break;
-            // Scale down in the X direction
-            case GLFW_KEY_F:
-                ScaleTo[0] -= 0.5;
-                if (ScaleTo[0] < 0)
-                    ScaleTo[0] = 0;
-                break;
-            // Translate down in the X direction
-            case GLFW_KEY_A:
-                TranslationTo[0] -= 0.5;
-                break;
-            // Translate up in the X direction
-            case GLFW_KEY_D:
-                TranslationTo[0] += 0.5;
-                break;
-            // Translate down in the Y direction
-            case GLFW_KEY_S:
-                TranslationTo[1] -= 0.5;
-                break;
-            // Translate up in the Y direction
-            case GLFW_KEY_W:
-                TranslationTo[1] += 0.5;
-                break;
-            // Add rotation
-            case GLFW_KEY_E:
-                RotationTo += 0.1;
-                break;
-            // Subtract rotation
-            case GLFW_KEY_Q:
-                RotationTo -= 0.1;
-                break;
-            // Shear up in the X direction
-            case GLFW_KEY_J:
-                ShearTo[0] += 0.1;
-                break;
-            // Shear down in the X direction
-            case GLFW_KEY_L:
-                ShearTo[0] -= 0.1;
-                break;
-            // Shear up in the Y direction
-            case GLFW_KEY_I:
-                ShearTo[1] += 0.1;
-                break;
-            // Shear down in the Y direction
-            case GLFW_KEY_K:
-                ShearTo[1] -= 0.1;
-                break;
-            // Reset all values to their original
-            case GLFW_KEY_R:
-                ScaleTo[0] = 1.0;
-                ScaleTo[1] = 1.0;
-                ShearTo[0] = 0.0;
-                ShearTo[1] = 0.0;
-                TranslationTo[0] = 0.0;
-                TranslationTo[1] = 0.0;
-                RotationTo = 0;
-                break;
+void benchmark_print(const char* stage, const PerfCounters* counters, double mb) {
+    double runs = counters->runs > 0 ? counters->runs : 1;
+    double total_mb = mb * runs;
+    int i;
+    printf("  %-10s %10.2f %10.1f", stage, counters->seconds / runs * 1e3,
+           counters->seconds > 0 ? total_mb / counters->seconds : 0);
+    for (i=0; i<PERF_COUNTER_KINDS; i++) {
+        if (counters->fds[i] < 0)
+            printf(" %14s", "-");
+        else
+            printf(" %14.0f", counters->values[i] / total_mb);
+        if (i == PERF_INSTRUCTIONS) {
+            if (counters->fds[PERF_CYCLES] < 0 || counters->fds[PERF_INSTRUCTIONS] < 0 || counters->values[PERF_CYCLES] == 0)
+                printf(" %6s", "-");
+            else
+                printf(" %6.2f", counters->values[PERF_INSTRUCTIONS] / (double) counters->values[PERF_CYCLES]);
         }
+    }
+    printf("\n");
 }
 
 /**
- * The callback called when the mouse is scrolled
- * @param window
- * @param xoffset
- * @param yoffset
+ * Measure decoding and uploading PPM files. Every file is loaded once to
+ * bring it into the page cache, then decoded and uploaded repeat times with
+ * the time, and optionally hardware counters, summed over the runs. Decoding
+ * is reported per MB of the file and uploads per MB of the host copy. Without
+ * inputs a P3 and a P6 file are generated to measure.
+ * @param argc - Arguments after --benchmark
+ * @param argv
+ * @return
  */
-void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
-{
-    // Scale the image by some portion of the amount scrolled in the Y direction
-    ScaleTo[0] += yoffset * 0.5;
-    ScaleTo[1] += yoffset * 0.5;
+int benchmark_main(int argc, char* argv[]) {
+    Generator gen = { 6, 2048, 2048, 255, 0.0, WHITESPACE_LF, 1, 0, 0 };
+    int repeat = 5;
+    int hardware = FALSE;
+    char** inputs = malloc(sizeof(char*) * (argc + 2));
+    int input_count = 0;
+    char generated[2][64];
+    int generated_count = 0;
+    int i, r;
+    for (i=0; i<argc; i++) {
+        if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+            if (repeat < 1) {
+                fprintf(stderr, "Error: At least one run is needed\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--counters") == 0) {
+            hardware = TRUE;
+        }
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%ux%u", &gen.width, &gen.height) != 2 || gen.width == 0 || gen.height == 0) {
+                fprintf(stderr, "Error: Expected a size written as WxH but got '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc) {
+            gen.color_max = atoi(argv[++i]);
+            if (gen.color_max < 1 || gen.color_max > 65535) {
+                fprintf(stderr, "Error: The maximum color value must be between 1 and 65535\n");
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "-", 1) == 0) {
+            fprintf(stderr, "Error: Unknown or incomplete option '%s'\n", argv[i]);
+            show_benchmark_help();
+            return 1;
+        }
+        else {
+            inputs[input_count++] = argv[i];
+        }
+    }
+
+    // Counters are inherited by threads created later, so open them before the worker pool exists
+    PerfCounters counters;
+    perf_counters_open(&counters, hardware);
+
+    // Without inputs measure one generated file of each format
+    if (input_count == 0) {
+        for (gen.ppm_version=3; gen.ppm_version<=6; gen.ppm_version+=3) {
+            snprintf(generated[generated_count], sizeof generated[0], "/tmp/ezview-benchmark-XXXXXX");
+            int fd = mkstemp(generated[generated_count]);
+            if (fd < 0) {
+                fprintf(stderr, "Error: Could not create a temporary file to benchmark\n");
+                return 1;
+            }
+            close(fd);
+            inputs[input_count++] = generated[generated_count++];
+            if (generator_write_file(&gen, generated[generated_count - 1]) != 0)
+                return 1;
+        }
+    }
+
+    // Uploads need a context, a hidden window is enough
+    glfwSetErrorCallback(error_callback);
+    if (glfwInit()) {
+        glfwDefaultWindowHints();
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        window = glfwCreateWindow(64, 64, "ezview benchmark", NULL, NULL);
+        if (window != NULL)
+            glfwMakeContextCurrent(window);
+    }
+    if (window == NULL)
+        fprintf(stderr, "Texture uploads are not measured without a window\n");
+
+    int result = 0;
+    for (i=0; i<input_count && result == 0; i++) {
+        Image image;
+        LoadOptions options = { 0, NULL, FALSE, PIXEL_FORMAT_U16, NULL, NULL, NULL, 0, NULL, 0 };
+        struct stat file_stat;
+        char magic[3] = { 0 };
+        FILE* fp = fopen(inputs[i], "rb");
+        if (fp == NULL || stat(inputs[i], &file_stat) != 0 || fread(magic, 1, 2, fp) != 2) {
+            fprintf(stderr, ERR_OPEN_FILE_READING, inputs[i]);
+            if (fp != NULL)
+                fclose(fp);
+            result = 1;
+            break;
+        }
+        fclose(fp);
+
+        // The untimed load warms the page cache and the worker pool
+        if (load_image(&image, inputs[i], &options) != 0) {
+            result = 1;
+            break;
+        }
+        double file_mb = file_stat.st_size / (1024.0 * 1024.0);
+        printf("%s: %s %ux%u, maximum %i, %.2f MB, %i runs\n", inputs[i], magic, image.width, image.height,
+               image.color_max, file_mb, repeat);
+        printf("  %-10s %10s %10s %14s %14s %6s %14s %14s\n", "stage", "ms/run", "MB/s",
+               "cycles/MB", "instr/MB", "IPC", "cache miss/MB", "branch miss/MB");
+
+        perf_counters_clear(&counters);
+        options.counters = &counters;
+        for (r=0; r<repeat && result == 0; r++) {
+            image_free(&image);
+            result = load_image(&image, inputs[i], &options);
+        }
+        if (result != 0)
+            break;
+        benchmark_print(strcmp(magic, "P3") == 0 ? "decode p3" : "decode p6", &counters, file_mb);
+
+        // glFinish makes the driver's copy part of each upload
+        if (window != NULL) {
+            GLuint texture;
+            size_t sample_bytes = image.format == PIXEL_FORMAT_FLOAT ? sizeof(float) : sizeof(uint16_t);
+            double image_mb = (double) image.width * image.height * 3 * sample_bytes / (1024.0 * 1024.0);
+            glGenTextures(1, &texture);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            image_upload_texture(&image);
+            glFinish();
+            perf_counters_clear(&counters);
+            for (r=0; r<repeat; r++) {
+                perf_counters_start(&counters);
+                image_upload_texture(&image);
+                glFinish();
+                perf_counters_stop(&counters);
+            }
+            benchmark_print("upload", &counters, image_mb);
+            glDeleteTextures(1, &texture);
+        }
+        image_free(&image);
+    }
 
-    if (ScaleTo[0] < 0)
-        ScaleTo[0] = 0;
-    if (ScaleTo[1] < 0)
-        ScaleTo[1] = 0;
+    for (i=0; i<generated_count; i++)
+        unlink(generated[i]);
+    if (window != NULL)
+        glfwDestroyWindow(window);
+    glfwTerminate();
+    perf_counters_close(&counters);
+    free(inputs);
+    return result;
 }
 
 /**
- * Tween from a current value to a new value. This function supports arrays of
- * values by specifying how many entries are in the input value sets.
- * @param currentValues The current values that are being tweened
- * @param newValues The new destination values that should be achieved at the end of the tweening
- * @param totalEntries The total number of entries in the input set (currentValues and newValues should have the same length)
+ * Parse a pair of numbers written as x,y into two transform channels
+ * @param arg
+ * @param channel - The first of the two channels
+ * @return
  */
-void tween(float *currentValues, float *newValues, int totalEntries)
-{
-    for (totalEntries--; totalEntries >= 0; totalEntries--)
-        currentValues[totalEntries] += (newValues[totalEntries] - currentValues[totalEntries]) * 0.1;
+int parse_transform_pair(const char* arg, int channel) {
+    if (sscanf(arg, "%f,%f", &TransformTo[channel], &TransformTo[channel + 1]) != 2) {
+        fprintf(stderr, "Error: Expected two numbers written as x,y but got '%s'\n", arg);
+        return 1;
+    }
+    return 0;
 }
 
 /**
  * The main enchilada, do all the things!
  */
 int main (int argc, char *argv[]) {
+    double main_started = monotonic_seconds();
+    StartupSeconds[STARTUP_PROCESS] = process_age_seconds();
+
+    // Run as the batch converter when called as ezconvert or with --convert, the corpus generator, or the benchmark
+    const char* program = strrchr(argv[0], '/');
+    program = program != NULL ? program + 1 : argv[0];
+    if (strcmp(program, "ezconvert") == 0)
+        return convert_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "--convert") == 0)
+        return convert_main(argc - 2, argv + 2);
+    if (argc > 1 && strcmp(argv[1], "--generate") == 0)
+        return generate_main(argc - 2, argv + 2);
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+        return benchmark_main(argc - 2, argv + 2);
+
+    // Split the arguments into options and input files
+    char **inputs = malloc(sizeof(char*) * argc);
+    int input_count = 0;
+    int histogram_bins = 256;
+    int print_stats = FALSE;
+    int memory_stats = FALSE;
+    int compress = FALSE;
+    int first_frame = FALSE;
+    PixelFormat pixel_format = PIXEL_FORMAT_U16;
+    Filter filters[FILTER_MAX];
+    int filter_count = 0;
+    int roi_mode = FALSE;
+    int tile_cache_mb = 0;
+    ResidencyPolicy residency_policy = RESIDENCY_KEEP;
+    char* export_fname = NULL;
+    int i;
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--easing") == 0 && i + 1 < argc) {
+            if (easing_from_name(argv[++i], &TransformAnimator.easing) != 0)
+                return 1;
+        }
+        else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            TransformAnimator.duration = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--histogram") == 0 && i + 1 < argc) {
+            histogram_bins = atoi(argv[++i]);
+            if (histogram_bins != 256 && histogram_bins != 4096) {
+                fprintf(stderr, "Error: The histogram must have 256 or 4096 bins\n");
+                return 1;
+            }
+            print_stats = TRUE;
+        }
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "float") == 0)
+                pixel_format = PIXEL_FORMAT_FLOAT;
+            else if (strcmp(argv[i], "native") == 0)
+                pixel_format = PIXEL_FORMAT_U16;
+            else if (strcmp(argv[i], "half") == 0)
+                pixel_format = PIXEL_FORMAT_HALF;
+            else {
+                fprintf(stderr, "Error: Unknown pixel format '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            if (filter_count == FILTER_MAX) {
+                fprintf(stderr, "Error: At most %i filters can be applied\n", FILTER_MAX);
+                return 1;
+            }
+            if (filter_parse(argv[++i], &filters[filter_count++]) != 0)
+                return 1;
+        }
+        else if (strcmp(argv[i], "--residency") == 0 && i + 1 < argc) {
+            if (residency_policy_from_name(argv[++i], &residency_policy) != 0)
+                return 1;
+        }
+        else if (strcmp(argv[i], "--compress") == 0) {
+            compress = TRUE;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            memory_stats = TRUE;
+        }
+        else if (strcmp(argv[i], "--first-frame") == 0) {
+            first_frame = TRUE;
+        }
+        else if (strcmp(argv[i], "--verbose") == 0) {
+            Verbose = TRUE;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_start(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--roi") == 0) {
+            roi_mode = TRUE;
+        }
+        else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc) {
+            tile_cache_mb = atoi(argv[++i]);
+            if (tile_cache_mb <= 0) {
+                fprintf(stderr, "Error: The tile cache needs at least 1 MB\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            if (parse_transform_pair(argv[++i], CHANNEL_SCALE_X) != 0)
+                return 1;
+        }
+        else if (strcmp(argv[i], "--shear") == 0 && i + 1 < argc) {
+            if (parse_transform_pair(argv[++i], CHANNEL_SHEAR_X) != 0)
+                return 1;
+        }
+        else if (strcmp(argv[i], "--translate") == 0 && i + 1 < argc) {
+            if (parse_transform_pair(argv[++i], CHANNEL_TRANSLATION_X) != 0)
+                return 1;
+        }
+        else if (strcmp(argv[i], "--rotate") == 0 && i + 1 < argc) {
+            TransformTo[CHANNEL_ROTATION] = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_fname = argv[++i];
+        }
+        else if (strcmp(argv[i], "--srgb") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "texture") == 0)
+                CurrentSrgbMode = SRGB_TEXTURE;
+            else if (strcmp(argv[i], "decode") == 0)
+                CurrentSrgbMode = SRGB_DECODE;
+            else {
+                fprintf(stderr, "Error: Unknown sRGB mode '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Error: Unknown or incomplete option '%s'\n", argv[i]);
+            show_help();
+            return 1;
+        }
+        else {
+            inputs[input_count++] = argv[i];
+        }
+    }
+
     // Check input arguments
-    if (argc != 2) {
+    if (input_count < 1) {
         fprintf(stderr, "Error: Not enough arguments provided\n");
         show_help();
         return 1;
     }
 
     // Capture filename to load
-    char *inputFname = argv[1];
+    char *inputFname = inputs[0];
+
+    // A directory or several files are shown as a contact sheet
+    ContactSheet sheet;
+    int sheet_mode = FALSE;
+    struct stat input_stat;
+    memset(&sheet, 0, sizeof(ContactSheet));
+    if (input_count > 1 || (stat(inputFname, &input_stat) == 0 && S_ISDIR(input_stat.st_mode))) {
+        sheet_mode = TRUE;
+        for (i=0; i<input_count; i++) {
+            int result;
+            if (stat(inputs[i], &input_stat) == 0 && S_ISDIR(input_stat.st_mode))
+                result = contact_sheet_add_directory(&sheet, inputs[i]);
+            else
+                result = contact_sheet_add(&sheet, inputs[i]);
+            if (result != 0)
+                exit(1);
+        }
+        if (sheet.count == 0) {
+            fprintf(stderr, "Error: No PPM files found\n");
+            exit(1);
+        }
+    }
+    if (sheet_mode && first_frame) {
+        fprintf(stderr, "Error: The time to first frame is only measured for a single image\n");
+        exit(1);
+    }
+
+    // An sRGB texture linearizes before the shader could rescale raw samples
+    if (CurrentSrgbMode == SRGB_TEXTURE && pixel_format == PIXEL_FORMAT_U16)
+        pixel_format = PIXEL_FORMAT_FLOAT;
+
+    // The viewer starts out showing the transform given on the command line
+    memcpy(Transform, TransformTo, sizeof(Transform));
+
+    // Filters and exports need the whole image, tiles already read only what is shown
+    if (tile_cache_mb > 0)
+        roi_mode = FALSE;
+    if ((roi_mode || tile_cache_mb > 0) && export_fname != NULL) {
+        roi_mode = FALSE;
+        tile_cache_mb = 0;
+    }
+    if (roi_mode && filter_count > 0) {
+        fprintf(stderr, "Region of interest decoding is not used when filtering\n");
+        roi_mode = FALSE;
+    }
+    if (tile_cache_mb > 0 && filter_count > 0) {
+        fprintf(stderr, "Tiled storage is not used when filtering\n");
+        tile_cache_mb = 0;
+    }
 
-    // Attempt to load the specified image
+    // Attempt to load the specified image, P6 files are only read as they are shown with --roi or --tiles
     Image image;
-    if (load_image(&image, inputFname) != 0) {
+    RoiDecoder roi;
+    TileStore tiles;
+    memset(&roi, 0, sizeof(RoiDecoder));
+    memset(&tiles, 0, sizeof(TileStore));
+    roi.fd = -1;
+    tiles.fd = -1;
+    LoadOptions load_options = { histogram_bins, &CurrentStats, CurrentSrgbMode == SRGB_DECODE, pixel_format,
+                                 roi_mode ? &roi : NULL, NULL, tile_cache_mb > 0 ? &tiles : NULL,
+                                 (size_t) tile_cache_mb * 1024 * 1024, NULL, 0 };
+    AllocationStats before_load = Allocations;
+    double stage_started = monotonic_seconds();
+    if (!sheet_mode && load_image(&image, inputFname, &load_options) != 0) {
         fprintf(stderr, "An error occurred loading the specified source file.\n");
         exit(1);
     }
+    StartupSeconds[STARTUP_LOAD] = monotonic_seconds() - stage_started;
+    LoadAllocations.count = Allocations.count - before_load.count;
+    LoadAllocations.bytes = Allocations.bytes - before_load.bytes;
+    if (!sheet_mode && print_stats && CurrentStats.bins > 0)
+        image_stats_print(&CurrentStats, stdout);
+
+    // Filters run on the decoded image before it is uploaded
+    for (i=0; !sheet_mode && i<filter_count; i++) {
+        if (image_apply_filter(&image, &filters[i]) != 0) {
+            fprintf(stderr, "An error occurred filtering the specified source file.\n");
+            exit(1);
+        }
+    }
+
+    // Exports are written without ever opening a window
+    if (export_fname != NULL) {
+        if (sheet_mode) {
+            fprintf(stderr, "Error: Only a single image can be exported\n");
+            exit(1);
+        }
+        int result = image_export(&image, TransformTo, export_fname, load_options.linearize);
+        if (memory_stats)
+            memory_stats_print(&image, NULL, NULL, 0, stdout);
+        exit(result == 0 ? EXIT_SUCCESS : 1);
+    }
 
     // Define GLFW variables
     GLint program_id;
-    GLuint color_slot;
-    GLuint position_slot;
-    GLuint texcoord_slot;
-    GLuint scale_slot;
-    GLuint translation_slot;
-    GLuint rotation_slot;
-    GLuint shear_slot;
+    ShaderSlots slots;
     GLuint vertex_buffer;
     GLuint index_buffer;
     GLuint tex;
@@ -735,8 +7359,10 @@ int main (int argc, char *argv[]) {
     glfwSetErrorCallback(error_callback);
 
     // Initialize GLFW library
+    stage_started = monotonic_seconds();
     if (!glfwInit())
         return -1;
+    StartupSeconds[STARTUP_GLFW_INIT] = monotonic_seconds() - stage_started;
 
     // Setup GLFW window
     glfwDefaultWindowHints();
@@ -745,9 +7371,13 @@ int main (int argc, char *argv[]) {
 
     // Create a fancy window name that has the name of the file being displayed
     char windowName[128];
-    snprintf(windowName, sizeof windowName, "ezview - '%s'", inputFname);
+    if (sheet_mode)
+        snprintf(windowName, sizeof windowName, "ezview - contact sheet (%i images)", sheet.count);
+    else
+        snprintf(windowName, sizeof windowName, "ezview - '%s'", inputFname);
 
     // Create and open a window
+    stage_started = monotonic_seconds();
     window = glfwCreateWindow(640,
                               480,
                               windowName,
@@ -762,22 +7392,31 @@ int main (int argc, char *argv[]) {
     }
 
     glfwMakeContextCurrent(window);
+    StartupSeconds[STARTUP_WINDOW] = monotonic_seconds() - stage_started;
+
+    // sRGB textures need OpenGL 2.1 or EXT_texture_sRGB, otherwise fall back to decoding
+    if (CurrentSrgbMode == SRGB_TEXTURE &&
+        glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MINOR) < 1 &&
+        glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR) < 3 &&
+        !glfwExtensionSupported("GL_EXT_texture_sRGB")) {
+        fprintf(stderr, "sRGB textures are not supported, showing the image in gamma space\n");
+        CurrentSrgbMode = SRGB_OFF;
+    }
+
+    // Block compression needs S3TC, otherwise textures are uploaded as they are
+    if (compress && glfwExtensionSupported("GL_EXT_texture_compression_s3tc"))
+        TextureCompression = TRUE;
+    else if (compress)
+        fprintf(stderr, "S3TC textures are not supported, uploading uncompressed textures\n");
 
+    stage_started = monotonic_seconds();
     program_id = simple_program();
+    StartupSeconds[STARTUP_PROGRAM] = monotonic_seconds() - stage_started;
 
     glUseProgram(program_id);
 
     // Configure all the shader slots
-    position_slot = glGetAttribLocation(program_id, "Position");
-    color_slot = glGetAttribLocation(program_id, "SourceColor");
-    texcoord_slot = glGetAttribLocation(program_id, "SourceTexcoord");
-    scale_slot = glGetUniformLocation(program_id, "Scale");
-    translation_slot = glGetUniformLocation(program_id, "Translation");
-    rotation_slot = glGetUniformLocation(program_id, "Rotation");
-    shear_slot = glGetUniformLocation(program_id, "Shear");
-    glEnableVertexAttribArray(position_slot);
-    glEnableVertexAttribArray(color_slot);
-    glEnableVertexAttribArray(texcoord_slot);
+    shader_slots_init(program_id, &slots);
 
     // Create Buffer
     glGenBuffers(1, &vertex_buffer);
@@ -785,76 +7424,170 @@ int main (int argc, char *argv[]) {
     // Map GL_ARRAY_BUFFER to this buffer
     glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
 
-    // Send the data
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertices), Vertices, GL_STATIC_DRAW);
-
     glGenBuffers(1, &index_buffer);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Indices), Indices, GL_STATIC_DRAW);
 
     int bufferWidth, bufferHeight;
     glfwGetFramebufferSize(window, &bufferWidth, &bufferHeight);
 
-    // Configure the texture
-    glGenTextures(1, &tex);
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.pixmap);
-
-    glVertexAttribPointer(position_slot,
-                          3,
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Vertex),
-                          0);
-
-    glVertexAttribPointer(color_slot,
-                          4,
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Vertex),
-                          (GLvoid*) (sizeof(float) * 3));
-
-    glVertexAttribPointer(texcoord_slot,
-                          2,
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Vertex),
-                          (GLvoid*) (sizeof(float) * 7));
+    shader_slots_bind_vertices(&slots);
 
     // Setup callbacks for events
     glfwSetKeyCallback(window, key_callback);
     glfwSetScrollCallback(window, scroll_callback);
 
-    // Repeat
-    while (!glfwWindowShouldClose(window)) {
+    if (sheet_mode) {
+        // Thumbnails stream into the atlases while the sheet is being shown
+        sheet.options.linearize = CurrentSrgbMode == SRGB_DECODE;
+        if (contact_sheet_start(&sheet) != 0)
+            exit(1);
+        contact_sheet_run(&sheet, &slots, bufferWidth, bufferHeight);
+        if (memory_stats) {
+            LoadAllocations = Allocations;
+            memory_stats_print(NULL, NULL, sheet.atlases, sheet.atlas_count, stdout);
+        }
+        contact_sheet_destroy(&sheet);
+    }
+    else {
+        // Send the data
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Vertices), Vertices, GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Indices), Indices, GL_STATIC_DRAW);
 
-        // Tween values
-        tween(Scale, ScaleTo, 2);
-        tween(Translation, TranslationTo, 2);
-        tween(Shear, ShearTo, 2);
-        tween(&Rotation, &RotationTo, 1);
+        // Configure the texture
+        glGenTextures(1, &tex);
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        GLint max_texture_size;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+        if (tiles.fd < 0 && ((GLint) image.width > max_texture_size || (GLint) image.height > max_texture_size))
+            fprintf(stderr, "The image is larger than the largest texture (%i pixels), try --tiles\n", max_texture_size);
 
-        // Send updated values to the shader
-        glUniform2f(scale_slot, Scale[0], Scale[1]);
-        glUniform2f(translation_slot, Translation[0], Translation[1]);
-        glUniform2f(shear_slot, Shear[0], Shear[1]);
-        glUniform1f(rotation_slot, Rotation);
+        // A tiled image only ever has the part in view uploaded
+        Image tile_view;
+        int tile_view_shown = FALSE;
+        float tile_view_transform[CHANNEL_COUNT];
+        memset(&tile_view, 0, sizeof(Image));
+        stage_started = monotonic_seconds();
+        if (roi.fd >= 0)
+            image_reserve_texture(&image);
+        else if (tiles.fd < 0)
+            image_upload_texture(&image);
+        StartupSeconds[STARTUP_UPLOAD] = monotonic_seconds() - stage_started;
 
-        // Clear the screen
-        glClearColor(0, 0.0, 0.0, 1.0);
-        glClear(GL_COLOR_BUFFER_BIT);
+        // The host copy is only needed again for exports, the inspector, and zoom levels
+        Residency residency;
+        int managed = roi.fd < 0 && tiles.fd < 0 && residency_policy != RESIDENCY_KEEP;
+        if (residency_policy != RESIDENCY_KEEP && !managed)
+            fprintf(stderr, "The host copy is kept for region of interest decoding and tiled images\n");
+        residency_init(&residency, managed ? residency_policy : RESIDENCY_KEEP, &image, inputFname,
+                       &load_options, filters, filter_count);
+        residency_evict(&residency);
 
-        glViewport(0, 0, bufferWidth, bufferHeight);
+        // Downscaled levels are built in the background when zoomed out
+        ZoomCache zoom;
+        zoom_cache_init(&zoom, &image, tex);
+        zoom.residency = &residency;
 
-        // Draw everything
-        glDrawElements(GL_TRIANGLES,
-                       sizeof(Indices) / sizeof(GLubyte),
-                       GL_UNSIGNED_BYTE, 0);
+        // Show the pixel under the cursor in the title
+        CurrentInspector.image = &image;
+        CurrentInspector.tiles = tiles.fd >= 0 ? &tiles : NULL;
+        CurrentInspector.residency = &residency;
+        CurrentInspector.title = windowName;
+        glfwSetCursorPosCallback(window, cursor_callback);
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        // Repeat
+        int64_t frame = 0;
+        while (!glfwWindowShouldClose(window)) {
+            double span = trace_begin();
+
+            // Animate values and send them to the shader
+            int animating = update_transform(&slots);
+
+            // Levels are resampled from the whole image, so they wait until a partial decode is done
+            int whole = roi.fd < 0 && tiles.fd < 0;
+            zoom_cache_update(&zoom, whole ? zoom_cache_level(&zoom, bufferWidth, bufferHeight) : 0, !animating);
+
+            // Tiled images are resampled for the new view once the transform settles
+            if (tiles.fd >= 0 && !animating &&
+                (!tile_view_shown || memcmp(tile_view_transform, Transform, sizeof(Transform)) != 0)) {
+                if (tile_view_update(&tiles, &image, &tile_view, bufferWidth, bufferHeight) != 0)
+                    exit(1);
+                memcpy(tile_view_transform, Transform, sizeof(Transform));
+                tile_view_shown = TRUE;
+            }
+
+            // Decode and upload whatever part of the image just came into view
+            uint32_t visible[4];
+            uint32_t dirty[4];
+            if (roi.fd >= 0 && transform_visible_rect(Transform, &image, ROI_MARGIN, visible)) {
+                int blocks = roi_decode(&roi, visible, dirty);
+                if (blocks < 0)
+                    exit(1);
+                if (blocks > 0)
+                    image_upload_region(&image, dirty);
+            }
+            update_adjustments(&slots);
+
+            // The image moves under a still cursor while the transform animates
+            if (animating)
+                inspector_update(window);
+
+            // Exports need every block of a partially decoded image
+            if (ExportRequested) {
+                uint32_t all[4] = { 0, 0, image.width, image.height };
+                ExportRequested = FALSE;
+                int blocks = roi.fd >= 0 ? roi_decode(&roi, all, dirty) : 0;
+                if (blocks > 0)
+                    image_upload_region(&image, dirty);
+                if (blocks < 0)
+                    fprintf(stderr, "The image could not be decoded completely, nothing was exported\n");
+                else if (tiles.fd >= 0)
+                    fprintf(stderr, "Tiled images can not be exported from the viewer\n");
+                else if (residency_acquire(&residency) == 0) {
+                    export_current_view(&image, load_options.linearize);
+                    residency_release(&residency);
+                }
+            }
+            if (MemoryStatsRequested) {
+                GLuint textures[ZOOM_MAX_LEVELS];
+                MemoryStatsRequested = FALSE;
+                memory_stats_print(&image, CurrentInspector.tiles, textures, zoom_cache_textures(&zoom, textures), stdout);
+            }
+
+            // Clear the screen
+            glClearColor(0, 0.0, 0.0, 1.0);
+            glClear(GL_COLOR_BUFFER_BIT);
+
+            glViewport(0, 0, bufferWidth, bufferHeight);
+
+            // Draw everything
+            glDrawElements(GL_TRIANGLES,
+                           sizeof(Indices) / sizeof(GLubyte),
+                           GL_UNSIGNED_BYTE, 0);
+
+            stage_started = monotonic_seconds();
+            glfwSwapBuffers(window);
+            trace_end_arg("frame", span, frame++);
+
+            // Measuring startup ends with the first frame
+            if (first_frame) {
+                StartupSeconds[STARTUP_SWAP] = monotonic_seconds() - stage_started;
+                startup_print(monotonic_seconds() - main_started, stdout);
+                break;
+            }
+
+            // Wake up in time to evict a host copy that has gone idle
+            wait_for_events(animating, residency_idle(&residency));
+        }
+        if (memory_stats) {
+            GLuint textures[ZOOM_MAX_LEVELS];
+            memory_stats_print(&image, CurrentInspector.tiles, textures, zoom_cache_textures(&zoom, textures), stdout);
+        }
+        zoom_cache_destroy(&zoom);
+        residency_destroy(&residency);
+        if (tiles.fd >= 0)
+            tile_store_close(&tiles);
     }
 
     // Finished, close everything up